@@ -0,0 +1,285 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "benchmark/benchmark.h"
+
+#include "nbbt/Buffer.h"
+#include "nbbt/allocation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Count heap allocations of the whole process.
+
+#ifdef NBBT_ALLOCATION_AUDIT
+
+// operator new is already replaced by the library, which counts per thread.
+static size_t allocations()
+{
+    nbbt::AllocationStats stats;
+    nbbt::allocation_stats(stats);
+    return stats.allocations;
+}
+
+#else
+
+static std::atomic<size_t> g_allocations(0);
+
+void* operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+static size_t allocations()
+{
+    return g_allocations.load();
+}
+
+#endif // NBBT_ALLOCATION_AUDIT
+
+struct AllocationCounter
+{
+    AllocationCounter() : start(allocations()) {}
+
+    void report(benchmark::State& state)
+    {
+        state.counters["allocs/op"] = benchmark::Counter(
+                    static_cast<double>(allocations() - start), benchmark::Counter::kAvgIterations);
+    }
+
+    size_t start;
+};
+
+//------------------------------------------------------------------------------
+// Arguments: chunksize (log2), message size, fragmentation
+
+enum Fragmentation
+{
+    ALIGNED = 0,    // message starts at the beginning of a chunk
+    STRADDLING = 1, // message crosses a chunk boundary
+};
+
+static void arguments(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({ "chunk", "msg", "frag" });
+    b->ArgsProduct({ { 8, 10, 12, 14, 16 }, { 16, 256, 4096, 65536 }, { ALIGNED, STRADDLING } });
+}
+
+/**
+ * Move the write position of an empty buffer to where the next message has
+ * given fragmentation.
+ *
+ * An emptied buffer starts over at its first chunk, so one byte is left in
+ * front of that position. The benchmarks never empty the buffer: they drop the
+ * byte once data follows it, or keep the last byte of what they remove.
+ */
+static void position(nbbt::Buffer& buffer, size_t chunksize, size_t msg, int fragmentation)
+{
+    size_t chunk = size_t(1) << chunksize;
+    size_t skip = chunk;
+    if (STRADDLING == fragmentation) {
+        skip = chunk - std::min(msg, chunk) / 2;
+    }
+
+    std::vector<unsigned char> fill(skip);
+    buffer.append(fill.data(), fill.size());
+    buffer.remove(fill.size() - 1);
+}
+
+// amount of data kept in a buffer by the benchmarks that need a filled buffer
+static size_t const c_fill = 1 << 20;
+
+//------------------------------------------------------------------------------
+
+static void BM_Append(benchmark::State& state)
+{
+    size_t chunksize = state.range(0);
+    size_t msg = state.range(1);
+
+    nbbt::Buffer buffer(INVALID_SOCKET, chunksize);
+    position(buffer, chunksize, msg, state.range(2));
+    std::vector<unsigned char> data(msg, 'x');
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        buffer.append(data.data(), msg);
+
+        // keep the buffer size bounded, the amortized cost is negligible
+        if (buffer.available() >= c_fill) {
+            buffer.remove(buffer.available() - 1);
+        }
+    }
+
+    allocations.report(state);
+    state.SetBytesProcessed(state.iterations() * msg);
+}
+BENCHMARK(BM_Append)->Apply(arguments);
+
+//------------------------------------------------------------------------------
+
+static void BM_Memcpy(benchmark::State& state)
+{
+    size_t chunksize = state.range(0);
+    size_t msg = state.range(1);
+
+    nbbt::Buffer buffer(INVALID_SOCKET, chunksize);
+    position(buffer, chunksize, msg, state.range(2));
+    std::vector<unsigned char> data(msg, 'x');
+    buffer.append(data.data(), msg);
+    buffer.remove(1);
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        buffer.memcpy(data.data(), msg);
+        benchmark::DoNotOptimize(data.data());
+        benchmark::ClobberMemory();
+    }
+
+    allocations.report(state);
+    state.SetBytesProcessed(state.iterations() * msg);
+}
+BENCHMARK(BM_Memcpy)->Apply(arguments);
+
+//------------------------------------------------------------------------------
+
+static void BM_Remove(benchmark::State& state)
+{
+    size_t chunksize = state.range(0);
+    size_t msg = state.range(1);
+
+    nbbt::Buffer buffer(INVALID_SOCKET, chunksize);
+    position(buffer, chunksize, msg, state.range(2));
+    std::vector<unsigned char> data(c_fill, 'x');
+    buffer.append(data.data(), data.size());
+    buffer.remove(1);
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        if (buffer.available() <= msg) {
+            state.PauseTiming();
+            buffer.append(data.data(), data.size());
+            state.ResumeTiming();
+        }
+        buffer.remove(msg);
+    }
+
+    allocations.report(state);
+    state.SetBytesProcessed(state.iterations() * msg);
+}
+BENCHMARK(BM_Remove)->Apply(arguments);
+
+//------------------------------------------------------------------------------
+
+static void BM_GetString(benchmark::State& state)
+{
+    size_t chunksize = state.range(0);
+    size_t msg = state.range(1);
+
+    nbbt::Buffer buffer(INVALID_SOCKET, chunksize);
+    position(buffer, chunksize, msg, state.range(2));
+    std::vector<unsigned char> data(msg, 'x');
+    data.back() = '\0';
+    buffer.append(data.data(), msg);
+    buffer.remove(1);
+
+    std::string string;
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        buffer.get_string(string, false);
+        benchmark::DoNotOptimize(string.data());
+    }
+
+    allocations.report(state);
+    state.SetBytesProcessed(state.iterations() * msg);
+}
+BENCHMARK(BM_GetString)->Apply(arguments);
+
+//------------------------------------------------------------------------------
+
+static void BM_Flush(benchmark::State& state)
+{
+    size_t chunksize = state.range(0);
+    size_t msg = state.range(1);
+
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        state.SkipWithError("socketpair() failed");
+        return;
+    }
+
+    // drain the other end of the socket pair concurrently
+    std::thread reader([&fds] {
+        char scratch[65536];
+        while (::read(fds[1], scratch, sizeof(scratch)) > 0);
+    });
+
+    nbbt::Buffer buffer(fds[0], chunksize);
+    position(buffer, chunksize, msg, state.range(2));
+    std::vector<unsigned char> data(msg, 'x');
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        // the last byte of the previous message is dropped, this one's is kept
+        buffer.append(data.data(), msg);
+        buffer.remove(1);
+        while (buffer.available() > 1) {
+            if (buffer.flush(buffer.available() - 1) != 1) {
+                state.SkipWithError("flush() failed");
+                break;
+            }
+        }
+    }
+
+    allocations.report(state);
+    state.SetBytesProcessed(state.iterations() * msg);
+
+    ::shutdown(fds[0], SHUT_RDWR);
+    reader.join();
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+BENCHMARK(BM_Flush)->Apply(arguments);
@@ -0,0 +1,423 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * End-to-end benchmark over loopback or a unix socket.
+ *
+ * Starts an echo or request/response Server and drives it with a number of
+ * client connections that each keep a configurable number of requests in
+ * flight. Reports messages per second, throughput and the round trip latency
+ * percentiles.
+ *
+ * Every request is framed as [uint32 length][uint64 send time][payload]. The
+ * echo server returns the byte stream as is, the request/response server
+ * parses the frames and answers each with a frame of --response bytes that
+ * carries the send time of the request.
+ */
+
+#include "nbbt/Buffer.h"
+#include "nbbt/Server.h"
+#include "nbbt/histogram.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+struct Options
+{
+    bool echo = true;           // --mode=echo|rr
+    int port = 55600;           // --port=N
+    std::string unix_path;      // --unix=PATH
+    int connections = 16;       // --connections=N
+    size_t size = 64;           // --size=BYTES (request payload)
+    size_t response = 64;       // --response=BYTES (rr mode)
+    int pipeline = 1;           // --pipeline=N requests in flight per connection
+    int server_threads = 1;     // --server-threads=N
+    int client_threads = 1;     // --client-threads=N
+    int warmup = 1;             // --warmup=SECONDS
+    int duration = 5;           // --duration=SECONDS
+};
+
+static size_t const c_header = sizeof(uint32_t) + sizeof(uint64_t);
+
+static std::atomic<bool> g_stop(false);
+static std::atomic<bool> g_measuring(false);
+
+//------------------------------------------------------------------------------
+
+static void usage(char const* name)
+{
+    fprintf(stderr,
+            "usage: %s [--mode=echo|rr] [--port=N | --unix=PATH] [--connections=N]\n"
+            "       [--size=BYTES] [--response=BYTES] [--pipeline=N] [--server-threads=N]\n"
+            "       [--client-threads=N] [--warmup=SECONDS] [--duration=SECONDS]\n", name);
+}
+
+static bool parse(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            return false;
+        }
+
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        long number = std::strtol(value.c_str(), nullptr, 10);
+
+        if (key == "mode") {
+            if (value != "echo" && value != "rr") {
+                return false;
+            }
+            options.echo = (value == "echo");
+        } else if (key == "port") {
+            options.port = static_cast<int>(number);
+        } else if (key == "unix") {
+            options.unix_path = value;
+        } else if (key == "connections") {
+            options.connections = static_cast<int>(number);
+        } else if (key == "size") {
+            options.size = static_cast<size_t>(number);
+        } else if (key == "response") {
+            options.response = static_cast<size_t>(number);
+        } else if (key == "pipeline") {
+            options.pipeline = static_cast<int>(number);
+        } else if (key == "server-threads") {
+            options.server_threads = static_cast<int>(number);
+        } else if (key == "client-threads") {
+            options.client_threads = static_cast<int>(number);
+        } else if (key == "warmup") {
+            options.warmup = static_cast<int>(number);
+        } else if (key == "duration") {
+            options.duration = static_cast<int>(number);
+        } else {
+            return false;
+        }
+    }
+
+    if (!options.unix_path.empty() && options.server_threads != 1) {
+        fprintf(stderr, "unix sockets support a single server thread only\n");
+        return false;
+    }
+
+    return options.connections > 0 && options.pipeline > 0
+            && options.server_threads > 0 && options.client_threads > 0;
+}
+
+//------------------------------------------------------------------------------
+// Server
+
+struct BenchServer : public nbbt::Server
+{
+    explicit BenchServer(Options const& options)
+        : options_(options), response_(c_header + options.response, 'r')
+    {
+        uint32_t length = static_cast<uint32_t>(options.response);
+        ::memcpy(&response_[0], &length, sizeof(length));
+    }
+
+    void onConnected(nbbt::client_t) override {}
+    void onDisconnected(nbbt::client_t) override {}
+
+    void onReadyRead(nbbt::client_t client) override
+    {
+        nbbt::Buffer* rbuffer = read_buffer(client);
+
+        if (options_.echo) {
+            // return everything, chunk by chunk without copying
+            size_t bytes;
+            unsigned char const* data;
+            while ((data = rbuffer->peek(0, bytes))) {
+                send(client, data, bytes);
+                rbuffer->remove(bytes);
+            }
+            return;
+        }
+
+        // answer every complete request
+        while (rbuffer->available() >= c_header) {
+            unsigned char header[c_header];
+            rbuffer->memcpy(header, c_header);
+
+            uint32_t length;
+            ::memcpy(&length, header, sizeof(length));
+            if (rbuffer->available() < c_header + length) {
+                break;
+            }
+
+            ::memcpy(&response_[sizeof(uint32_t)], header + sizeof(uint32_t), sizeof(uint64_t));
+            rbuffer->remove(c_header + length);
+            send(client, response_.data(), response_.size());
+        }
+    }
+
+    Options const& options_;
+    std::vector<unsigned char> response_;
+};
+
+static void server_thread(BenchServer* server)
+{
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        if (!server->run(100)) {
+            break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Clients
+
+struct Connection
+{
+    int socket;
+    nbbt::Buffer rbuffer;
+    nbbt::Buffer wbuffer;
+    bool writable_armed = false;
+};
+
+struct ClientStats
+{
+    nbbt::Histogram rtt;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+};
+
+static int connect_to(Options const& options)
+{
+    int s;
+    if (!options.unix_path.empty()) {
+        s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un address;
+        ::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        ::strncpy(address.sun_path, options.unix_path.c_str(), sizeof(address.sun_path) - 1);
+        if (::connect(s, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            ::close(s);
+            return -1;
+        }
+    } else {
+        s = ::socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        ::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(options.port);
+        if (::connect(s, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            ::close(s);
+            return -1;
+        }
+        int one = 1;
+        ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    nbbt::socket_set_nonblocking(s);
+    return s;
+}
+
+static void send_request(Connection& connection, std::vector<unsigned char>& request)
+{
+    uint64_t now = nbbt::clock_ns();
+    ::memcpy(&request[sizeof(uint32_t)], &now, sizeof(now));
+    connection.wbuffer.send(request.data(), request.size());
+}
+
+static void client_thread(Options const& options, int connections, ClientStats* stats)
+{
+    int epoll = ::epoll_create1(0);
+
+    std::vector<unsigned char> request(c_header + options.size, 'q');
+    uint32_t length = static_cast<uint32_t>(options.size);
+    ::memcpy(&request[0], &length, sizeof(length));
+
+    std::vector<std::unique_ptr<Connection>> all;
+    for (int i = 0; i < connections; ++i) {
+        int s = connect_to(options);
+        if (-1 == s) {
+            perror("connect");
+            continue;
+        }
+
+        std::unique_ptr<Connection> connection(new Connection);
+        connection->socket = s;
+        connection->rbuffer.set_socket(s);
+        connection->wbuffer.set_socket(s);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection.get();
+        ::epoll_ctl(epoll, EPOLL_CTL_ADD, s, &event);
+
+        for (int j = 0; j < options.pipeline; ++j) {
+            send_request(*connection, request);
+        }
+        all.push_back(std::move(connection));
+    }
+
+    struct epoll_event events[64];
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        int n = ::epoll_wait(epoll, events, 64, 100);
+        for (int i = 0; i < n; ++i) {
+            Connection& connection = *static_cast<Connection*>(events[i].data.ptr);
+
+            if (events[i].events & EPOLLOUT) {
+                connection.wbuffer.flush();
+            }
+
+            if (events[i].events & EPOLLIN) {
+                size_t read;
+                if (connection.rbuffer.read(read) != 1) {
+                    g_stop = true;
+                    break;
+                }
+
+                // complete responses
+                while (connection.rbuffer.available() >= c_header) {
+                    unsigned char header[c_header];
+                    connection.rbuffer.memcpy(header, c_header);
+
+                    uint32_t length;
+                    uint64_t sent;
+                    ::memcpy(&length, header, sizeof(length));
+                    ::memcpy(&sent, header + sizeof(length), sizeof(sent));
+                    if (connection.rbuffer.available() < c_header + length) {
+                        break;
+                    }
+                    connection.rbuffer.remove(c_header + length);
+
+                    if (g_measuring.load(std::memory_order_relaxed)) {
+                        stats->rtt.record(nbbt::clock_ns() - sent);
+                        stats->messages += 1;
+                        stats->bytes += c_header + length;
+                    }
+
+                    send_request(connection, request);
+                }
+            }
+
+            // only wait for EPOLLOUT while data is pending
+            bool pending = connection.wbuffer.available() > 0;
+            if (pending != connection.writable_armed) {
+                struct epoll_event event;
+                event.events = EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+                event.data.ptr = &connection;
+                ::epoll_ctl(epoll, EPOLL_CTL_MOD, connection.socket, &event);
+                connection.writable_armed = pending;
+            }
+        }
+    }
+
+    for (auto& connection : all) {
+        ::close(connection->socket);
+    }
+    ::close(epoll);
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // one server per thread, the kernel distributes connections (SO_REUSEPORT)
+    std::vector<std::unique_ptr<BenchServer>> servers;
+    for (int i = 0; i < options.server_threads; ++i) {
+        std::unique_ptr<BenchServer> server(new BenchServer(options));
+        server->set_reuseport(options.server_threads > 1);
+        server->set_nodelay(true);
+
+        bool ok = options.unix_path.empty() ? server->init(options.port)
+                                            : server->init(options.unix_path.c_str());
+        if (!ok) {
+            fprintf(stderr, "failed to start server\n");
+            return 1;
+        }
+        servers.push_back(std::move(server));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& server : servers) {
+        threads.push_back(std::thread(&server_thread, server.get()));
+    }
+
+    std::vector<std::unique_ptr<ClientStats>> stats;
+    for (int i = 0; i < options.client_threads; ++i) {
+        // distribute connections evenly
+        int connections = options.connections / options.client_threads
+                + (i < options.connections % options.client_threads ? 1 : 0);
+        stats.push_back(std::unique_ptr<ClientStats>(new ClientStats));
+        threads.push_back(std::thread(&client_thread, std::cref(options), connections, stats.back().get()));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(options.warmup));
+    g_measuring = true;
+    uint64_t start = nbbt::clock_ns();
+    std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+    g_measuring = false;
+    double seconds = (nbbt::clock_ns() - start) / 1e9;
+
+    g_stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    nbbt::Histogram rtt;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    for (auto& s : stats) {
+        rtt.merge(s->rtt);
+        messages += s->messages;
+        bytes += s->bytes;
+    }
+
+    printf("mode            %s\n", options.echo ? "echo" : "rr");
+    printf("transport       %s\n", options.unix_path.empty() ? "tcp loopback" : "unix");
+    printf("connections     %d (pipeline %d)\n", options.connections, options.pipeline);
+    printf("threads         %d server, %d client\n", options.server_threads, options.client_threads);
+    printf("message size    %zu\n", options.size);
+    printf("msgs/s          %.0f\n", messages / seconds);
+    printf("MB/s            %.2f\n", bytes / seconds / 1e6);
+    printf("rtt p50         %.1f us\n", rtt.percentile(50.0) / 1e3);
+    printf("rtt p99         %.1f us\n", rtt.percentile(99.0) / 1e3);
+    printf("rtt p999        %.1f us\n", rtt.percentile(99.9) / 1e3);
+    printf("rtt max         %.1f us\n", rtt.max() / 1e3);
+
+    return 0;
+}
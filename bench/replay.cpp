@@ -0,0 +1,419 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays a capture (see nbbt::CaptureWriter) against a running server.
+ *
+ * Every captured connection is opened again and the received data of the
+ * capture is sent as it was recorded. Each CAPTURE_IN record is a step whose
+ * response consists of the CAPTURE_OUT bytes recorded before the next step.
+ *
+ * --speed=1 (default) sends the steps at the recorded times, --speed=2 twice
+ * as fast and so on. --speed=0 sends each step as soon as the response of the
+ * previous one has arrived. Reports throughput and the latency from sending a
+ * step until its response is complete.
+ */
+
+#include "nbbt/Buffer.h"
+#include "nbbt/capture.h"
+#include "nbbt/histogram.h"
+#include "nbbt/socket.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+struct Options
+{
+    std::string file;           // --file=PATH
+    int port = 55600;           // --port=N
+    std::string unix_path;      // --unix=PATH
+    double speed = 1.0;         // --speed=FACTOR, 0 as fast as possible
+    int timeout = 60;           // --timeout=SECONDS
+};
+
+struct Step
+{
+    uint64_t time;              // nanoseconds since the start of the capture
+    std::vector<unsigned char> data;
+    uint64_t response;          // bytes sent by the server in return
+};
+
+struct Session
+{
+    uint64_t open = 0;          // nanoseconds since the start of the capture
+    std::vector<Step> steps;
+
+    int socket = -1;
+    std::unique_ptr<nbbt::Buffer> wbuffer;
+    bool writable_armed = false;
+    bool done = false;
+    size_t next = 0;            // next step to send
+    uint64_t received = 0;
+    uint64_t expected = 0;      // response bytes of all sent steps
+
+    // sent steps waiting for their response: (send time, expected total)
+    std::deque<std::pair<uint64_t, uint64_t>> outstanding;
+};
+
+//------------------------------------------------------------------------------
+
+static void usage(char const* name)
+{
+    fprintf(stderr,
+            "usage: %s --file=PATH [--port=N | --unix=PATH] [--speed=FACTOR]\n"
+            "       [--timeout=SECONDS]\n", name);
+}
+
+static bool parse(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            return false;
+        }
+
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+
+        if (key == "file") {
+            options.file = value;
+        } else if (key == "port") {
+            options.port = static_cast<int>(std::strtol(value.c_str(), nullptr, 10));
+        } else if (key == "unix") {
+            options.unix_path = value;
+        } else if (key == "speed") {
+            options.speed = std::strtod(value.c_str(), nullptr);
+        } else if (key == "timeout") {
+            options.timeout = static_cast<int>(std::strtol(value.c_str(), nullptr, 10));
+        } else {
+            return false;
+        }
+    }
+
+    return !options.file.empty() && options.speed >= 0.0 && options.timeout > 0;
+}
+
+//------------------------------------------------------------------------------
+
+static bool load(std::string const& file, std::map<uint32_t, Session>& sessions)
+{
+    nbbt::CaptureReader reader;
+    if (!reader.open(file.c_str())) {
+        fprintf(stderr, "cannot read capture %s\n", file.c_str());
+        return false;
+    }
+
+    nbbt::CaptureRecord record;
+    uint64_t start = 0;
+    bool first = true;
+    while (reader.next(record)) {
+        if (first) {
+            start = record.time;
+            first = false;
+        }
+        uint64_t time = record.time - start;
+
+        // client ids are unique within a capture, a connection without an
+        // open record started before the capture
+        Session& session = sessions[record.connection];
+        switch (record.type) {
+        case nbbt::CAPTURE_OPEN:
+            session.open = time;
+            break;
+        case nbbt::CAPTURE_IN:
+            session.steps.push_back(Step{ time, std::move(record.data), 0 });
+            break;
+        case nbbt::CAPTURE_OUT:
+            if (!session.steps.empty()) {
+                session.steps.back().response += record.data.size();
+            }
+            break;
+        case nbbt::CAPTURE_CLOSE:
+            break;
+        }
+    }
+
+    return true;
+}
+
+static int connect_to(Options const& options)
+{
+    int s;
+    if (!options.unix_path.empty()) {
+        s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un address;
+        ::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        ::strncpy(address.sun_path, options.unix_path.c_str(), sizeof(address.sun_path) - 1);
+        if (::connect(s, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            ::close(s);
+            return -1;
+        }
+    } else {
+        s = ::socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        ::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(options.port);
+        if (::connect(s, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            ::close(s);
+            return -1;
+        }
+        int one = 1;
+        ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    nbbt::socket_set_nonblocking(s);
+    return s;
+}
+
+//------------------------------------------------------------------------------
+
+struct Stats
+{
+    nbbt::Histogram latency;
+    uint64_t steps = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t failed = 0;
+};
+
+static void close_session(Session& session)
+{
+    if (-1 != session.socket) {
+        ::close(session.socket);
+        session.socket = -1;
+    }
+    session.done = true;
+}
+
+static void update_events(int epoll, Session& session)
+{
+    // only wait for EPOLLOUT while data is pending
+    bool pending = session.wbuffer->available() > 0;
+    if (pending != session.writable_armed) {
+        struct epoll_event event;
+        event.events = EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        event.data.ptr = &session;
+        ::epoll_ctl(epoll, EPOLL_CTL_MOD, session.socket, &event);
+        session.writable_armed = pending;
+    }
+}
+
+/**
+ * Open the connection and send all steps that are due.
+ *
+ * @return              nanoseconds until the next step is due, 0 if nothing is
+ *                      scheduled
+ */
+static uint64_t advance(Options const& options, int epoll, Session& session,
+                        uint64_t elapsed, Stats& stats)
+{
+    double const speed = options.speed;
+    auto due = [speed](uint64_t time) {
+        return speed > 0.0 ? static_cast<uint64_t>(time / speed) : 0;
+    };
+
+    if (session.done) {
+        return 0;
+    }
+
+    if (-1 == session.socket) {
+        if (due(session.open) > elapsed) {
+            return due(session.open) - elapsed;
+        }
+
+        session.socket = connect_to(options);
+        if (-1 == session.socket) {
+            perror("connect");
+            stats.failed += 1;
+            session.done = true;
+            return 0;
+        }
+
+        session.wbuffer.reset(new nbbt::Buffer(session.socket));
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &session;
+        ::epoll_ctl(epoll, EPOLL_CTL_ADD, session.socket, &event);
+    }
+
+    while (session.next < session.steps.size()) {
+        Step const& step = session.steps[session.next];
+        if (speed > 0.0) {
+            if (due(step.time) > elapsed) {
+                update_events(epoll, session);
+                return due(step.time) - elapsed;
+            }
+        } else if (!session.outstanding.empty()) {
+            // closed loop, wait for the previous response
+            break;
+        }
+
+        if (session.wbuffer->send(step.data.data(), step.data.size()) < 0) {
+            stats.failed += 1;
+            close_session(session);
+            return 0;
+        }
+
+        stats.steps += 1;
+        stats.sent += step.data.size();
+        if (step.response > 0) {
+            session.expected += step.response;
+            session.outstanding.push_back(std::make_pair(nbbt::clock_ns(), session.expected));
+        }
+        session.next += 1;
+    }
+
+    if (session.next == session.steps.size() && session.outstanding.empty()
+            && session.wbuffer->available() == 0) {
+        close_session(session);
+        return 0;
+    }
+
+    update_events(epoll, session);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::map<uint32_t, Session> sessions;
+    if (!load(options.file, sessions)) {
+        return 1;
+    }
+
+    int epoll = ::epoll_create1(0);
+    Stats stats;
+    std::vector<unsigned char> scratch(64 << 10);
+
+    uint64_t start = nbbt::clock_ns();
+    uint64_t deadline = start + static_cast<uint64_t>(options.timeout) * 1000000000ull;
+
+    for (;;) {
+        uint64_t now = nbbt::clock_ns();
+        if (now >= deadline) {
+            fprintf(stderr, "timeout\n");
+            break;
+        }
+
+        // send what is due, find the next scheduled step
+        uint64_t wait = 0;
+        size_t open = 0;
+        for (auto& it : sessions) {
+            uint64_t next = advance(options, epoll, it.second, now - start, stats);
+            if (next > 0 && (0 == wait || next < wait)) {
+                wait = next;
+            }
+            open += it.second.done ? 0 : 1;
+        }
+        if (0 == open) {
+            break;
+        }
+
+        int timeout = wait > 0 ? static_cast<int>((wait + 999999) / 1000000) : 100;
+        struct epoll_event events[64];
+        int n = ::epoll_wait(epoll, events, 64, timeout);
+        for (int i = 0; i < n; ++i) {
+            Session& session = *static_cast<Session*>(events[i].data.ptr);
+            if (session.done) {
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                session.wbuffer->flush();
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t ret;
+                while ((ret = ::recv(session.socket, scratch.data(), scratch.size(), 0)) > 0) {
+                    session.received += static_cast<uint64_t>(ret);
+                    stats.received += static_cast<uint64_t>(ret);
+                }
+
+                uint64_t received = nbbt::clock_ns();
+                while (!session.outstanding.empty()
+                        && session.received >= session.outstanding.front().second) {
+                    stats.latency.record(received - session.outstanding.front().first);
+                    session.outstanding.pop_front();
+                }
+
+                if (0 == ret || (-1 == ret && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    // closed by the server, responses still missing failed
+                    stats.failed += session.outstanding.size();
+                    close_session(session);
+                }
+            }
+        }
+    }
+
+    double seconds = (nbbt::clock_ns() - start) / 1e9;
+
+    for (auto& it : sessions) {
+        close_session(it.second);
+    }
+    ::close(epoll);
+
+    printf("capture         %s\n", options.file.c_str());
+    printf("connections     %zu\n", sessions.size());
+    if (options.speed > 0.0) {
+        printf("speed           %gx\n", options.speed);
+    } else {
+        printf("speed           max\n");
+    }
+    printf("duration        %.3f s\n", seconds);
+    printf("steps           %llu (%llu failed)\n", (unsigned long long)stats.steps,
+           (unsigned long long)stats.failed);
+    printf("steps/s         %.0f\n", stats.steps / seconds);
+    printf("MB/s            %.2f sent, %.2f received\n", stats.sent / seconds / 1e6,
+           stats.received / seconds / 1e6);
+    printf("latency p50     %.1f us\n", stats.latency.percentile(50.0) / 1e3);
+    printf("latency p99     %.1f us\n", stats.latency.percentile(99.0) / 1e3);
+    printf("latency p999    %.1f us\n", stats.latency.percentile(99.9) / 1e3);
+    printf("latency max     %.1f us\n", stats.latency.max() / 1e3);
+
+    return 0;
+}
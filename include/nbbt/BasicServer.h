@@ -0,0 +1,929 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_BASICSERVER_H
+#define LIBNBBT_BASICSERVER_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+#include "nbbt/histogram.h"
+#include "nbbt/socket.h"
+
+#include <sys/epoll.h>
+
+#include <algorithm>
+#include <cstddef> /* size_t */
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+typedef int client_t;
+
+class TlsContext;
+class TlsSession;
+class CompressionTransport;
+struct CompressionOptions;
+class CaptureWriter;
+class CaptureTransport;
+class TokenBucket;
+struct Relay;
+struct WriteLanes;
+
+// write lanes of a connection, see BasicServer::send()
+static unsigned const c_write_lanes = 4;
+
+/**
+ * Buffer usage of a single connection.
+ */
+struct ConnectionStats
+{
+    size_t rbuffered = 0;   // bytes stored in the read buffer
+    size_t wbuffered = 0;   // bytes stored in the write buffer
+    size_t rcapacity = 0;   // bytes allocated by the read buffer
+    size_t wcapacity = 0;   // bytes allocated by the write buffer
+    uint64_t throttled = 0; // nanoseconds waited for a rate limit
+};
+
+/**
+ * State of a single connection. Owns the objects it points to, the socket is
+ * closed by the server.
+ */
+struct ClientData
+{
+    ClientData(socket_t socket, client_t id, size_t chunksize)
+        : socket(socket), id(id), rbuffer(socket, chunksize), wbuffer(socket, chunksize)
+    {}
+    ~ClientData();
+
+    ClientData(ClientData const&) = delete;
+    ClientData& operator=(ClientData const&) = delete;
+
+    socket_t socket;
+    client_t id;
+    struct epoll_event event;
+    Buffer rbuffer;
+    Buffer wbuffer;
+    TlsSession* tls = nullptr;
+    CompressionTransport* compression = nullptr;
+    CaptureTransport* capture = nullptr;
+    TokenBucket* bucket = nullptr;  // rate limit of this connection
+    Histogram* rxDelay = nullptr;   // see ServerBase::set_rx_timestamps()
+    Relay* relay = nullptr;         // see ServerBase::relay()
+    WriteLanes* lanes = nullptr;    // message boundaries, see BasicServer::send()
+    size_t handling = 0;        // bytes of the message passed to onMessage()
+    bool handshake = false;     // TLS handshake in progress
+    bool queued = false;        // waiting for a coalesced flush
+    bool active = false;        // events since the last idle check
+    int throttle = -1;          // timer waiting for rate limit tokens
+    int64_t throttledSince = 0; // steady clock nanoseconds, 0 if not throttled
+    uint64_t throttled = 0;     // nanoseconds waited for a rate limit
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * Calls onReadyRead(client) whenever data has been received. The handler takes
+ * the data from the read buffer.
+ */
+struct StreamFraming
+{
+    template <class Traits, class Handler>
+    static bool dispatch(Handler& handler, ClientData& client)
+    {
+        handler.onReadyRead(client.id);
+        return true;
+    }
+};
+
+/**
+ * Messages are prefixed with their size (32 bit, big endian). Calls
+ * onMessage(client, buffer, bytes) for every complete message at the beginning
+ * of the read buffer. The message is removed after the handler returns, except
+ * for what the handler has taken itself (e.g. with remove() or relay(), which
+ * does not pass the message on). A message larger than Traits::max_message
+ * disconnects the client.
+ */
+struct LengthPrefixFraming
+{
+    template <class Traits, class Handler>
+    static bool dispatch(Handler& handler, ClientData& client)
+    {
+        Buffer& buffer = client.rbuffer;
+        unsigned char header[4];
+        while (buffer.available() >= sizeof(header)) {
+            buffer.memcpy(header, sizeof(header));
+            size_t bytes = (size_t(header[0]) << 24) | (size_t(header[1]) << 16)
+                         | (size_t(header[2]) << 8) | size_t(header[3]);
+            if (bytes > Traits::max_message) {
+                return false;
+            }
+            if (buffer.available() - sizeof(header) < bytes) {
+                return true;
+            }
+
+            buffer.remove(sizeof(header));
+            size_t available = buffer.available();
+            client.handling = bytes;
+            handler.onMessage(client.id, buffer, bytes);
+            client.handling = 0;
+
+            size_t taken = available - std::min(available, buffer.available());
+            if (taken < bytes) {
+                buffer.remove(bytes - taken);
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Compile time configuration of BasicServer.
+ */
+struct ServerTraits
+{
+    // how received data is passed to the handler
+    typedef StreamFraming framing;
+
+    // Collect everything sent during one iteration of the event loop and
+    // flush it at the end of the iteration, instead of one ::send() per call.
+    static bool const coalesce = false;
+
+    // chunk size of the connection buffers (2^chunksize)
+    static size_t const chunksize = 12;
+
+    // largest message accepted by LengthPrefixFraming, larger ones disconnect
+    static size_t const max_message = 16 << 20;
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * Listener, connections, timers and the admin/handoff sockets of a server. The
+ * event loop and the handler calls are in BasicServer.
+ */
+class ServerBase
+{
+public:
+    bool init(int port, int domain = AF_INET);
+
+    /**
+     * Listen on a unix domain socket.
+     *
+     * @param path          path of the socket, an existing file is replaced
+     * @return              false on error
+     */
+    bool init(char const* path);
+
+    /**
+     * Set SO_REUSEPORT on the listening socket, so several servers (e.g. one
+     * per thread) can listen on the same port. Call before init().
+     *
+     * @param enable        enable SO_REUSEPORT
+     */
+    void set_reuseport(bool enable);
+
+    /**
+     * Set TCP_NODELAY on connections accepted from now on.
+     *
+     * @param enable        disable Nagle's algorithm
+     */
+    void set_nodelay(bool enable);
+
+    /**
+     * @brief pin this server to given CPUs.
+     *
+     * Pins the calling thread, so call it from the thread that runs this
+     * server, before any connection exists. Buffer chunks of connections are
+     * allocated on the NUMA node of the first CPU (see NodeChunkAllocator).
+     *
+     * With a single CPU, the listening socket gets SO_INCOMING_CPU. Servers
+     * sharing a port through set_reuseport() then accept the connections
+     * whose packets are processed on their CPU, i.e. the CPU handling the NIC
+     * queue (Linux 6.1, older kernels ignore it for reuseport groups).
+     *
+     * @param cpus          CPU numbers
+     * @return              false on error
+     */
+    bool set_affinity(std::vector<int> const& cpus);
+
+    /**
+     * @brief allocate buffer chunks from arenas on 2 MiB pages.
+     *
+     * Reduces TLB misses with many connections. Falls back to transparent
+     * huge pages and then regular pages when no huge pages are available,
+     * see NodeChunkAllocator. Call before any connection exists.
+     *
+     * @param enable        use huge pages
+     * @return              false if connections exist
+     */
+    bool set_hugepages(bool enable);
+
+    /**
+     * @brief release the buffer memory of idle connections.
+     *
+     * Connections without any event or write for at least timeout (and at
+     * most twice as long) give their chunks back to the allocator, see
+     * Buffer::shrink(). Small pending data is kept in the inline segment.
+     *
+     * @param timeout       idle time in milliseconds, 0 to disable
+     */
+    void set_idle_release(int timeout);
+
+    /**
+     * @brief bound the write buffer memory of slow consumers.
+     *
+     * Write buffers of connections accepted from now on move their older
+     * chunks to a temporary file once they hold more than budget bytes in
+     * memory, see Buffer::set_spill(). Nothing is dropped; without room in
+     * the file, chunks stay in memory.
+     *
+     * @param budget        bytes of chunks a write buffer keeps in memory,
+     *                      0 to disable spilling
+     * @param capacity      maximum size of the file
+     * @param directory     directory of the file, /tmp is often in memory
+     * @return              false if the file cannot be created
+     */
+    bool set_spill(size_t budget, size_t capacity, char const* directory = "/var/tmp");
+
+    /**
+     * @brief limit the number of open connections.
+     *
+     * At the limit, the listening socket is taken out of the event loop until
+     * a connection closes, so new connections wait in the listen backlog.
+     * With shed, they are accepted and closed right away instead, after the
+     * handler had the chance to write a short reply in onRejected().
+     *
+     * @param max           maximum number of connections, 0 for unlimited
+     * @param shed          close connections over the limit
+     */
+    void set_max_connections(size_t max, bool shed = false);
+
+    /**
+     * Accept at most given number of connections per iteration of run(), so a
+     * flood of new connections cannot starve the existing ones. The rest is
+     * accepted in the following iterations.
+     *
+     * @param accepts       connections per iteration, 0 for unlimited
+     *                      (default: 64)
+     */
+    void set_accept_budget(size_t accepts);
+
+    /**
+     * Flush the write buffer of given client. Data that cannot be sent yet is
+     * sent from within run() as soon as the socket becomes writable.
+     *
+     * Use this after writing to write_buffer() directly.
+     *
+     * @param client        client
+     * @return              false on error or unknown client
+     */
+    bool flush(client_t client);
+
+    /**
+     * Direct access to the buffers of given client, e.g. for use with Reader.
+     *
+     * @param client        client
+     * @return              nullptr if the client is unknown
+     */
+    Buffer* read_buffer(client_t client);
+    Buffer* write_buffer(client_t client);
+
+    /**
+     * @brief open a connection to another server, e.g. a backend.
+     *
+     * Connects without blocking, data sent before the connection is
+     * established waits in the write buffer. The connection is served like an
+     * accepted one, but never encrypted or compressed, and not reported
+     * through onConnected(). onDisconnected() is called when it closes or
+     * cannot be established.
+     *
+     * @param address       address of the server
+     * @param length        size of address
+     * @param client        id of the new connection
+     * @return              false on error
+     */
+    bool connect(struct sockaddr const* address, socklen_t length, client_t& client);
+
+    /**
+     * @brief pass all further data between two connections.
+     *
+     * For proxies: once the application has seen what it needs (e.g. the
+     * request headers), the rest is moved with ::splice() through a pipe per
+     * direction and never copied to user space. Data left in the read buffers
+     * is copied to the other connection and, like everything already in the
+     * write buffers, sent before any relayed data. The copy is queued on lane 0
+     * (see send()). Called from onMessage(), the message being handled is not
+     * passed on.
+     *
+     * A connection is only read while the other one accepts data, so a slow
+     * receiver holds the sender back through the socket buffers. When one side
+     * closes, what it sent is passed on and the other side is closed as well;
+     * both are reported through onDisconnected(). The read handlers are not
+     * called for relayed data. Not available with TLS, compression, capture or
+     * a rate limit.
+     *
+     * @param a             client id
+     * @param b             client id
+     * @return              false if a connection does not exist, already
+     *                      relays or uses one of the above
+     */
+    bool relay(client_t a, client_t b);
+
+    /**
+     * Call given function once from within run() after given time.
+     *
+     * @param timeout       time in milliseconds
+     * @param callback      function to call
+     * @return              timer id
+     */
+    int start_timer(int timeout, std::function<void()> callback);
+
+    /**
+     * Cancel a timer that has not been fired yet.
+     *
+     * @param timer         timer id returned by start_timer()
+     */
+    void stop_timer(int timer);
+
+    /**
+     * Get the buffer usage of given client.
+     *
+     * @param client        client
+     * @param stats         buffer usage
+     * @return              false if the client is unknown
+     */
+    bool stats(client_t client, ConnectionStats& stats) const;
+
+    /**
+     * @brief serve metrics on a local unix socket.
+     *
+     * Every connection to the socket receives the current metrics (see
+     * metrics.h) in the Prometheus text format, followed by the connections
+     * with the largest buffers, and is closed. The socket is served from
+     * within run().
+     *
+     * @param path          path of the unix socket
+     * @return              false on error
+     */
+    bool init_admin(char const* path);
+
+    /**
+     * @brief encrypt all connections accepted from now on.
+     *
+     * onConnected() is called once the TLS handshake has completed. All other
+     * functions work on plaintext. See TlsContext.
+     *
+     * @param context       context initialized as server, must outlive this
+     *                      server; nullptr to disable TLS
+     * @return              false if context is not a server context
+     */
+    bool set_tls(TlsContext* context);
+
+    /**
+     * @brief compress all connections accepted from now on.
+     *
+     * Writes are compressed when the write buffer is flushed and received
+     * data is decoded into the read buffer, inside TLS if enabled. The peer
+     * has to use compression too. See CompressionTransport.
+     *
+     * @param options       algorithm, level and threshold; COMPRESSION_NONE
+     *                      to disable compression
+     * @return              false if the algorithm is not supported by this
+     *                      build
+     */
+    bool set_compression(CompressionOptions const& options);
+
+    /**
+     * @brief record the traffic of all connections accepted from now on.
+     *
+     * Received and sent data is appended to the capture as the application
+     * sees it (inside TLS and compression), see CaptureTransport. Replay it
+     * with the nbbt-replay benchmark.
+     *
+     * @param capture       open capture file that outlives the connections,
+     *                      nullptr to stop recording new connections
+     */
+    void set_capture(CaptureWriter* capture);
+
+    /**
+     * @brief limit the bandwidth of all connections together.
+     *
+     * Write buffers only send as much as the limit allows. A throttled
+     * connection stops waiting for EPOLLOUT and is flushed again by a timer
+     * once enough tokens have been refilled. See TokenBucket. Connections
+     * paired by relay() are not limited.
+     *
+     * @param rate          bytes per second, 0 for unlimited
+     * @param burst         bytes that may be sent at once
+     */
+    void set_rate_limit(uint64_t rate, uint64_t burst);
+
+    /**
+     * @brief limit the bandwidth of a single connection.
+     *
+     * Applies in addition to the limit of all connections.
+     *
+     * @param client        client id
+     * @param rate          bytes per second, 0 for unlimited
+     * @param burst         bytes that may be sent at once
+     * @return              false if client does not exist or is relayed, see
+     *                      relay()
+     */
+    bool set_rate_limit(client_t client, uint64_t rate, uint64_t burst);
+
+    /**
+     * @brief accept a handoff request on a local unix socket.
+     *
+     * Allows a new process to take over this server without closing the
+     * listening socket (see takeover()). When the new process connects, the
+     * listening socket, and if requested all connections together with the
+     * contents of their buffers, are sent to it (SCM_RIGHTS). This server then
+     * stops accepting connections and reports the connections it handed over
+     * through onDisconnected(), without closing them. TLS connections are
+     * never handed over.
+     *
+     * Connections that were not handed over are served until they close:
+     *
+     * while (server.listening() || server.connections() > 0) {
+     *     server.run(100);
+     * }
+     *
+     * @param path          path of the unix socket
+     * @return              false on error
+     */
+    bool init_handoff(char const* path);
+
+    /**
+     * @brief serve another socket from within run().
+     *
+     * Calling it again for the same socket only changes the events, e.g. from
+     * within the callback.
+     *
+     * @param socket        socket (or any other file descriptor)
+     * @param events        epoll events, e.g. EPOLLIN | EPOLLET
+     * @param callback      called with the received events
+     * @return              false on error
+     */
+    bool watch(socket_t socket, uint32_t events, std::function<void(uint32_t)> callback);
+
+    /**
+     * Stop serving a socket passed to watch(). Not from within its callback.
+     *
+     * @param socket        socket
+     */
+    void unwatch(socket_t socket);
+
+    /**
+     * Whether this server accepts new connections.
+     */
+    bool listening() const;
+
+    /**
+     * Number of open connections.
+     */
+    size_t connections() const;
+
+    /**
+     * Get a snapshot of the event loop latencies (see histogram.h). May be
+     * called from any thread. Snapshots of several servers can be merged.
+     *
+     * @param latency       latencies in nanoseconds
+     */
+    void latency(LoopLatency& latency) const;
+
+    /**
+     * @brief measure how long received data waits in the socket.
+     *
+     * Connections accepted from now on record when the kernel received their
+     * data, see Buffer::set_timestamps(). Every read records how long its
+     * oldest byte waited, per connection (see rx_delay()) and in
+     * LoopLatency::rxqueue. A growing delay means the loop cannot keep up.
+     * Costs a histogram per connection; not available with TLS, compression
+     * or capture.
+     *
+     * @param enable        record timestamps
+     */
+    void set_rx_timestamps(bool enable);
+
+    /**
+     * Get the receive queueing delays of a connection, see
+     * set_rx_timestamps(). Only valid until the connection is closed.
+     *
+     * @param client        client id
+     * @return              delays in nanoseconds, nullptr if client does not
+     *                      exist or records no timestamps
+     */
+    Histogram const* rx_delay(client_t client) const;
+
+protected:
+    explicit ServerBase(size_t chunksize);
+    ~ServerBase();
+
+    ServerBase(ServerBase const&) = delete;
+    ServerBase& operator=(ServerBase const&) = delete;
+
+    enum EventType
+    {
+        EVENT_NONE,         // served internally or stale
+        EVENT_LISTENER,     // call accept() until it returns nullptr
+        EVENT_HANDOFF,      // call serve_handoff()
+        EVENT_CLIENT
+    };
+
+    // Steps of the event loop, see BasicServer::run().
+    int wait(int timeout);
+    EventType event(int index, ClientData*& client, uint32_t& events);
+    ClientData* accept(socket_t& rejected);
+    void reject(socket_t socket);
+    int handshake(ClientData* client);
+    bool exists(socket_t socket) const;
+    void disconnected(ClientData* client);
+    bool flush(ClientData* client);
+    void record_rx_delay(ClientData* client, size_t offset);
+    bool relay(ClientData* client, uint32_t events, client_t& peer);
+    void flush_queued(std::vector<client_t>& failed);
+    void fire_timers();
+    void serve_handoff(std::vector<client_t>& moved);
+    bool takeover(char const* path, bool connections, std::vector<client_t>& received);
+
+    ClientData* find(client_t client) const;
+    bool send(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes);
+    bool append(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes);
+    void queue(ClientData* client);
+
+    LoopLatency* latency_;
+
+private:
+    struct ServerImpl;
+    ServerImpl* p;
+}; // class ServerBase
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief event loop calling Handler directly.
+ *
+ * Handler derives from BasicServer<Handler, Traits> and implements
+ *
+ * void onConnected(client_t client);
+ * void onRejected(socket_t socket);                    // optional
+ * void onDisconnected(client_t client);
+ * void onReadyRead(client_t client);                   // StreamFraming
+ * void onMessage(client_t client, Buffer& buffer,
+ *                size_t bytes);                        // LengthPrefixFraming
+ *
+ * The calls are not virtual, so they can be inlined into run(). Server is the
+ * instantiation with virtual handlers.
+ *
+ * struct Echo : public BasicServer<Echo, EchoTraits>
+ * {
+ *     void onConnected(client_t) {}
+ *     void onDisconnected(client_t) {}
+ *     void onMessage(client_t client, Buffer& buffer, size_t bytes) { ... }
+ * };
+ */
+template <class Handler, class Traits = ServerTraits>
+class BasicServer : public ServerBase
+{
+public:
+    /**
+     * @brief run one iteration of the event loop.
+     *
+     * Waits for socket events and expired timers, and calls the event handlers.
+     *
+     * @param timeout       maximum time to wait in milliseconds (-1: infinite)
+     * @return              false on error
+     */
+    bool run(int timeout = -1);
+
+    /**
+     * @brief take over a server that called init_handoff().
+     *
+     * Use instead of init(). Blocks until the transfer is complete. Every
+     * received connection is reported through onConnected() and, if its read
+     * buffer already contains data, the read handler.
+     *
+     * @param path          path passed to init_handoff() by the old process
+     * @param connections   also take over open connections
+     * @return              false if no listening socket was received
+     */
+    bool takeover(char const* path, bool connections = true);
+
+    bool send(client_t client, unsigned char const* src, size_t bytes)
+    {
+        return send(client, 0, src, bytes);
+    }
+
+    /**
+     * @brief send a message on a write lane.
+     *
+     * Every connection has c_write_lanes lanes with a buffer each. Lane 0 is
+     * the write buffer used by send() without a lane, higher lanes are sent
+     * first. The lane only changes between messages (the data of one call),
+     * so a heartbeat sent during a bulk transfer goes out as soon as the
+     * message being written is complete. Data appended to write_buffer()
+     * directly is part of the next message on lane 0.
+     *
+     * @param client        client id
+     * @param lane          lane, higher is more urgent
+     * @param src           message
+     * @param bytes         size of the message
+     * @return              false on error, unknown client or lane
+     */
+    bool send(client_t client, unsigned lane, unsigned char const* src, size_t bytes)
+    {
+        ClientData* data = find(client);
+        if (!data) {
+            return false;
+        }
+
+        if (Traits::coalesce) {
+            if (!append(data, lane, src, bytes)) {
+                return false;
+            }
+            queue(data);
+            return true;
+        }
+
+        return ServerBase::send(data, lane, src, bytes);
+    }
+
+    bool memcpy(client_t client, unsigned char* dest, size_t bytes) const
+    {
+        ClientData* data = find(client);
+        if (!data || data->rbuffer.available() < bytes) {
+            return false;
+        }
+
+        data->rbuffer.memcpy(dest, bytes);
+        return true;
+    }
+
+    void remove(client_t client, size_t bytes)
+    {
+        ClientData* data = find(client);
+        if (data) {
+            data->rbuffer.remove(bytes);
+        }
+    }
+
+    size_t available(client_t client) const
+    {
+        ClientData* data = find(client);
+        return data ? data->rbuffer.available() : 0;
+    }
+
+    bool get_string(client_t client, std::string& string, bool take = false)
+    {
+        ClientData* data = find(client);
+        return data && data->rbuffer.get_string(string, take);
+    }
+
+    /**
+     * Called with a connection that is closed right after accepting, because
+     * the server is full (see set_max_connections()) or out of file
+     * descriptors. The socket is non-blocking and closed after the call.
+     * Handlers that do not care need not declare it.
+     *
+     * @param socket        accepted socket
+     */
+    void onRejected(socket_t socket) { (void)socket; }
+
+protected:
+    BasicServer() : ServerBase(Traits::chunksize) {}
+
+private:
+    Handler& handler() { return static_cast<Handler&>(*this); }
+
+    void connected(client_t client)
+    {
+        NBBT_LATENCY_START(callback_start);
+        handler().onConnected(client);
+        NBBT_LATENCY_RECORD(latency_->callback, callback_start);
+    }
+
+    void disconnect(ClientData* client)
+    {
+        client_t id = client->id;
+        disconnected(client);
+        handler().onDisconnected(id);
+    }
+}; // class BasicServer
+
+//------------------------------------------------------------------------------
+
+template <class Handler, class Traits>
+bool BasicServer<Handler, Traits>::run(int timeout)
+{
+    int nfds = wait(timeout);
+    if (-1 == nfds) {
+        return false;
+    }
+
+    NBBT_LATENCY_START(iteration_start);
+    for (int i = 0; i < nfds; ++i) {
+        ClientData* client;
+        uint32_t events;
+        switch (event(i, client, events)) {
+        case EVENT_LISTENER:
+        {
+            // new clients connect, see set_accept_budget()
+            socket_t rejected;
+            while ((client = accept(rejected)) || INVALID_SOCKET != rejected) {
+                if (!client) {
+                    handler().onRejected(rejected);
+                    reject(rejected);
+                } else if (!client->handshake) {
+                    connected(client->id);
+                }
+            }
+            continue;
+        }
+        case EVENT_HANDOFF:
+        {
+            std::vector<client_t> moved;
+            serve_handoff(moved);
+            for (client_t id : moved) {
+                handler().onDisconnected(id);
+            }
+            continue;
+        }
+        case EVENT_CLIENT:
+        {
+            break;
+        }
+        default:
+        {
+            continue;
+        }
+        } // switch
+
+        socket_t socket = client->socket;
+        client_t id = client->id;
+
+        // TLS handshake, the client is reported once it completes
+        if (client->handshake) {
+            int ret = (events & (EPOLLERR | EPOLLHUP)) ? -1 : handshake(client);
+            if (1 != ret) {
+                if (-1 == ret) {
+                    // never reported as connected
+                    disconnected(client);
+                }
+                continue;
+            }
+
+            connected(id);
+
+            // the handler may have disconnected the client
+            if (!exists(socket)) {
+                continue;
+            }
+
+            // records that arrived together with the handshake
+            events |= EPOLLIN;
+        }
+
+        // data of connections paired by relay() passes through the kernel
+        if (client->relay) {
+            client_t peer;
+            if (!relay(client, events, peer)) {
+                disconnect(client);
+                if (ClientData* other = find(peer)) {
+                    disconnect(other);
+                }
+            }
+            continue;
+        }
+
+        // socket has disconnected
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            disconnect(client);
+            continue;
+        }
+
+        // data available to read from client/slave
+        if (events & EPOLLIN) {
+            size_t read;
+            size_t offset = client->rbuffer.available();
+            NBBT_LATENCY_START(read_start);
+            int ret = client->rbuffer.read(read);
+            NBBT_LATENCY_RECORD(latency_->read, read_start);
+            if (-1 == ret) {
+                log_last_socket_error();
+            }
+            if (client->rxDelay) {
+                record_rx_delay(client, offset);
+            }
+
+            if (client->rbuffer.available() > 0) {
+                NBBT_LATENCY_START(callback_start);
+                bool valid = Traits::framing::template dispatch<Traits>(handler(), *client);
+                NBBT_LATENCY_RECORD(latency_->callback, callback_start);
+
+                // the handler may have disconnected the client
+                if (!exists(socket)) {
+                    continue;
+                }
+                if (!valid) {
+                    disconnect(client);
+                    continue;
+                }
+            }
+
+            if (ret < 1) {
+                // client closed the connection
+                disconnect(client);
+                continue;
+            }
+        }
+
+        if (events & EPOLLRDHUP) {
+            // client closed the connection
+            disconnect(client);
+            continue;
+        }
+
+        // write buffer has more space
+        if (events & EPOLLOUT) {
+            if (!flush(client)) {
+                disconnect(client);
+                continue;
+            }
+        }
+    }
+
+    fire_timers();
+
+    // coalesced writes and connections refilled by the rate limit
+    std::vector<client_t> failed;
+    flush_queued(failed);
+    for (client_t id : failed) {
+        handler().onDisconnected(id);
+    }
+
+    NBBT_LATENCY_RECORD(latency_->iteration, iteration_start);
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+template <class Handler, class Traits>
+bool BasicServer<Handler, Traits>::takeover(char const* path, bool connections)
+{
+    std::vector<client_t> received;
+    bool ret = ServerBase::takeover(path, connections, received);
+
+    for (client_t id : received) {
+        handler().onConnected(id);
+
+        ClientData* client = find(id);
+        if (client && client->rbuffer.available() > 0) {
+            bool valid = Traits::framing::template dispatch<Traits>(handler(), *client);
+
+            // the handler may have disconnected the client
+            if (!valid && (client = find(id))) {
+                disconnect(client);
+            }
+        }
+    }
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_BASICSERVER_H
@@ -33,8 +33,10 @@
 #include "shared/win32_utf8.h"
 #endif
 
-#include <deque>
+#include <cstdint>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 //------------------------------------------------------------------------------
 
@@ -42,6 +44,56 @@ namespace nbbt {
 
 //------------------------------------------------------------------------------
 
+class SpillFile;
+
+/**
+ * Replaces ::recv() and ::send() of a Buffer, e.g. to encrypt the data
+ * (see TlsSession). Both behave like their socket counterparts and set errno
+ * to EAGAIN if the operation would block.
+ *
+ * A transport may return less than requested from send(). The next call
+ * continues with the remaining bytes of the same stream.
+ *
+ * A transport that accepts data it cannot write yet reports it through
+ * pending() and writes it in flush().
+ */
+class Transport
+{
+public:
+    virtual ~Transport() {}
+
+    virtual long recv(void* dest, size_t bytes) = 0;
+    virtual long send(void const* src, size_t bytes) = 0;
+
+    /**
+     * Write accepted data.
+     *
+     * @return              1 if nothing is pending anymore
+     *                      0 if the socket is not writable
+     *                      -1 on error
+     */
+    virtual int flush() { return 1; }
+    virtual bool pending() const { return false; }
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * Provides the chunk memory of a Buffer, e.g. on a certain NUMA node (see
+ * NodeChunkAllocator). Chunks are returned with the same size they were
+ * allocated with.
+ */
+class ChunkAllocator
+{
+public:
+    virtual ~ChunkAllocator() {}
+
+    virtual unsigned char* allocate(size_t bytes) = 0;
+    virtual void deallocate(unsigned char* chunk, size_t bytes) = 0;
+};
+
+//------------------------------------------------------------------------------
+
 /**
  * SocketBuffer is a contiguous unlimited buffer, that supports adding at the
  * tail and taking from the head.
@@ -50,7 +102,8 @@ namespace nbbt {
  * picking completely received messages from the beginning.
  *
  * It uses an array of buffers internally to be able to allow infinite append
- * to tail and remove from head.
+ * to tail and remove from head. Nothing is allocated before the data exceeds
+ * a small inline segment, so tiny messages never allocate a chunk.
  *
  * Usage as read buffer
  * --------------------
@@ -165,6 +218,54 @@ public:
      */
     bool get_string(std::string& string, bool take = false);
 
+    /**
+     * Search for given byte.
+     *
+     * @param delim         byte to search for
+     * @param offset        offset of the first occurrence (relative to the
+     *                      beginning of this buffer)
+     * @param start         offset to start searching at
+     * @return              false if delim is not in the buffer
+     */
+    bool find(unsigned char delim, size_t& offset, size_t start = 0) const;
+
+    /**
+     * Get direct access to the data at given offset without copying.
+     *
+     * Data is stored in chunks, so only the part up to the end of the chunk
+     * containing offset is contiguous.
+     *
+     * @param offset        offset relative to the beginning of this buffer
+     * @param bytes         number of contiguous bytes at the returned address
+     * @return              address of the byte at offset, nullptr if offset is
+     *                      not available
+     */
+    unsigned char const* peek(size_t offset, size_t& bytes) const;
+
+    /**
+     * @brief record when the kernel received the data.
+     *
+     * Enables software receive timestamps (SO_TIMESTAMPING) on the socket and
+     * reads with ::recvmsg(). For TCP, the kernel reports one timestamp per
+     * read, that of the latest segment, so a timestamp applies to the bytes
+     * of a whole read. Not available with a transport (e.g. TLS). The kernel
+     * may take a moment to start stamping after the first socket enables it;
+     * data received until then has no timestamp.
+     *
+     * @param enable        record timestamps
+     * @return              false if the socket option cannot be set
+     */
+    bool set_timestamps(bool enable);
+
+    /**
+     * Get the time the kernel received the byte at given offset.
+     *
+     * @param offset        offset relative to the beginning of this buffer
+     * @param ns            CLOCK_REALTIME nanoseconds
+     * @return              false if no timestamp is known
+     */
+    bool timestamp(size_t offset, uint64_t& ns) const;
+
     /**
      * @brief send given buffer.
      *
@@ -179,14 +280,43 @@ public:
      */
     int send(unsigned char const* src, size_t bytes);
 
+    /**
+     * Append given data without sending it. Call flush() to send it.
+     *
+     * @param src           data to append
+     * @param bytes         size of data
+     */
+    void append(unsigned char const* src, size_t bytes);
+
+    /**
+     * Get direct access to the free space at the end of this buffer, to write
+     * data without copying it (see WriteCursor). Allocates a chunk if the last
+     * one is full.
+     *
+     * @param bytes         number of contiguous bytes at the returned address
+     * @return              address of the first free byte
+     */
+    unsigned char* tail(size_t& bytes);
+
+    /**
+     * Append data written to the space returned by tail().
+     *
+     * @param bytes         number of bytes written, at most the size returned
+     *                      by tail()
+     */
+    void commit(size_t bytes);
+
     /**
      * Flush buffer by calling ::send().
      *
+     * @param limit         maximum number of bytes to send, e.g. the tokens of
+     *                      a TokenBucket; data already accepted by the
+     *                      transport is written regardless
      * @return              1 on success
      *                      0 on closed socket
      *                      -1 on socket error
      */
-    int flush();
+    int flush(size_t limit = SIZE_MAX);
 
     /**
      * Set the current socket.
@@ -195,19 +325,122 @@ public:
      */
     void set_socket(socket_t socket) { m_socket = socket; }
 
+    /**
+     * Use given transport instead of the socket.
+     *
+     * @param transport     transport, nullptr for the socket
+     */
+    void set_transport(Transport* transport) { m_transport = transport; }
+    Transport* transport() const { return m_transport; }
+
+    /**
+     * Allocate chunks from given allocator instead of the heap. Releases all
+     * chunks allocated so far, the buffer has to be empty.
+     *
+     * @param allocator     allocator, must outlive this buffer; nullptr for
+     *                      the heap
+     */
+    void set_allocator(ChunkAllocator* allocator);
+
+    /**
+     * @brief bound the memory of a buffer that grows large.
+     *
+     * Once the chunks in memory exceed the budget, completely written chunks
+     * are moved to the spill file, oldest first. The first chunks (sent or
+     * read next) and the chunk being written stay in memory. Spilled chunks
+     * are read back ahead of their use while the buffer drains. Without room
+     * in the file, chunks stay in memory.
+     *
+     * Call while the buffer is empty.
+     *
+     * @param spill         file with slots of the chunk size, nullptr to
+     *                      keep all chunks in memory
+     * @param budget        bytes of chunks to keep in memory
+     * @return              false if the slot size does not match
+     */
+    bool set_spill(SpillFile* spill, size_t budget);
+
+    /**
+     * Bytes of chunks currently in the spill file.
+     */
+    inline size_t spilled() const { return m_spilled << m_chunksize; }
+
     inline size_t available() const { return m_writepos - m_readpos; }
 
+    /**
+     * Whether flush() has something to write, including data accepted by the
+     * transport.
+     */
+    inline bool pending() const
+    {
+        return available() > 0 || (m_transport && m_transport->pending());
+    }
+
+    /**
+     * Number of bytes allocated for chunks.
+     */
+    inline size_t capacity() const { return _chunks() << m_chunksize; }
+
     void clear();
 
+    /**
+     * Release the chunks not needed for the data currently stored, e.g. when
+     * the connection is idle. Data that fits into the inline segment is moved
+     * there and all chunks are released.
+     */
+    void shrink();
+
+    /**
+     * Bytes stored in the object itself before the first chunk is allocated.
+     */
+    static size_t const c_inline_size = 64;
+
+    /**
+     * Chunks at the beginning that are never spilled.
+     */
+    static size_t const c_spill_head = 2;
+
 private:
+    inline size_t _chunks() const { return m_chunks.size() - m_first; }
+    inline size_t _inline() const { return std::min<size_t>(c_inline_size, size_t(1) << m_chunksize); }
+
+    // the inline segment while no chunk is allocated
+    inline unsigned char* _chunk(size_t chunk) const
+    {
+        return 0 == _chunks() ? const_cast<unsigned char*>(m_inline) : m_chunks[m_first + chunk];
+    }
+
+    void _leave_inline();
+    long _recv_timestamped(unsigned char* dest, size_t bytes);
+    void _drop_timestamps();
+    void _page_out();
+    void _pop_front();
     void _append(unsigned char const* src, size_t bytes);
     int _send(unsigned char const* src, size_t bytes, size_t& sent);
+    unsigned char* _allocate();
+    void _deallocate(unsigned char* chunk);
 
     socket_t m_socket;
+    Transport* m_transport;
+    ChunkAllocator* m_allocator;
+    SpillFile* m_spill;
+    size_t m_spillBudget;
+    size_t m_spilled;   // chunks in the spill file
+    size_t m_spillEnd;  // chunk after the spilled ones
     size_t m_chunksize;
     size_t m_readpos;
     size_t m_writepos;
-    std::deque<unsigned char*> m_chunks;
+
+    // a vector allocates nothing while empty, unlike std::deque
+    std::vector<unsigned char*> m_chunks;
+    size_t m_first;     // chunks before are unused
+
+    // kernel receive times: (stream offset of the first byte of a read, ns)
+    bool m_timestamps;
+    uint64_t m_removed; // stream offset of the beginning of this buffer
+    std::vector<std::pair<uint64_t, uint64_t>> m_stamps;
+    size_t m_firstStamp;
+    unsigned char m_inline[c_inline_size];
 }; // class Buffer
 
 //------------------------------------------------------------------------------
@@ -28,6 +28,7 @@
 //------------------------------------------------------------------------------
 
 #include "nbbt/Buffer.h"
+#include "nbbt/Resolver.h"
 
 //------------------------------------------------------------------------------
 
@@ -35,15 +36,78 @@ namespace nbbt {
 
 //------------------------------------------------------------------------------
 
+class TlsContext;
+struct CompressionOptions;
+
 class Client
 {
 public:
     Client();
     virtual ~Client();
 
+    /**
+     * @brief connect to given host.
+     *
+     * Blocks until the host name is resolved (unless cached) and the
+     * connection is established.
+     *
+     * @param host          host name or dotted IPv4 address
+     * @param port          port
+     * @return              false if the host could not be resolved or the
+     *                      connection failed
+     */
     bool connect(char const* host, int port);
+
+    /**
+     * @brief connect to given host without blocking on name resolution.
+     *
+     * If the host name is not cached, it is resolved on the resolvers helper
+     * thread and the connection is established from within run(). Once
+     * connected, onConnected() is called. If the name cannot be resolved or the
+     * connection fails, onDisconnected() is called instead.
+     *
+     * @param host          host name or dotted IPv4 address
+     * @param port          port
+     * @return              false if the host could not be resolved or the
+     *                      connection failed immediately
+     */
+    bool connect_async(char const* host, int port);
+
     bool run();
 
+    /**
+     * Use given resolver instead of Resolver::instance().
+     *
+     * @param resolver      resolver, must outlive this client
+     * @return              false while connect_async() waits for a lookup
+     */
+    bool set_resolver(Resolver* resolver);
+
+    /**
+     * @brief encrypt the next connection.
+     *
+     * The handshake is part of connect() and blocks. The certificate is
+     * verified against the host name passed to connect().
+     *
+     * @param context       context initialized as client, must outlive this
+     *                      client; nullptr to disable TLS
+     * @return              false if context is not a client context
+     */
+    bool set_tls(TlsContext* context);
+
+    /**
+     * @brief compress the next connection.
+     *
+     * The server has to use compression too. See CompressionTransport.
+     *
+     * @param options       algorithm, level and threshold; COMPRESSION_NONE
+     *                      to disable compression
+     * @return              false if the algorithm is not supported by this
+     *                      build
+     */
+    bool set_compression(CompressionOptions const& options);
+
+    virtual void onConnected() {}
     virtual void onDisconnected() = 0;
     virtual void onReadyRead() = 0;
 
@@ -0,0 +1,327 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_CURSOR_H
+#define LIBNBBT_CURSOR_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <stdlib.h> /* _byteswap_* */
+#endif
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+namespace detail {
+
+template <size_t N> struct uint_of_size;
+template <> struct uint_of_size<1> { typedef uint8_t type; };
+template <> struct uint_of_size<2> { typedef uint16_t type; };
+template <> struct uint_of_size<4> { typedef uint32_t type; };
+template <> struct uint_of_size<8> { typedef uint64_t type; };
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static bool const c_host_big_endian = true;
+#else
+static bool const c_host_big_endian = false;
+#endif
+
+inline uint8_t bswap(uint8_t value) { return value; }
+#ifdef _MSC_VER
+inline uint16_t bswap(uint16_t value) { return _byteswap_ushort(value); }
+inline uint32_t bswap(uint32_t value) { return _byteswap_ulong(value); }
+inline uint64_t bswap(uint64_t value) { return _byteswap_uint64(value); }
+#else
+inline uint16_t bswap(uint16_t value) { return __builtin_bswap16(value); }
+inline uint32_t bswap(uint32_t value) { return __builtin_bswap32(value); }
+inline uint64_t bswap(uint64_t value) { return __builtin_bswap64(value); }
+#endif
+
+/**
+ * Decode a value stored with given byte order. Compiles to a load and at most
+ * a byte swap instruction.
+ */
+template <class T, bool BigEndian>
+inline T load(unsigned char const* src)
+{
+    typedef typename uint_of_size<sizeof(T)>::type uint_t;
+    uint_t bits;
+    ::memcpy(&bits, src, sizeof(bits));
+    if (BigEndian != c_host_big_endian) {
+        bits = bswap(bits);
+    }
+    T value;
+    ::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+template <class T, bool BigEndian>
+inline void store(unsigned char* dest, T value)
+{
+    typedef typename uint_of_size<sizeof(T)>::type uint_t;
+    uint_t bits;
+    ::memcpy(&bits, &value, sizeof(bits));
+    if (BigEndian != c_host_big_endian) {
+        bits = bswap(bits);
+    }
+    ::memcpy(dest, &bits, sizeof(bits));
+}
+
+} // namespace detail
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief typed reads from a Buffer.
+ *
+ * Decodes integers and floats of either byte order, LEB128 varints and
+ * length-prefixed strings, starting at an offset into the buffer. The data
+ * stays in the buffer; once a complete message has been decoded, remove it
+ * with Buffer::remove(cursor.offset()).
+ *
+ * Every read is bounds checked. If not enough data has been received yet, it
+ * returns false and the cursor does not move, so decoding can be retried with
+ * a new cursor once more data has arrived. Values within a chunk are read in
+ * place, only values spanning two chunks are assembled.
+ *
+ * nbbt::ReadCursor cursor(buffer);
+ * uint32_t length;
+ * std::string name;
+ * if (cursor.read_be(length) && cursor.read_string(name)) {
+ *     buffer.remove(cursor.offset());
+ * }
+ *
+ * The buffer must not be modified except for appending while the cursor is in
+ * use.
+ */
+class ReadCursor
+{
+public:
+    /**
+     * @param buffer        buffer to read from
+     * @param offset        offset relative to the beginning of buffer
+     */
+    explicit ReadCursor(Buffer const& buffer, size_t offset = 0);
+
+    /**
+     * Read an integer or floating point value in big or little endian byte
+     * order.
+     *
+     * @param value         decoded value
+     * @return              false if not enough data is available
+     */
+    template <class T> inline bool read_be(T& value) { return read<T, true>(value); }
+    template <class T> inline bool read_le(T& value) { return read<T, false>(value); }
+
+    /**
+     * Read an unsigned LEB128 varint, or a signed one in zigzag encoding.
+     *
+     * @param value         decoded value
+     * @return              false if not enough data is available or the
+     *                      varint is longer than 10 bytes (see error())
+     */
+    bool read_varint(uint64_t& value);
+    bool read_svarint(int64_t& value);
+
+    /**
+     * Copy bytes.
+     *
+     * @param dest          destination
+     * @param bytes         number of bytes
+     * @return              false if not enough data is available
+     */
+    bool read_bytes(unsigned char* dest, size_t bytes);
+
+    /**
+     * Read a string prefixed with its length as varint.
+     *
+     * @param string        decoded string
+     * @param max           maximum length, longer strings are an error
+     * @return              false if not enough data is available or the
+     *                      string is too long (see error())
+     */
+    bool read_string(std::string& string, size_t max = SIZE_MAX);
+
+    /**
+     * Skip bytes.
+     *
+     * @param bytes         number of bytes
+     * @return              false if not enough data is available
+     */
+    bool skip(size_t bytes);
+
+    /**
+     * Offset of the next read relative to the beginning of the buffer.
+     */
+    inline size_t offset() const { return m_offset; }
+
+    inline size_t remaining() const { return m_buffer.available() - m_offset; }
+
+    /**
+     * Whether a read failed because of malformed data rather than missing
+     * data. Waiting for more data does not help then.
+     */
+    inline bool error() const { return m_error; }
+
+private:
+    template <class T, bool BigEndian>
+    inline bool read(T& value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "integer or floating point type required");
+
+        // within the current chunk
+        if (sizeof(T) <= static_cast<size_t>(m_end - m_ptr)) {
+            value = detail::load<T, BigEndian>(m_ptr);
+            m_ptr += sizeof(T);
+            m_offset += sizeof(T);
+            return true;
+        }
+
+        unsigned char bytes[sizeof(T)];
+        if (!read_bytes(bytes, sizeof(T))) {
+            return false;
+        }
+        value = detail::load<T, BigEndian>(bytes);
+        return true;
+    }
+
+    void seek(size_t offset);
+
+    Buffer const& m_buffer;
+    size_t m_offset;
+    unsigned char const* m_ptr;     // data at m_offset
+    unsigned char const* m_end;     // end of the contiguous data at m_ptr
+    bool m_error;
+}; // class ReadCursor
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief typed writes to a Buffer.
+ *
+ * Encodes the counterparts of ReadCursor directly into the free space of the
+ * last chunk (see Buffer::tail()), allocating chunks as needed. Written data
+ * becomes part of the buffer with commit(), at the latest when the cursor is
+ * destroyed. Do not modify the buffer otherwise in the meantime.
+ *
+ * {
+ *     nbbt::WriteCursor cursor(wbuffer);
+ *     cursor.write_be(uint32_t(42));
+ *     cursor.write_string(name);
+ * }
+ * wbuffer.flush();
+ */
+class WriteCursor
+{
+public:
+    explicit WriteCursor(Buffer& buffer);
+    ~WriteCursor();
+
+    WriteCursor(WriteCursor const&) = delete;
+    WriteCursor& operator=(WriteCursor const&) = delete;
+
+    /**
+     * Write an integer or floating point value in big or little endian byte
+     * order.
+     *
+     * @param value         value
+     */
+    template <class T> inline void write_be(T value) { write<T, true>(value); }
+    template <class T> inline void write_le(T value) { write<T, false>(value); }
+
+    /**
+     * Write an unsigned LEB128 varint, or a signed one in zigzag encoding.
+     *
+     * @param value         value
+     */
+    void write_varint(uint64_t value);
+    void write_svarint(int64_t value);
+
+    /**
+     * @param src           data
+     * @param bytes         number of bytes
+     */
+    void write_bytes(unsigned char const* src, size_t bytes);
+
+    /**
+     * Write a string prefixed with its length as varint.
+     *
+     * @param string        string
+     * @param length        length of string
+     */
+    void write_string(char const* string, size_t length);
+    inline void write_string(std::string const& string) { write_string(string.data(), string.size()); }
+
+    /**
+     * Append the data written so far to the buffer.
+     */
+    void commit();
+
+    /**
+     * Number of bytes written, including the ones not committed yet.
+     */
+    inline size_t written() const { return m_written + static_cast<size_t>(m_ptr - m_start); }
+
+private:
+    template <class T, bool BigEndian>
+    inline void write(T value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "integer or floating point type required");
+
+        if (sizeof(T) <= static_cast<size_t>(m_end - m_ptr)) {
+            detail::store<T, BigEndian>(m_ptr, value);
+            m_ptr += sizeof(T);
+            return;
+        }
+
+        unsigned char bytes[sizeof(T)];
+        detail::store<T, BigEndian>(bytes, value);
+        write_bytes(bytes, sizeof(T));
+    }
+
+    Buffer& m_buffer;
+    unsigned char* m_start;     // first byte not committed
+    unsigned char* m_ptr;       // next byte to write
+    unsigned char* m_end;       // end of the chunk
+    size_t m_written;           // bytes committed
+}; // class WriteCursor
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_CURSOR_H
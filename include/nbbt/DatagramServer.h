@@ -0,0 +1,176 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_DATAGRAMSERVER_H
+#define LIBNBBT_DATAGRAMSERVER_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/socket.h"
+
+#include <cstddef> /* size_t */
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+class ServerBase;
+
+/**
+ * A received datagram. Only valid within DatagramServer::onReceived().
+ */
+struct Datagram
+{
+    unsigned char const* data;
+    size_t bytes;
+    struct sockaddr const* address;     // sender
+    socklen_t addrlen;
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief UDP endpoint served by the event loop of a Server.
+ *
+ * Datagrams are received with recvmmsg() into preallocated buffers, up to
+ * batch datagrams per call, and passed to onReceived() as one batch. Replies
+ * queued with send() during onReceived() are sent with a single sendmmsg()
+ * once it returns.
+ *
+ * With GRO the kernel may pass several datagrams of the same sender in one
+ * buffer, they are split again before onReceived(). With GSO consecutive
+ * replies of the same size to the same address are sent as one message and
+ * split by the kernel (or the NIC).
+ *
+ * struct Echo : public DatagramServer
+ * {
+ *     void onReceived(Datagram const* datagrams, size_t count) override
+ *     {
+ *         for (size_t i = 0; i < count; ++i) {
+ *             send(datagrams[i], datagrams[i].data, datagrams[i].bytes);
+ *         }
+ *     }
+ * };
+ *
+ * Echo echo;
+ * echo.init(port);
+ * echo.attach(server);
+ * while (server.run());
+ */
+class DatagramServer
+{
+public:
+    /**
+     * @param batch         datagrams per system call
+     * @param size          maximum size of a datagram
+     */
+    explicit DatagramServer(size_t batch = 64, size_t size = 2048);
+    virtual ~DatagramServer();
+
+    DatagramServer(DatagramServer const&) = delete;
+    DatagramServer& operator=(DatagramServer const&) = delete;
+
+    /**
+     * Use UDP GRO (receive) and GSO (send) if the kernel supports them. Call
+     * before init().
+     *
+     * @param gro           receive coalesced datagrams
+     * @param gso           send coalesced datagrams
+     */
+    void set_offload(bool gro, bool gso);
+
+    bool init(int port, int domain = AF_INET);
+
+    /**
+     * Serve this endpoint from within server.run(). The server must outlive
+     * this endpoint.
+     *
+     * @param server        server
+     * @return              false on error
+     */
+    bool attach(ServerBase& server);
+
+    /**
+     * @brief receive all pending datagrams.
+     *
+     * Called by the server, unless you run your own loop.
+     *
+     * @return              1 on success
+     *                      -1 on socket error
+     */
+    int read();
+
+    /**
+     * @brief queue a datagram.
+     *
+     * Queued datagrams are sent after onReceived() returns, or by flush().
+     *
+     * @param to            datagram to reply to
+     * @param src           data
+     * @param bytes         size of data (<= size passed to the constructor)
+     * @return              false if the datagram is too large or the queue is
+     *                      full and cannot be flushed
+     */
+    bool send(Datagram const& to, unsigned char const* src, size_t bytes);
+    bool send(struct sockaddr const* address, socklen_t addrlen, unsigned char const* src, size_t bytes);
+
+    /**
+     * @brief send all queued datagrams.
+     *
+     * @return              1 if the queue is empty
+     *                      0 if the socket is not writable, the rest is sent
+     *                        when it becomes writable (if attached)
+     *                      -1 on socket error
+     */
+    int flush();
+
+    /**
+     * Number of queued datagrams.
+     */
+    size_t queued() const;
+
+    /**
+     * Whether GRO/GSO is in use.
+     */
+    bool gro() const;
+    bool gso() const;
+
+    socket_t socket() const;
+
+    virtual void onReceived(Datagram const* datagrams, size_t count) = 0;
+
+private:
+    struct DatagramServerImpl;
+    DatagramServerImpl* p;
+}; // class DatagramServer
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_DATAGRAMSERVER_H
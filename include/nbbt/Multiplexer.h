@@ -0,0 +1,201 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_MULTIPLEXER_H
+#define LIBNBBT_MULTIPLEXER_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief logical streams over a single connection.
+ *
+ * Every stream has an id, its own handler and its own flow control window, so
+ * a slow or bulky stream does not block the others. Data is sent as frames of
+ * [type:8][stream:32][length:32][payload] (big endian):
+ *
+ * - DATA   payload of a stream, at most 16 KiB per frame
+ * - WINDOW 32 bit increment of the sender's window of a stream
+ * - CLOSE  the sender will not send more on the stream
+ *
+ * Frames of all streams with data and window left are written to the write
+ * buffer in turns of one frame each. A stream can have at most window bytes in
+ * flight; the receiver grants more once its handler has processed the data.
+ * Both peers have to use the same window.
+ *
+ * Streams opened by the initiator (e.g. the client) have odd ids, the ones
+ * opened by the other peer even ids.
+ *
+ * nbbt::Multiplexer mux(*write_buffer(client), false);
+ * mux.set_accept([&](uint32_t stream) {
+ *     mux.set_handler(stream, [&, stream](nbbt::Buffer& buffer, size_t bytes) {
+ *         // bytes at the beginning of buffer, 0 if the peer closed the stream
+ *     });
+ * });
+ *
+ * void onReadyRead(client_t client) override {
+ *     if (!mux.process(*read_buffer(client))) {
+ *         // protocol error, disconnect
+ *     }
+ *     mux.flush();
+ *     flush(client);
+ * }
+ */
+class Multiplexer
+{
+public:
+    /**
+     * The payload is removed after the handler returns, except for what the
+     * handler has taken itself.
+     *
+     * @param buffer        the read buffer with the payload at its beginning
+     * @param bytes         number of payload bytes, 0 if the peer closed the
+     *                      stream
+     */
+    typedef std::function<void(Buffer& buffer, size_t bytes)> handler_t;
+
+    /**
+     * @param stream        id of a stream opened by the peer
+     */
+    typedef std::function<void(uint32_t stream)> accept_t;
+
+    /**
+     * @param wbuffer       write buffer of the connection, frames are appended
+     *                      and have to be flushed by the caller
+     * @param initiator     whether this peer uses odd stream ids
+     * @param window        bytes a stream may have in flight
+     */
+    Multiplexer(Buffer& wbuffer, bool initiator, uint32_t window = 256 << 10);
+
+    /**
+     * Open a stream.
+     *
+     * @param handler       called with received data
+     * @return              stream id
+     */
+    uint32_t open(handler_t handler);
+
+    /**
+     * Called for every stream opened by the peer, before its data is passed
+     * on. Call set_handler() from it, otherwise the data of the stream is
+     * dropped.
+     *
+     * @param accept        callback
+     */
+    void set_accept(accept_t accept);
+
+    /**
+     * @param stream        stream id
+     * @param handler       called with received data
+     * @return              false if stream does not exist
+     */
+    bool set_handler(uint32_t stream, handler_t handler);
+
+    /**
+     * Queue data on a stream. Call flush() to write it.
+     *
+     * @param stream        stream id
+     * @param src           data
+     * @param bytes         size of data
+     * @return              false if stream does not exist or is closed
+     */
+    bool send(uint32_t stream, unsigned char const* src, size_t bytes);
+
+    /**
+     * Close the sending side of a stream once its queued data is sent (after
+     * flush()). The stream is removed when both sides are closed.
+     *
+     * @param stream        stream id
+     * @return              false if stream does not exist or is closed
+     */
+    bool close(uint32_t stream);
+
+    /**
+     * Write frames of all streams with queued data and window left to the
+     * write buffer, one frame per stream in turns. Queue the data of all
+     * streams first and flush once, so a bulky stream does not get ahead of
+     * the others.
+     */
+    void flush();
+
+    /**
+     * Dispatch all complete frames at the beginning of the read buffer. Call
+     * this from the read handler of the connection, then flush() and flush the
+     * write buffer (window updates and newly allowed data).
+     *
+     * @param rbuffer       read buffer of the connection
+     * @return              false on a protocol error
+     */
+    bool process(Buffer& rbuffer);
+
+    /**
+     * Bytes queued on a stream that did not fit into its window yet.
+     */
+    size_t queued(uint32_t stream) const;
+
+    inline size_t streams() const { return m_streams.size(); }
+
+private:
+    struct Stream
+    {
+        handler_t handler;
+        Buffer queue;               // waiting for window
+        uint32_t sendWindow;
+        uint32_t recvWindow;
+        uint32_t consumed = 0;      // processed, not granted again yet
+        bool closing = false;       // close() called
+        bool closeSent = false;
+        bool closeReceived = false;
+    };
+
+    Stream& create(uint32_t id);
+    Stream* incoming(uint32_t id);
+    void write_header(uint8_t type, uint32_t stream, uint32_t length);
+
+    Buffer& m_wbuffer;
+    uint32_t m_window;
+    uint32_t m_nextId;
+    uint32_t m_lastPeerId;
+    accept_t m_accept;
+    std::map<uint32_t, Stream> m_streams;
+}; // class Multiplexer
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_MULTIPLEXER_H
@@ -0,0 +1,147 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_READER_H
+#define LIBNBBT_READER_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+
+#include <deque>
+#include <functional>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Reader queues read operations on a read buffer and completes them in order
+ * as soon as enough data has been received.
+ *
+ * This replaces hand written partial read state in onReadyRead(): a protocol
+ * is written as a chain of operations, each queueing the next one from its
+ * handler.
+ *
+ * The handler of a completed operation gets the buffer with the requested
+ * bytes at its beginning. They can be accessed in place with Buffer::peek()
+ * or copied with Buffer::memcpy(). After the handler returns, the bytes are
+ * removed from the buffer, except for those the handler has taken itself (e.g.
+ * with Server::remove() or Server::relay()).
+ *
+ * Example
+ * -------
+ *
+ * void read_header() {
+ *     reader.read_exact(4, [this](nbbt::Buffer& buffer, size_t) {
+ *         uint32_t length;
+ *         buffer.memcpy(reinterpret_cast<unsigned char*>(&length), 4);
+ *         read_body(ntohl(length));
+ *     });
+ * }
+ *
+ * void onReadyRead(client_t client) override {
+ *     reader.process(*read_buffer(client));
+ * }
+ *
+ * read_until() remembers how far it has searched, so a long line arriving in
+ * many segments is only scanned once. This assumes the data before that
+ * position stays in place: it starts over when the buffer holds less than at
+ * the end of the last process(). Removing data and receiving at least as much
+ * in between is not noticed, so take data outside of the handlers only while
+ * no read_until() is pending.
+ *
+ * Each queued operation costs heap allocations: the deque allocates its
+ * blocks as the queue grows, and a handler_t allocates when its captures do
+ * not fit into the small buffer of std::function. Protocols that queue an
+ * operation per message pay this on every message; they should keep their
+ * captures small (e.g. only `this`) or use onReadyRead() directly.
+ *
+ * There is no counterpart for writes or delays. Write with Server::send()
+ * or Server::write_buffer() and delay with Server::start_timer().
+ */
+class Reader
+{
+public:
+    /**
+     * @param buffer        the read buffer
+     * @param bytes         number of bytes at the beginning of buffer that
+     *                      complete the operation
+     */
+    typedef std::function<void(Buffer& buffer, size_t bytes)> handler_t;
+
+    /**
+     * Complete when given number of bytes has been received.
+     *
+     * @param bytes         number of bytes
+     * @param handler       called on completion
+     */
+    void read_exact(size_t bytes, handler_t handler);
+
+    /**
+     * Complete when given delimiter has been received. The bytes passed to the
+     * handler include the delimiter.
+     *
+     * @param delim         delimiter
+     * @param handler       called on completion
+     */
+    void read_until(unsigned char delim, handler_t handler);
+
+    /**
+     * Complete all operations that can be completed with the data in given
+     * buffer. Call this from onReadyRead().
+     *
+     * @param buffer        read buffer
+     */
+    void process(Buffer& buffer);
+
+    /**
+     * Drop all pending operations.
+     */
+    void clear();
+
+    inline bool pending() const { return !m_operations.empty(); }
+
+private:
+    struct Operation
+    {
+        size_t bytes;
+        int delim; // -1 for read_exact()
+        handler_t handler;
+    };
+
+    std::deque<Operation> m_operations;
+    size_t m_scanned = 0;
+    size_t m_available = 0; // buffered at the end of process()
+}; // class Reader
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_READER_H
@@ -0,0 +1,197 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_RESOLVER_H
+#define LIBNBBT_RESOLVER_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/socket.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Resolver translates host names into IPv4 addresses and caches the results.
+ *
+ * Lookups are done with the reentrant ::getaddrinfo(). Every successfully
+ * resolved name is kept for ttl seconds together with all of its address
+ * records. Subsequent lookups rotate through these records, so connections to
+ * the same name are spread over all of its addresses.
+ *
+ * Failed lookups are cached as well (for negative_ttl seconds), so a broken
+ * name does not cause a resolution on every connection attempt.
+ *
+ * Asynchronous resolution
+ * -----------------------
+ *
+ * resolve_async() hands the name to a helper thread and returns immediately.
+ * Once the result is in the cache, a single byte is written to the given
+ * notification socket. The caller waits for the socket to become readable in
+ * its event loop and then picks up the result with lookup_cached():
+ *
+ * resolver.resolve_async("example.com", notify_write_end);
+ *
+ * // ... notify_read_end became readable
+ * struct in_addr address;
+ * switch (resolver.lookup_cached("example.com", address)) {
+ * case 1:  // resolved, connect to address
+ * case 0:  // name could not be resolved
+ * default: // -1, not in cache (expired in the meantime)
+ * }
+ */
+class Resolver
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param ttl           seconds a resolved name is kept in the cache
+     * @param negative_ttl  seconds a failed resolution is kept in the cache
+     */
+    explicit Resolver(unsigned ttl = 60, unsigned negative_ttl = 5);
+    ~Resolver();
+
+    /**
+     * The process wide resolver used by Client.
+     */
+    static Resolver& instance();
+
+    /**
+     * @brief resolve given host name.
+     *
+     * Returns a cached address if possible, otherwise blocks the calling thread
+     * until ::getaddrinfo() returns.
+     *
+     * @param host          host name or dotted IPv4 address
+     * @param address       the next address of the hosts address records
+     * @return              false if the name could not be resolved
+     */
+    bool lookup(char const* host, struct in_addr& address);
+
+    /**
+     * Look given host name up in the cache only. Never blocks.
+     *
+     * @param host          host name or dotted IPv4 address
+     * @param address       the next address of the hosts address records
+     * @return              1 on success
+     *                      0 if the name could not be resolved
+     *                      -1 if the name is not in the cache
+     */
+    int lookup_cached(char const* host, struct in_addr& address);
+
+    /**
+     * Get all cached address records of given host name.
+     *
+     * @param host          host name
+     * @param addresses     the address records
+     * @return              false if the name is not in the cache or could not
+     *                      be resolved
+     */
+    bool addresses(char const* host, std::vector<struct in_addr>& addresses);
+
+    /**
+     * Resolve given host name on the helper thread.
+     *
+     * When the result is available in the cache, one byte is written to notify.
+     * Concurrent requests for the same name share a single resolution.
+     *
+     * @param host          host name
+     * @param notify        non blocking socket or pipe to signal completion on
+     */
+    void resolve_async(char const* host, socket_t notify);
+
+    /**
+     * Stop notifying given socket about pending resolutions. Call this before
+     * closing a socket passed to resolve_async().
+     *
+     * @param notify        socket or pipe passed to resolve_async()
+     */
+    void cancel(socket_t notify);
+
+    /**
+     * Put address records into the cache, e.g. for static hosts.
+     *
+     * @param host          host name
+     * @param addresses     address records (empty for a failed resolution)
+     * @param ttl           seconds to keep the entry
+     */
+    void insert(char const* host, std::vector<struct in_addr> const& addresses, unsigned ttl);
+
+    /**
+     * Remove all entries from the cache.
+     */
+    void clear();
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry
+    {
+        std::vector<struct in_addr> addresses;
+        clock::time_point expires;
+        size_t next = 0;
+    };
+
+    struct Request
+    {
+        std::string host;
+        std::vector<socket_t> notify;
+    };
+
+    int _lookup_cached(std::string const& host, struct in_addr& address);
+    void _resolve(std::string const& host);
+    void _worker();
+
+    unsigned m_ttl;
+    unsigned m_negative_ttl;
+
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_cache;
+
+    std::condition_variable m_cond;
+    std::deque<Request> m_requests;
+    std::thread m_thread;
+    bool m_stop;
+}; // class Resolver
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_RESOLVER_H
@@ -27,6 +27,9 @@
 
 //------------------------------------------------------------------------------
 
+#include "nbbt/BasicServer.h"
+#include "nbbt/socket.h"
+
 #include <cstddef> /* size_t */
 #include <string>
 
@@ -36,10 +39,6 @@ namespace nbbt {
 
 //------------------------------------------------------------------------------
 
-typedef int client_t;
-
-//------------------------------------------------------------------------------
-
 class IServer
 {
 public:
@@ -56,26 +55,35 @@ public:
 
 //------------------------------------------------------------------------------
 
-class Server : public IServer
+/**
+ * Server with virtual event handlers, see BasicServer for the functions.
+ */
+class Server : public IServer, public BasicServer<Server>
 {
 public:
     Server();
     virtual ~Server();
 
-    bool init(int port, int domain = AF_INET);
-    bool run(int timeout = -1);
-
     bool send(client_t client, unsigned char const* src, size_t bytes) override;
     bool memcpy(client_t client, unsigned char* dest, size_t bytes) const override;
     void remove(client_t client, size_t bytes) override;
     size_t available(client_t client) const override;
     bool get_string(client_t client, std::string& string, bool take = false) override;
 
-private:
-    struct ServerImpl;
-    ServerImpl* p;
+    /**
+     * See BasicServer::send() with a lane.
+     */
+    bool send(client_t client, unsigned lane, unsigned char const* src, size_t bytes);
+
+    /**
+     * See BasicServer::onRejected().
+     */
+    virtual void onRejected(socket_t socket) { (void)socket; }
 }; // class Server
 
+// instantiated in Server.cpp
+extern template class BasicServer<Server>;
+
 //------------------------------------------------------------------------------
 
 class ThreadedServer: public IServer
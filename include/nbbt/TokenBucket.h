@@ -0,0 +1,117 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_TOKENBUCKET_H
+#define LIBNBBT_TOKENBUCKET_H
+
+//------------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief byte rate limit.
+ *
+ * Tokens refill at rate bytes per second up to burst. Sending consumes one
+ * token per byte. Nothing sleeps: the caller sends what available() allows
+ * and asks delay() when to try again.
+ *
+ * TokenBucket bucket(1 << 20, 64 << 10); // 1 MiB/s, 64 KiB at once
+ * size_t allowed = bucket.available(TokenBucket::clock::now());
+ * ...
+ * bucket.consume(sent);
+ */
+class TokenBucket
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * Unlimited bucket.
+     */
+    TokenBucket();
+
+    /**
+     * @param rate          bytes per second, 0 for unlimited
+     * @param burst         bytes that may be sent at once (at least 1)
+     */
+    TokenBucket(uint64_t rate, uint64_t burst);
+
+    /**
+     * Change the limit. The bucket starts full.
+     *
+     * @param rate          bytes per second, 0 for unlimited
+     * @param burst         bytes that may be sent at once (at least 1)
+     */
+    void set_rate(uint64_t rate, uint64_t burst);
+
+    inline bool limited() const { return m_rate > 0; }
+    inline uint64_t rate() const { return m_rate; }
+    inline uint64_t burst() const { return m_burst; }
+
+    /**
+     * Refill and get the number of bytes that may be sent now.
+     *
+     * @param now           current time
+     * @return              tokens, SIZE_MAX if unlimited
+     */
+    size_t available(clock::time_point now);
+
+    /**
+     * Take tokens for sent bytes.
+     *
+     * @param bytes         bytes sent, at most available()
+     */
+    void consume(size_t bytes);
+
+    /**
+     * Time until given number of tokens is available, relative to the last
+     * call of available().
+     *
+     * @param bytes         tokens needed, limited to burst
+     * @return              milliseconds, rounded up
+     */
+    int delay(size_t bytes) const;
+
+private:
+    uint64_t m_rate;
+    uint64_t m_burst;
+    uint64_t m_tokens;
+    clock::time_point m_last;   // tokens are refilled up to here
+}; // class TokenBucket
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_TOKENBUCKET_H
@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_ALLOCATION_H
+#define LIBNBBT_ALLOCATION_H
+
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Heap allocations of a thread.
+ */
+struct AllocationStats
+{
+    uint64_t allocations = 0;   // calls to operator new
+    uint64_t deallocations = 0; // calls to operator delete
+    uint64_t bytes = 0;         // bytes requested from operator new
+};
+
+/**
+ * Whether the library was built with NBBT_ALLOCATION_AUDIT.
+ *
+ * The audit replaces the global operator new and delete of the program and
+ * counts the calls of every thread (relaxed, thread-local counters). Within a
+ * reactor thread that is the library and the handlers it calls. Off by
+ * default, a program may replace the operators itself.
+ */
+bool allocation_audit_enabled();
+
+/**
+ * Get the allocations of the calling thread so far. Take a snapshot before
+ * and after a section of code to see what it allocated.
+ *
+ * @param stats         counters, all 0 without NBBT_ALLOCATION_AUDIT
+ */
+void allocation_stats(AllocationStats& stats);
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_ALLOCATION_H
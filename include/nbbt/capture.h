@@ -0,0 +1,220 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_CAPTURE_H
+#define LIBNBBT_CAPTURE_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+#include "nbbt/socket.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+enum CaptureType
+{
+    CAPTURE_OPEN,       // connection accepted
+    CAPTURE_IN,         // bytes received
+    CAPTURE_OUT,        // bytes sent
+    CAPTURE_CLOSE       // connection closed
+};
+
+/**
+ * A single record of a capture file.
+ */
+struct CaptureRecord
+{
+    uint64_t time = 0;          // CLOCK_MONOTONIC nanoseconds
+    uint32_t connection = 0;    // client id
+    CaptureType type = CAPTURE_OPEN;
+    std::vector<unsigned char> data;
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief append-only file of connection traffic.
+ *
+ * The file starts with the magic "NBBTCAP1" followed by records of
+ * [time:64][connection:32][type:8][length:32][data] (little endian). Records
+ * are collected in memory and written with a single ::write() whenever 64 KiB
+ * are buffered, on flush() and when the writer is destroyed.
+ *
+ * Not thread safe, use one file per server thread.
+ *
+ * nbbt::CaptureWriter capture;
+ * capture.open("traffic.cap");
+ * server.set_capture(&capture);
+ */
+class CaptureWriter
+{
+public:
+    CaptureWriter() = default;
+    ~CaptureWriter();
+
+    CaptureWriter(CaptureWriter const&) = delete;
+    CaptureWriter& operator=(CaptureWriter const&) = delete;
+
+    /**
+     * Open given file for appending, create it if it does not exist.
+     *
+     * @param path          file path
+     * @return              false on error
+     */
+    bool open(char const* path);
+
+    /**
+     * Write the buffered records and close the file.
+     */
+    void close();
+
+    /**
+     * @param connection    client id
+     * @param type          record type
+     * @param data          payload of CAPTURE_IN and CAPTURE_OUT
+     * @param bytes         size of payload
+     */
+    void record(uint32_t connection, CaptureType type, void const* data = nullptr, size_t bytes = 0);
+
+    /**
+     * Write the buffered records.
+     *
+     * @return              false on error
+     */
+    bool flush();
+
+    inline bool is_open() const { return -1 != m_fd; }
+
+    /**
+     * Bytes of all records, written or buffered.
+     */
+    inline uint64_t bytes() const { return m_bytes; }
+
+private:
+    int m_fd = -1;
+    std::vector<unsigned char> m_buffer;
+    uint64_t m_bytes = 0;
+}; // class CaptureWriter
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief sequential reader of a capture file.
+ *
+ * nbbt::CaptureReader reader;
+ * nbbt::CaptureRecord record;
+ * if (reader.open("traffic.cap")) {
+ *     while (reader.next(record)) {
+ *         ...
+ *     }
+ * }
+ */
+class CaptureReader
+{
+public:
+    CaptureReader() = default;
+    ~CaptureReader();
+
+    CaptureReader(CaptureReader const&) = delete;
+    CaptureReader& operator=(CaptureReader const&) = delete;
+
+    /**
+     * @param path          file path
+     * @return              false if the file cannot be opened or is no capture
+     */
+    bool open(char const* path);
+
+    /**
+     * Read the next record.
+     *
+     * @param record        receives the record
+     * @return              false at the end of the file or if the last
+     *                      record is truncated
+     */
+    bool next(CaptureRecord& record);
+
+private:
+    FILE* m_file = nullptr;
+}; // class CaptureReader
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief records the traffic of a connection.
+ *
+ * Sits on top of the other transports of a Buffer, so the capture contains the
+ * plain data the application reads and writes. Writes a CAPTURE_OPEN record
+ * when created and a CAPTURE_CLOSE record when destroyed.
+ */
+class CaptureTransport : public Transport
+{
+public:
+    /**
+     * @param writer        capture file, has to outlive the transport
+     * @param connection    client id
+     * @param socket        socket for reading and writing
+     */
+    CaptureTransport(CaptureWriter& writer, uint32_t connection, socket_t socket);
+    ~CaptureTransport() override;
+
+    CaptureTransport(CaptureTransport const&) = delete;
+    CaptureTransport& operator=(CaptureTransport const&) = delete;
+
+    /**
+     * Read and write through other transports instead of the socket.
+     *
+     * @param recv          transport to read from, nullptr for the socket
+     * @param send          transport to write to, nullptr for the socket
+     */
+    void set_lower(Transport* recv, Transport* send);
+
+    long recv(void* dest, size_t bytes) override;
+    long send(void const* src, size_t bytes) override;
+    int flush() override;
+    bool pending() const override;
+
+private:
+    CaptureWriter& m_writer;
+    uint32_t m_connection;
+    socket_t m_socket;
+    Transport* m_recv = nullptr;
+    Transport* m_send = nullptr;
+}; // class CaptureTransport
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_CAPTURE_H
@@ -0,0 +1,154 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_COMPRESSION_H
+#define LIBNBBT_COMPRESSION_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+#include "nbbt/socket.h"
+
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+enum Compression
+{
+    COMPRESSION_NONE,
+    COMPRESSION_DEFLATE,    // zlib (NBBT_HAS_ZLIB)
+    COMPRESSION_ZSTD        // zstd (NBBT_HAS_ZSTD)
+};
+
+/**
+ * Whether given algorithm was available at build time.
+ */
+bool compression_supported(Compression algorithm);
+
+/**
+ * Compression settings of a connection. Both peers have to use compression,
+ * the receiver decodes all algorithms it supports regardless of its own
+ * setting.
+ */
+struct CompressionOptions
+{
+    Compression algorithm = COMPRESSION_NONE;
+    int level = -1;             // -1: default level of the algorithm
+    size_t threshold = 256;     // smaller writes are sent uncompressed
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief stream compression between a Buffer and the socket.
+ *
+ * Every send() becomes a frame of [type:8][length:32, big endian][data]. Each
+ * connection keeps one compression stream that is flushed at the end of every
+ * frame, so the receiver can decode it immediately and the dictionary carries
+ * over to the next frame. Writes smaller than the threshold are sent raw.
+ *
+ * Buffer::flush() passes one chunk at a time, the payload never has to be
+ * contiguous. Received frames are decoded into the read buffer while they
+ * arrive.
+ *
+ * Buffer wbuffer(socket);
+ * CompressionTransport compression(options, socket);
+ * wbuffer.set_transport(&compression);
+ */
+class CompressionTransport : public Transport
+{
+public:
+    /**
+     * @param options       compression settings
+     * @param socket        socket for reading and writing frames
+     */
+    CompressionTransport(CompressionOptions const& options, socket_t socket);
+    ~CompressionTransport() override;
+
+    CompressionTransport(CompressionTransport const&) = delete;
+    CompressionTransport& operator=(CompressionTransport const&) = delete;
+
+    /**
+     * Read and write frames through other transports (e.g. TlsSession)
+     * instead of the socket.
+     *
+     * @param recv          transport to read from, nullptr for the socket
+     * @param send          transport to write to, nullptr for the socket
+     */
+    void set_lower(Transport* recv, Transport* send);
+
+    long recv(void* dest, size_t bytes) override;
+    long send(void const* src, size_t bytes) override;
+    int flush() override;
+    bool pending() const override { return m_outpos < m_out.size(); }
+
+    /**
+     * Bytes passed to send() and bytes written to the socket.
+     */
+    uint64_t bytes_in() const { return m_bytesIn; }
+    uint64_t bytes_out() const { return m_bytesOut; }
+
+private:
+    struct Codec;
+
+    long lower_recv(void* dest, size_t bytes);
+    long lower_send(void const* src, size_t bytes);
+    bool encode(unsigned char const* src, size_t bytes);
+    long decode(unsigned char* dest, size_t bytes);
+
+    CompressionOptions m_options;
+    socket_t m_socket;
+    Transport* m_recv;
+    Transport* m_send;
+    Codec* m_codec;
+
+    // encoded frames not written yet
+    std::vector<unsigned char> m_out;
+    size_t m_outpos;
+
+    // received data not decoded yet
+    std::vector<unsigned char> m_in;
+    size_t m_inpos;
+
+    // frame being decoded
+    int m_frameType;
+    size_t m_frameRemaining;
+    bool m_decoderFull;     // the decoder might hold more output
+
+    uint64_t m_bytesIn;
+    uint64_t m_bytesOut;
+}; // class CompressionTransport
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_COMPRESSION_H
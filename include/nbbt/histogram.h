@@ -0,0 +1,188 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_HISTOGRAM_H
+#define LIBNBBT_HISTOGRAM_H
+
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <time.h>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Current time of the monotonic clock in nanoseconds.
+ *
+ * CLOCK_MONOTONIC is read through the vDSO without a syscall.
+ * CLOCK_MONOTONIC_COARSE would be slightly cheaper, but its resolution of
+ * one scheduler tick is too low to time single callbacks.
+ */
+inline uint64_t clock_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * Histogram with logarithmic buckets, similar to HdrHistogram.
+ *
+ * Every power of two is divided into 2^c_sub_bucket_bits linear sub buckets,
+ * so a recorded value is off by less than 1/16 (6.25%) from the reported one.
+ * Values up to 2^64 are covered in a fixed array without any allocation.
+ *
+ * record() may only be called by a single thread (the reactor thread). All
+ * other functions may be called from any thread. Copying a histogram takes a
+ * snapshot.
+ */
+class Histogram
+{
+public:
+    static int const c_sub_bucket_bits = 4;
+    static size_t const c_sub_buckets = size_t(1) << c_sub_bucket_bits;
+    static size_t const c_buckets = (64 - c_sub_bucket_bits + 1) * c_sub_buckets;
+
+    Histogram();
+    Histogram(Histogram const& other);
+    Histogram& operator=(Histogram const& other);
+
+    /**
+     * Record a value. Not thread safe, see class description.
+     *
+     * @param value         e.g. nanoseconds
+     */
+    inline void record(uint64_t value)
+    {
+        increment(m_counts[bucket(value)], 1);
+        increment(m_count, 1);
+        increment(m_sum, value);
+        if (value > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Add all values of other histogram, e.g. of another reactor thread.
+     *
+     * @param other         histogram to add
+     */
+    void merge(Histogram const& other);
+
+    void reset();
+
+    inline uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    inline uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    inline uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+    /**
+     * Get the value below which given percentage of all values lie.
+     *
+     * @param percentile    0.0 - 100.0
+     * @return              upper bound of the bucket containing the
+     *                      percentile, 0 if empty
+     */
+    uint64_t percentile(double percentile) const;
+
+    /**
+     * Get the bucket index of given value.
+     */
+    static inline size_t bucket(uint64_t value)
+    {
+        if (value < c_sub_buckets) {
+            return static_cast<size_t>(value);
+        }
+
+        int shift = (63 - __builtin_clzll(value)) - c_sub_bucket_bits;
+        return (static_cast<size_t>(shift) + 1) * c_sub_buckets
+                + static_cast<size_t>((value >> shift) - c_sub_buckets);
+    }
+
+    /**
+     * Get the smallest value of given bucket.
+     */
+    static uint64_t bucket_lower(size_t bucket);
+
+private:
+    static inline void increment(std::atomic<uint64_t>& v, uint64_t value)
+    {
+        v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> m_counts[c_buckets];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+}; // class Histogram
+
+//------------------------------------------------------------------------------
+
+/**
+ * Latencies of an event loop in nanoseconds.
+ */
+struct LoopLatency
+{
+    Histogram wait;         // waiting for events (epoll_wait)
+    Histogram iteration;    // handling all events of one wakeup
+    Histogram read;         // draining a socket into the read buffer
+    Histogram callback;     // a single onConnected()/onReadyRead() call
+    Histogram flush;        // flushing a write buffer
+    Histogram rxqueue;      // data waiting in socket receive buffers
+
+    void merge(LoopLatency const& other);
+    void reset();
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * Time a section of code. Compiled away if NBBT_DISABLE_HISTOGRAMS is defined.
+ *
+ * NBBT_LATENCY_START(start);
+ * ...
+ * NBBT_LATENCY_RECORD(latency.read, start);
+ */
+#ifndef NBBT_DISABLE_HISTOGRAMS
+#define NBBT_LATENCY_START(name) uint64_t const name = ::nbbt::clock_ns()
+#define NBBT_LATENCY_RECORD(histogram, name) (histogram).record(::nbbt::clock_ns() - (name))
+#else
+#define NBBT_LATENCY_START(name)
+#define NBBT_LATENCY_RECORD(histogram, name)
+#endif
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_HISTOGRAM_H
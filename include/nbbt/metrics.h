@@ -0,0 +1,140 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_METRICS_H
+#define LIBNBBT_METRICS_H
+
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Runtime counters and gauges of the library.
+ *
+ * Every thread updates its own block of values, so recording is a relaxed
+ * load and store without any locked instruction or shared cache line.
+ * metrics_snapshot() sums the blocks of all threads, including the ones that
+ * have already exited.
+ *
+ * Gauges are recorded as deltas, so they may be increased on one thread and
+ * decreased on another.
+ *
+ * Define NBBT_DISABLE_METRICS to compile all recording away.
+ */
+enum Metric
+{
+    // counters
+    METRIC_BYTES_IN = 0,        // bytes received
+    METRIC_BYTES_OUT,           // bytes sent
+    METRIC_RECV_CALLS,          // ::recv() calls
+    METRIC_SEND_CALLS,          // ::send() calls
+    METRIC_EAGAIN,              // ::recv()/::send() calls that returned EAGAIN
+    METRIC_ACCEPTS,             // accepted connections
+    METRIC_CONNECTS,            // connections established by Client or ServerBase::connect()
+    METRIC_DISCONNECTS,         // closed connections
+    METRIC_REJECTS,             // connections closed right after accepting
+    METRIC_THROTTLES,           // connections stopped by a rate limit
+    METRIC_THROTTLED_NS,        // time connections waited for a rate limit
+    METRIC_RELAYED_BYTES,       // bytes passed on by ServerBase::relay()
+
+    // gauges
+    METRIC_CONNECTIONS,         // open connections
+    METRIC_BUFFERED_BYTES,      // bytes stored in buffers
+    METRIC_BUFFER_MEMORY,       // bytes allocated for buffer chunks
+    METRIC_ARENA_MEMORY,        // bytes mapped by chunk allocators
+    METRIC_HUGEPAGE_MEMORY,     // part of the above on huge pages
+    METRIC_SPILLED_MEMORY,      // bytes of buffer chunks moved to spill files
+
+    METRIC_COUNT
+};
+
+//------------------------------------------------------------------------------
+
+struct MetricsSnapshot
+{
+    int64_t values[METRIC_COUNT];
+};
+
+//------------------------------------------------------------------------------
+
+struct MetricsBlock
+{
+    std::atomic<int64_t> values[METRIC_COUNT];
+};
+
+/**
+ * Get the metrics block of the calling thread.
+ */
+MetricsBlock& metrics_block();
+
+//------------------------------------------------------------------------------
+
+/**
+ * Add value to given metric of the calling thread.
+ *
+ * @param metric        metric
+ * @param value         value to add (negative to decrease a gauge)
+ */
+inline void metrics_add(Metric metric, int64_t value = 1)
+{
+#ifndef NBBT_DISABLE_METRICS
+    // Only the owning thread writes, no read-modify-write needed.
+    std::atomic<int64_t>& v = metrics_block().values[metric];
+    v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+#else
+    (void)metric;
+    (void)value;
+#endif
+}
+
+/**
+ * Sum the metrics of all threads.
+ *
+ * @param snapshot      current values
+ */
+void metrics_snapshot(MetricsSnapshot& snapshot);
+
+/**
+ * Format metrics in the Prometheus text exposition format.
+ *
+ * @param snapshot      values to format
+ * @param text          formatted metrics
+ */
+void metrics_format_prometheus(MetricsSnapshot const& snapshot, std::string& text);
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_METRICS_H
@@ -0,0 +1,139 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_NUMA_H
+#define LIBNBBT_NUMA_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * Pin the calling thread to given CPUs.
+ *
+ * @param cpus          CPU numbers
+ * @return              false on error
+ */
+bool thread_set_affinity(std::vector<int> const& cpus);
+
+/**
+ * NUMA node of given CPU.
+ *
+ * @param cpu           CPU number
+ * @return              node, 0 without NUMA support
+ */
+int cpu_node(int cpu);
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief chunk memory of a single NUMA node.
+ *
+ * Chunks are taken from slabs bound to the node with mbind(). Released chunks
+ * are kept for reuse, the slabs are only unmapped together with the
+ * allocator. Not thread safe, every reactor uses its own allocator.
+ *
+ * With huge pages, slabs are 2 MiB aligned and mapped with MAP_HUGETLB, which
+ * needs pages reserved in /proc/sys/vm/nr_hugepages. Without reserved pages,
+ * slabs are advised as transparent huge pages (MADV_HUGEPAGE), and if that is
+ * not available either, regular pages are used.
+ *
+ * NodeChunkAllocator allocator(cpu_node(cpu));
+ * Buffer buffer(socket);
+ * buffer.set_allocator(&allocator);
+ */
+class NodeChunkAllocator : public ChunkAllocator
+{
+public:
+    /**
+     * @param node          NUMA node, -1 for the node of the first touch
+     * @param slab          bytes mapped at once, a multiple of 2 MiB with
+     *                      huge pages
+     * @param hugepages     back slabs with 2 MiB pages
+     */
+    explicit NodeChunkAllocator(int node, size_t slab = 1 << 20, bool hugepages = false);
+    ~NodeChunkAllocator() override;
+
+    NodeChunkAllocator(NodeChunkAllocator const&) = delete;
+    NodeChunkAllocator& operator=(NodeChunkAllocator const&) = delete;
+
+    unsigned char* allocate(size_t bytes) override;
+    void deallocate(unsigned char* chunk, size_t bytes) override;
+
+    inline int node() const { return m_node; }
+    inline bool hugepages() const { return m_hugepages; }
+
+    /**
+     * Bytes mapped for slabs.
+     */
+    inline size_t reserved() const { return m_slabs.size() * m_slab; }
+
+    /**
+     * Bytes of chunks currently allocated.
+     */
+    inline size_t used() const { return m_used; }
+
+    /**
+     * Bytes of slabs mapped with MAP_HUGETLB and advised with MADV_HUGEPAGE.
+     * The kernel decides whether advised slabs actually get huge pages.
+     */
+    inline size_t hugetlb() const { return m_hugetlb; }
+    inline size_t transparent() const { return m_transparent; }
+
+private:
+    void* map_huge();
+
+    bool map_slab();
+
+    int m_node;
+    bool m_hugepages;
+    bool m_tryHugetlb;  // false once MAP_HUGETLB failed
+    size_t m_slab;
+    std::vector<unsigned char*> m_slabs;
+    size_t m_offset;    // unused part of the last slab
+
+    // released chunks by size
+    std::map<size_t, std::vector<unsigned char*>> m_free;
+    size_t m_used;
+    size_t m_hugetlb;
+    size_t m_transparent;
+}; // class NodeChunkAllocator
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_NUMA_H
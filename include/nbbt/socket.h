@@ -57,6 +57,40 @@ void socket_close(socket_t socket);
 bool socket_set_nonblocking(socket_t socket);
 void log_last_socket_error();
 
+/**
+ * Create two connected non blocking sockets, e.g. to wake up a thread waiting
+ * in select(). On Windows this is a loopback TCP connection.
+ *
+ * @param sockets       both ends
+ * @return              false on error
+ */
+bool socket_pair(socket_t sockets[2]);
+
+#ifndef _WIN32
+/**
+ * Send a file descriptor (SCM_RIGHTS) together with given data over a unix
+ * domain socket. Blocks until all data is sent.
+ *
+ * @param socket        blocking unix domain socket
+ * @param fd            file descriptor to send, INVALID_SOCKET for none
+ * @param data          data to send with the file descriptor
+ * @param bytes         size of data (> 0)
+ * @return              false on error
+ */
+bool socket_send_fd(socket_t socket, socket_t fd, void const* data, size_t bytes);
+
+/**
+ * Receive data sent by socket_send_fd(). Blocks until all data is received.
+ *
+ * @param socket        blocking unix domain socket
+ * @param fd            received file descriptor, INVALID_SOCKET if none
+ * @param data          buffer for the data
+ * @param bytes         size of data (> 0)
+ * @return              false on error or closed socket
+ */
+bool socket_recv_fd(socket_t socket, socket_t& fd, void* data, size_t bytes);
+#endif
+
 //------------------------------------------------------------------------------
 
 } // namespace nbbt
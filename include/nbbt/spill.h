@@ -0,0 +1,126 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_SPILL_H
+#define LIBNBBT_SPILL_H
+
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief temporary file for buffer chunks that do not fit into memory.
+ *
+ * The file is created unlinked (O_TMPFILE), sized sparsely and mapped shared
+ * at once, so a chunk moved into the file keeps a stable address and is read
+ * like any other chunk. After copying, the pages are written back and dropped
+ * (MADV_PAGEOUT, Linux 5.4); reading pages them in again. The slot of a
+ * released chunk is punched out of the file.
+ *
+ * Not thread safe, every reactor uses its own file.
+ *
+ * SpillFile spill;
+ * spill.open("/var/tmp", 1 << 12, 1ull << 32);
+ * Buffer buffer(socket);
+ * buffer.set_spill(&spill, 1 << 20);
+ */
+class SpillFile
+{
+public:
+    SpillFile() = default;
+    ~SpillFile();
+
+    SpillFile(SpillFile const&) = delete;
+    SpillFile& operator=(SpillFile const&) = delete;
+
+    /**
+     * Create and map the file.
+     *
+     * @param directory     directory of the file, preferably not on tmpfs
+     * @param slot          chunk size of the buffers using the file
+     * @param capacity      maximum size of the file in bytes
+     * @return              false on error
+     */
+    bool open(char const* directory, size_t slot, size_t capacity);
+
+    /**
+     * Copy a chunk into a free slot.
+     *
+     * @param chunk         slot() bytes
+     * @return              address of the slot, nullptr if the file is full
+     */
+    unsigned char* store(unsigned char const* chunk);
+
+    /**
+     * Free the slot of a stored chunk.
+     *
+     * @param slot          address returned by store()
+     */
+    void release(unsigned char* slot);
+
+    /**
+     * Start reading a stored chunk back into memory ahead of its use.
+     *
+     * @param slot          address returned by store()
+     */
+    void prefetch(unsigned char const* slot);
+
+    inline bool contains(unsigned char const* p) const
+    {
+        return p >= m_base && p < m_base + m_capacity;
+    }
+
+    inline bool is_open() const { return nullptr != m_base; }
+    inline size_t slot() const { return m_slot; }
+    inline size_t capacity() const { return m_capacity; }
+
+    /**
+     * Bytes of stored chunks.
+     */
+    inline size_t used() const { return m_used; }
+
+private:
+    int m_fd = -1;
+    unsigned char* m_base = nullptr;
+    size_t m_slot = 0;
+    size_t m_capacity = 0;
+    size_t m_offset = 0;    // slots before have been used
+    size_t m_used = 0;
+    std::vector<unsigned char*> m_free;
+}; // class SpillFile
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_SPILL_H
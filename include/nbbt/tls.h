@@ -0,0 +1,206 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_TLS_H
+#define LIBNBBT_TLS_H
+
+//------------------------------------------------------------------------------
+
+#include "nbbt/Buffer.h"
+#include "nbbt/socket.h"
+
+#include <string>
+
+//------------------------------------------------------------------------------
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * TLS configuration shared by all connections of a Server or Client.
+ *
+ * Requires the library to be built with OpenSSL (NBBT_HAS_TLS), otherwise all
+ * init functions fail.
+ *
+ * The handshake is done by OpenSSL. Afterwards the record layer is moved into
+ * the kernel (kTLS) if the kernel supports it, so that writes and reads on the
+ * socket carry plaintext. Otherwise OpenSSL encrypts in userspace.
+ *
+ * Usage on loopback
+ * -----------------
+ *
+ * TlsContext server_tls;
+ * server_tls.init_server_self_signed("localhost");
+ * server.set_tls(&server_tls);
+ *
+ * TlsContext client_tls;
+ * client_tls.init_client();
+ * client_tls.trust(server_tls.certificate());
+ * client.set_tls(&client_tls);
+ * client.connect("localhost", port);
+ */
+class TlsContext
+{
+public:
+    TlsContext();
+    ~TlsContext();
+
+    TlsContext(TlsContext const&) = delete;
+    TlsContext& operator=(TlsContext const&) = delete;
+
+    /**
+     * Load certificate chain and private key (PEM).
+     *
+     * @param certificate   path of the certificate chain
+     * @param key           path of the private key
+     * @return              false on error
+     */
+    bool init_server(char const* certificate, char const* key);
+
+    /**
+     * Generate a self-signed certificate, e.g. for tests.
+     *
+     * @param common_name   host name the certificate is issued for
+     * @return              false on error
+     */
+    bool init_server_self_signed(char const* common_name);
+
+    /**
+     * Verify the peer certificate and host name.
+     *
+     * @param ca_file       trusted certificates (PEM), nullptr for the system
+     *                      default
+     * @return              false on error
+     */
+    bool init_client(char const* ca_file = nullptr);
+
+    /**
+     * Trust given certificate in addition to the ones passed to init_client().
+     *
+     * @param pem           certificate (PEM)
+     * @return              false on error
+     */
+    bool trust(std::string const& pem);
+
+    /**
+     * Own certificate (PEM), empty for clients.
+     */
+    std::string const& certificate() const { return m_certificate; }
+
+    /**
+     * Whether to try kernel TLS offload (default: true).
+     */
+    void set_ktls(bool enable);
+
+    bool is_server() const { return m_server; }
+    struct ssl_ctx_st* native() const { return m_ctx; }
+
+private:
+    bool init(bool server);
+
+    struct ssl_ctx_st* m_ctx;
+    bool m_server;
+    std::string m_certificate;
+}; // class TlsContext
+
+//------------------------------------------------------------------------------
+
+/**
+ * TLS connection on a socket.
+ *
+ * Drive handshake() until it returns 1, then use this as transport of the read
+ * and write buffer. If ktls_send() is true, the write buffer can write to the
+ * socket directly.
+ */
+class TlsSession : public Transport
+{
+public:
+    /**
+     * @param context       initialized context, must outlive this session
+     * @param socket        connected socket
+     * @param servername    host name to verify (clients only)
+     */
+    TlsSession(TlsContext& context, socket_t socket, char const* servername = nullptr);
+    ~TlsSession() override;
+
+    TlsSession(TlsSession const&) = delete;
+    TlsSession& operator=(TlsSession const&) = delete;
+
+    /**
+     * @brief continue the handshake.
+     *
+     * Blocks on a blocking socket.
+     *
+     * @return              1 on success
+     *                      0 if the socket has to become readable (or writable
+     *                        if want_write()) first
+     *                      -1 on error
+     */
+    int handshake();
+
+    bool established() const { return m_established; }
+    bool want_write() const { return m_wantWrite; }
+
+    /**
+     * Whether the kernel encrypts sent data.
+     */
+    bool ktls_send() const;
+
+    /**
+     * Whether the kernel decrypts received data.
+     */
+    bool ktls_recv() const;
+
+    /**
+     * Send close_notify, does not wait for the peer.
+     */
+    void shutdown();
+
+    long recv(void* dest, size_t bytes) override;
+    long send(void const* src, size_t bytes) override;
+
+private:
+    struct ssl_st* m_ssl;
+    bool m_established;
+    bool m_wantWrite;
+
+    // OpenSSL expects a write that would block to be repeated with the same
+    // data, the write buffer might present less at a time.
+    std::string m_retry;
+    size_t m_ahead;
+}; // class TlsSession
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_TLS_H
@@ -23,12 +23,17 @@
  */
 
 #include "nbbt/Buffer.h"
+#include "nbbt/metrics.h"
+#include "nbbt/spill.h"
 
 #include <cassert>
 #include <errno.h>
 #include <algorithm>
 #include <cstring>
 #include <limits>
+#ifndef _WIN32
+#include <linux/net_tstamp.h>
+#endif
 
 //------------------------------------------------------------------------------
 
@@ -36,8 +41,15 @@ namespace nbbt {
 
 //------------------------------------------------------------------------------
 
+size_t const Buffer::c_inline_size;
+size_t const Buffer::c_spill_head;
+
+//------------------------------------------------------------------------------
+
 Buffer::Buffer(socket_t socket, size_t chunksize)
-    : m_socket(socket), m_chunksize(chunksize), m_writepos(0), m_readpos(0)
+    : m_socket(socket), m_transport(nullptr), m_allocator(nullptr)
+    , m_spill(nullptr), m_spillBudget(0), m_spilled(0), m_spillEnd(0), m_chunksize(chunksize), m_readpos(0), m_writepos(0)
+    , m_first(0), m_timestamps(false), m_removed(0), m_firstStamp(0)
 {
 
 }
@@ -56,23 +68,184 @@ void Buffer::_append(const unsigned char* src, size_t bytes)
     assert(src);
     assert(bytes > 0);
 
+    // tiny messages stay in the inline segment
+    if (0 == _chunks()) {
+        if (m_writepos + bytes <= _inline()) {
+            ::memcpy(m_inline + m_writepos, src, bytes);
+            m_writepos += bytes;
+            metrics_add(METRIC_BUFFERED_BYTES, bytes);
+            return;
+        }
+        _leave_inline();
+    }
+
+    // one chunk at a time, so the previous ones can be spilled in between
+    if (m_spill && bytes > (size_t(1) << m_chunksize)) {
+        while (bytes > 0) {
+            size_t to_append = std::min(bytes, size_t(1) << m_chunksize);
+            _append(src, to_append);
+            src += to_append;
+            bytes -= to_append;
+        }
+        return;
+    }
+
     // add required chunks
-    while ((m_writepos + bytes) > (m_chunks.size() << m_chunksize)) {
-        m_chunks.push_back(new unsigned char[1 << m_chunksize]);
+    bool allocated = false;
+    while ((m_writepos + bytes) > (_chunks() << m_chunksize)) {
+        m_chunks.push_back(_allocate());
+        metrics_add(METRIC_BUFFER_MEMORY, 1 << m_chunksize);
+        allocated = true;
     }
 
+    metrics_add(METRIC_BUFFERED_BYTES, bytes);
+
     // copy data chunk wise
     while (bytes > 0) {
         size_t chunk = m_writepos >> m_chunksize;
         size_t chunk_idx = m_writepos - (chunk << m_chunksize);
         size_t to_copy = std::min(bytes, (1 << m_chunksize) - chunk_idx);
-        ::memcpy(reinterpret_cast<void*>(m_chunks[chunk] + chunk_idx), src, to_copy);
+        ::memcpy(reinterpret_cast<void*>(_chunk(chunk) + chunk_idx), src, to_copy);
         m_writepos += to_copy;
         bytes -= to_copy;
         src += to_copy;
     }
 
     assert(bytes == 0);
+
+    if (allocated && m_spill) {
+        _page_out();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+unsigned char* Buffer::tail(size_t& bytes)
+{
+    if (0 == _chunks()) {
+        if (m_writepos < _inline()) {
+            bytes = _inline() - m_writepos;
+            return m_inline + m_writepos;
+        }
+        _leave_inline();
+    }
+
+    size_t chunk = m_writepos >> m_chunksize;
+    if (chunk == _chunks()) {
+        m_chunks.push_back(_allocate());
+        metrics_add(METRIC_BUFFER_MEMORY, 1 << m_chunksize);
+        if (m_spill) {
+            _page_out();
+        }
+    }
+
+    size_t chunk_idx = m_writepos - (chunk << m_chunksize);
+    bytes = (1 << m_chunksize) - chunk_idx;
+    return _chunk(chunk) + chunk_idx;
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::commit(size_t bytes)
+{
+    assert(m_writepos + bytes <= (0 == _chunks() ? _inline() : _chunks() << m_chunksize));
+
+    m_writepos += bytes;
+    metrics_add(METRIC_BUFFERED_BYTES, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::_leave_inline()
+{
+    // the positions stay valid, the inline segment is smaller than a chunk
+    unsigned char* chunk = _allocate();
+    ::memcpy(chunk, m_inline, m_writepos);
+    m_chunks.push_back(chunk);
+    metrics_add(METRIC_BUFFER_MEMORY, 1 << m_chunksize);
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::_page_out()
+{
+    // the spilled chunks are contiguous and grow towards the tail
+    size_t written = m_writepos >> m_chunksize;
+    while (((_chunks() - m_spilled) << m_chunksize) > m_spillBudget) {
+        size_t chunk = 0 == m_spilled ? c_spill_head : m_spillEnd;
+        if (chunk >= written) {
+            break;
+        }
+
+        unsigned char* slot = m_spill->store(m_chunks[m_first + chunk]);
+        if (!slot) {
+            break;
+        }
+
+        _deallocate(m_chunks[m_first + chunk]);
+        metrics_add(METRIC_BUFFER_MEMORY, -(1 << m_chunksize));
+        m_chunks[m_first + chunk] = slot;
+        m_spilled += 1;
+        m_spillEnd = chunk + 1;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::_pop_front()
+{
+    // drop the unused front of the vector once it dominates
+    if (++m_first >= 16 && m_first * 2 >= m_chunks.size()) {
+        m_chunks.erase(m_chunks.begin(), m_chunks.begin() + m_first);
+        m_first = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+unsigned char* Buffer::_allocate()
+{
+    return m_allocator ? m_allocator->allocate(size_t(1) << m_chunksize)
+                       : new unsigned char[1 << m_chunksize];
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::_deallocate(unsigned char* chunk)
+{
+    if (m_spill && m_spill->contains(chunk)) {
+        m_spill->release(chunk);
+    } else if (m_allocator) {
+        m_allocator->deallocate(chunk, size_t(1) << m_chunksize);
+    } else {
+        delete [] chunk;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::set_allocator(ChunkAllocator* allocator)
+{
+    assert(available() == 0);
+
+    clear();
+    m_allocator = allocator;
+}
+
+//------------------------------------------------------------------------------
+
+bool Buffer::set_spill(SpillFile* spill, size_t budget)
+{
+    assert(available() == 0);
+
+    if (spill && spill->slot() != (size_t(1) << m_chunksize)) {
+        return false;
+    }
+
+    clear();
+    m_spill = spill;
+    m_spillBudget = budget;
+    return true;
 }
 
 //------------------------------------------------------------------------------
@@ -81,15 +254,18 @@ int Buffer::_send(const unsigned char* src, size_t bytes, size_t& sent)
 {
     sent = 0;
 
+    metrics_add(METRIC_SEND_CALLS);
 #ifdef _WIN32
     int ret = ::send(m_socket, reinterpret_cast<char const*>(src), static_cast<int>(bytes), 0);
     if (-1 == ret) {
         if (WSAGetLastError() == WSAEWOULDBLOCK) {
 #else
-    ssize_t ret = ::send(m_socket, reinterpret_cast<void const*>(src), bytes, 0);
+    ssize_t ret = m_transport ? m_transport->send(src, bytes)
+                              : ::send(m_socket, reinterpret_cast<void const*>(src), bytes, 0);
     if (-1 == ret) {
         if (errno == EAGAIN) {
 #endif
+            metrics_add(METRIC_EAGAIN);
             return 1;
         } else {
             return -1;
@@ -98,6 +274,7 @@ int Buffer::_send(const unsigned char* src, size_t bytes, size_t& sent)
         return 0;
     } else if (ret > 0) {
         sent = static_cast<size_t>(ret);
+        metrics_add(METRIC_BYTES_OUT, ret);
         return 1;
     }
 }
@@ -114,7 +291,7 @@ void Buffer::memcpy(unsigned char* dst, size_t bytes)
         size_t chunk = pos >> m_chunksize;
         size_t chunk_idx = pos - (chunk << m_chunksize);
         size_t to_copy = std::min(bytes, (1 << m_chunksize) - chunk_idx);
-        ::memcpy(dst, reinterpret_cast<void*>(m_chunks[chunk] + chunk_idx), to_copy);
+        ::memcpy(dst, reinterpret_cast<void*>(_chunk(chunk) + chunk_idx), to_copy);
         bytes -= to_copy;
         dst += to_copy;
         pos += to_copy;
@@ -128,22 +305,58 @@ void Buffer::memcpy(unsigned char* dst, size_t bytes)
 void Buffer::remove(size_t bytes)
 {
     m_readpos += bytes;
+    metrics_add(METRIC_BUFFERED_BYTES, -static_cast<int64_t>(bytes));
+
+    if (m_timestamps) {
+        m_removed += bytes;
+        _drop_timestamps();
+    }
+
+    // the inline segment is reused from its beginning
+    if (0 == _chunks()) {
+        if (m_readpos == m_writepos) {
+            m_readpos = 0;
+            m_writepos = 0;
+        }
+        return;
+    }
 
     // move every chunk that has been completely removed to the end of the chunks.
     while (m_readpos > (1 << m_chunksize)) {
-        unsigned char* chunk = m_chunks.front();
-        m_chunks.pop_front();
+        unsigned char* chunk = m_chunks[m_first];
+        _pop_front();
 
-        // at max only store twice the amount of chunks as currently needed
-        if (m_chunks.size() < (m_readpos >> m_chunksize) * 2) {
+        bool spilled = m_spilled > 0 && m_spilled == m_spillEnd;
+        if (m_spillEnd > 0) {
+            m_spillEnd -= 1;
+            m_spilled -= spilled ? 1 : 0;
+        }
+
+        if (spilled) {
+            _deallocate(chunk);
+        } else if (_chunks() < (m_readpos >> m_chunksize) * 2) {
+            // at max only store twice the amount of chunks as currently needed
             m_chunks.push_back(chunk);
         } else {
-            delete [] chunk;
+            _deallocate(chunk);
+            metrics_add(METRIC_BUFFER_MEMORY, -(1 << m_chunksize));
+        }
+
+        // read the next spilled chunk back before it is needed
+        size_t next = c_spill_head - 1;
+        if (m_spilled > 0 && next + m_spilled >= m_spillEnd && next < m_spillEnd) {
+            m_spill->prefetch(_chunk(next));
         }
 
         m_readpos -= 1 << m_chunksize;
         m_writepos -= 1 << m_chunksize;
     }
+
+    // an emptied buffer starts over at its first chunk
+    if (m_readpos == m_writepos && 0 == m_spilled) {
+        m_readpos = 0;
+        m_writepos = 0;
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -154,15 +367,19 @@ int Buffer::read(size_t& bytes_read)
     bytes_read = 0;
     unsigned char buffer[4096];
     for (;;) {
+        metrics_add(METRIC_RECV_CALLS);
 #ifdef _WIN32
         int read = ::recv(m_socket, reinterpret_cast<char*>(buffer), 4096, 0);
         if (-1 == read) {
             if (WSAGetLastError() == WSAEWOULDBLOCK) {
 #else
-        ssize_t read = ::recv(m_socket, buffer, 4096, 0);
+        ssize_t read = m_transport ? m_transport->recv(buffer, 4096)
+                     : m_timestamps ? _recv_timestamped(buffer, 4096)
+                                    : ::recv(m_socket, buffer, 4096, 0);
         if (-1 == read) {
             if (errno == EAGAIN) {
 #endif
+                metrics_add(METRIC_EAGAIN);
                 return 1;
             } else {
                 return -1;
@@ -170,6 +387,7 @@ int Buffer::read(size_t& bytes_read)
         } else if (0 == read) {
             return 0;
         } else {
+            metrics_add(METRIC_BYTES_IN, read);
             _append(buffer, read);
             bytes_read = available();
         }
@@ -180,32 +398,70 @@ int Buffer::read(size_t& bytes_read)
 
 void Buffer::clear()
 {
-    for (unsigned char* chunk : m_chunks) {
-        delete [] chunk;
+    metrics_add(METRIC_BUFFERED_BYTES, -static_cast<int64_t>(available()));
+    metrics_add(METRIC_BUFFER_MEMORY, -static_cast<int64_t>(capacity() - spilled()));
+
+    for (size_t i = m_first; i < m_chunks.size(); ++i) {
+        _deallocate(m_chunks[i]);
     }
+    m_spilled = 0;
+    m_spillEnd = 0;
+
+    m_removed += available();
+    m_stamps.clear();
+    m_firstStamp = 0;
 
-    m_chunks.clear();
+    // also releases the memory of the vector
+    std::vector<unsigned char*>().swap(m_chunks);
+    m_first = 0;
     m_writepos = 0;
     m_readpos = 0;
 }
 
 //------------------------------------------------------------------------------
 
-bool Buffer::get_string(std::string& string, bool take)
+void Buffer::shrink()
 {
-    string.clear();
+    if (0 == _chunks()) {
+        return;
+    }
 
-    size_t end = std::numeric_limits<size_t>::max();
-    for (size_t i = m_readpos; i < m_writepos; ++i) {
-        size_t chunk = i >> m_chunksize;
-        size_t idx = i - (chunk << m_chunksize);
-        if (m_chunks[chunk][idx] == '\0') {
-            end = i;
-            break;
+    size_t bytes = available();
+    if (bytes <= _inline()) {
+        // small enough for the inline segment, the data keeps its timestamps
+        unsigned char data[c_inline_size];
+        memcpy(data, bytes);
+        uint64_t removed = m_removed;
+        std::vector<std::pair<uint64_t, uint64_t>> stamps;
+        stamps.swap(m_stamps);
+        size_t firstStamp = m_firstStamp;
+        clear();
+        if (bytes > 0) {
+            _append(data, bytes);
         }
+        m_removed = removed;
+        m_stamps.swap(stamps);
+        m_firstStamp = firstStamp;
+        return;
+    }
+
+    // release the chunks behind the data
+    size_t used = (m_writepos + (1 << m_chunksize) - 1) >> m_chunksize;
+    while (_chunks() > used) {
+        _deallocate(m_chunks.back());
+        m_chunks.pop_back();
+        metrics_add(METRIC_BUFFER_MEMORY, -(1 << m_chunksize));
     }
+}
+
+//------------------------------------------------------------------------------
 
-    if (end == std::numeric_limits<size_t>::max()) {
+bool Buffer::get_string(std::string& string, bool take)
+{
+    string.clear();
+
+    size_t end;
+    if (!find('\0', end)) {
         return false;
     }
 
@@ -229,6 +485,147 @@ bool Buffer::get_string(std::string& string, bool take)
 
 //------------------------------------------------------------------------------
 
+bool Buffer::find(unsigned char delim, size_t& offset, size_t start) const
+{
+    // search chunk wise
+    size_t pos = m_readpos + start;
+    while (pos < m_writepos) {
+        size_t chunk = pos >> m_chunksize;
+        size_t chunk_idx = pos - (chunk << m_chunksize);
+        size_t to_search = std::min(m_writepos - pos, (1 << m_chunksize) - chunk_idx);
+        void const* found = ::memchr(_chunk(chunk) + chunk_idx, delim, to_search);
+        if (found) {
+            offset = pos + (static_cast<unsigned char const*>(found) - (_chunk(chunk) + chunk_idx)) - m_readpos;
+            return true;
+        }
+        pos += to_search;
+    }
+
+    return false;
+}
+
+//------------------------------------------------------------------------------
+
+unsigned char const* Buffer::peek(size_t offset, size_t& bytes) const
+{
+    size_t pos = m_readpos + offset;
+    if (pos >= m_writepos) {
+        bytes = 0;
+        return nullptr;
+    }
+
+    size_t chunk = pos >> m_chunksize;
+    size_t chunk_idx = pos - (chunk << m_chunksize);
+    bytes = std::min(m_writepos - pos, (1 << m_chunksize) - chunk_idx);
+    return _chunk(chunk) + chunk_idx;
+}
+
+//------------------------------------------------------------------------------
+
+bool Buffer::set_timestamps(bool enable)
+{
+#if defined(SO_TIMESTAMPING) && !defined(_WIN32)
+    int flags = enable ? SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+    if (-1 == ::setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+        return false;
+    }
+
+    m_timestamps = enable;
+    m_removed = 0;
+    m_stamps.clear();
+    m_firstStamp = 0;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+bool Buffer::timestamp(size_t offset, uint64_t& ns) const
+{
+    // the last read that started at or before offset
+    std::pair<uint64_t, uint64_t> key(m_removed + offset, UINT64_MAX);
+    auto it = std::upper_bound(m_stamps.begin() + m_firstStamp, m_stamps.end(), key);
+    if (it == m_stamps.begin() + m_firstStamp || offset >= available()) {
+        return false;
+    }
+
+    ns = (it - 1)->second;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+long Buffer::_recv_timestamped(unsigned char* dest, size_t bytes)
+{
+#if defined(SO_TIMESTAMPING) && !defined(_WIN32)
+    struct iovec iov;
+    iov.iov_base = dest;
+    iov.iov_len = bytes;
+
+    // struct scm_timestamping, the software timestamp comes first
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t ret = ::recvmsg(m_socket, &msg, 0);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (SOL_SOCKET != cmsg->cmsg_level || SCM_TIMESTAMPING != cmsg->cmsg_type) {
+            continue;
+        }
+
+        struct timespec ts;
+        ::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        uint64_t ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+
+        // consecutive reads of the same segments report the same time
+        if (0 != ns && (m_stamps.size() == m_firstStamp || m_stamps.back().second != ns)) {
+            m_stamps.push_back(std::make_pair(m_removed + available(), ns));
+        }
+    }
+
+    return ret;
+#else
+    return ::recv(m_socket, reinterpret_cast<char*>(dest), static_cast<int>(bytes), 0);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void Buffer::_drop_timestamps()
+{
+    if (0 == available()) {
+        m_stamps.clear();
+        m_firstStamp = 0;
+        return;
+    }
+
+    // keep the timestamp of the read the first byte belongs to
+    while (m_firstStamp + 1 < m_stamps.size() && m_stamps[m_firstStamp + 1].first <= m_removed) {
+        ++m_firstStamp;
+    }
+
+    if (m_firstStamp >= 16 && m_firstStamp * 2 >= m_stamps.size()) {
+        m_stamps.erase(m_stamps.begin(), m_stamps.begin() + m_firstStamp);
+        m_firstStamp = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
 int Buffer::send(unsigned char const* src, size_t bytes)
 {
     // If the buffer already contains data, we try to flush that first.
@@ -260,26 +657,45 @@ int Buffer::send(unsigned char const* src, size_t bytes)
 
 //------------------------------------------------------------------------------
 
-int Buffer::flush()
+void Buffer::append(unsigned char const* src, size_t bytes)
 {
+    if (bytes > 0) {
+        _append(src, bytes);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int Buffer::flush(size_t limit)
+{
+    if (m_transport && m_transport->pending()) {
+        int ret = m_transport->flush();
+        if (1 != ret) {
+            return ret < 0 ? -1 : 1;
+        }
+    }
+
     if (available() == 0) {
         return 1;
     }
 
-    size_t pos = m_readpos;
-    while (pos < m_writepos) {
-        size_t chunk = pos >> m_chunksize;
-        size_t chunk_idx = pos - (chunk << m_chunksize);
-        size_t to_send = std::min(m_writepos - pos, (1 << m_chunksize) - chunk_idx);
+    while (m_readpos < m_writepos && limit > 0) {
+        size_t chunk = m_readpos >> m_chunksize;
+        size_t chunk_idx = m_readpos - (chunk << m_chunksize);
+        size_t to_send = std::min(m_writepos - m_readpos, (1 << m_chunksize) - chunk_idx);
+        to_send = std::min(to_send, limit);
+        metrics_add(METRIC_SEND_CALLS);
 #ifdef _WIN32
-        int sent = ::send(m_socket, (const char*)(m_chunks[chunk] + chunk_idx), static_cast<int>(to_send), 0);
+        int sent = ::send(m_socket, (const char*)(_chunk(chunk) + chunk_idx), static_cast<int>(to_send), 0);
         if (-1 == sent) {
             if (WSAGetLastError() == WSAEWOULDBLOCK) {
 #else
-        ssize_t sent = ::send(m_socket, reinterpret_cast<void*>(m_chunks[chunk] + chunk_idx), to_send, 0);
+        ssize_t sent = m_transport ? m_transport->send(_chunk(chunk) + chunk_idx, to_send)
+                                   : ::send(m_socket, reinterpret_cast<void*>(_chunk(chunk) + chunk_idx), to_send, 0);
         if (-1 == sent) {
             if (errno == EAGAIN) {
 #endif
+                metrics_add(METRIC_EAGAIN);
                 return 1;
             } else {
                 return -1;
@@ -288,7 +704,9 @@ int Buffer::flush()
             return 0;
         }
 
-        pos += static_cast<size_t>(sent);
+        metrics_add(METRIC_BYTES_OUT, sent);
+        remove(static_cast<size_t>(sent));
+        limit -= static_cast<size_t>(sent);
     }
 
     return 1;
@@ -23,8 +23,11 @@
  */
 
 #include "nbbt/Client.h"
-#include "nbbt/log.h"
+#include "nbbt/compression.h"
+#include "nbbt/metrics.h"
+#include "log.h"
 #include "nbbt/socket.h"
+#include "nbbt/tls.h"
 
 #include <string.h>
 #include <map>
@@ -37,7 +40,23 @@ namespace nbbt {
 
 struct Client::ClientImpl
 {
+    bool connect(struct in_addr const& address, int port, char const* host);
+    void attach(Buffer& rbuffer, Buffer& wbuffer);
+    void close();
+
     socket_t socket = INVALID_SOCKET;
+    Resolver* resolver = &Resolver::instance();
+
+    TlsContext* tlsContext = nullptr;
+    TlsSession* tls = nullptr;
+
+    CompressionOptions compressionOptions;
+    CompressionTransport* compression = nullptr;
+
+    // pending asynchronous connect
+    std::string host;
+    int port = 0;
+    socket_t notify[2] = { INVALID_SOCKET, INVALID_SOCKET };
 };
 
 //------------------------------------------------------------------------------
@@ -53,72 +72,214 @@ Client::Client()
 
 Client::~Client()
 {
+    if (INVALID_SOCKET != p->notify[0]) {
+        p->resolver->cancel(p->notify[1]);
+        socket_close(p->notify[0]);
+        socket_close(p->notify[1]);
+    }
+
+    if (INVALID_SOCKET != p->socket) {
+        p->close();
+    }
+
     delete p;
 }
 
 //------------------------------------------------------------------------------
 
+bool Client::ClientImpl::connect(struct in_addr const& address, int port, char const* host)
+{
+    socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (INVALID_SOCKET == socket) {
+        log_last_socket_error();
+        return false;
+    }
+
+    struct sockaddr_in server;
+    ::memset(&server, 0, sizeof(server));
+    server.sin_addr = address;
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+
+    int ret = ::connect(socket, (struct sockaddr*)&server, sizeof(server));
+    if (ret != 0) {
+#ifdef _WIN32
+        if (WSAGetLastError() != WSAECONNREFUSED) {
+#else
+        if (errno != ECONNREFUSED) {
+#endif
+            log_last_socket_error();
+        }
+
+        socket_close(socket);
+        socket = INVALID_SOCKET;
+        return false;
+    }
+
+    // the handshake blocks, the socket is still blocking
+    if (tlsContext) {
+        tls = new TlsSession(*tlsContext, socket, host);
+        if (1 != tls->handshake()) {
+            delete tls;
+            tls = nullptr;
+            socket_close(socket);
+            socket = INVALID_SOCKET;
+            return false;
+        }
+    }
+
+    // Buffer::read() reads until EAGAIN
+    if (!socket_set_nonblocking(socket)) {
+        log_last_socket_error();
+        delete tls;
+        tls = nullptr;
+        socket_close(socket);
+        socket = INVALID_SOCKET;
+        return false;
+    }
+
+    metrics_add(METRIC_CONNECTS);
+    metrics_add(METRIC_CONNECTIONS, 1);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void Client::ClientImpl::attach(Buffer& rbuffer, Buffer& wbuffer)
+{
+    wbuffer.set_socket(socket);
+    rbuffer.set_socket(socket);
+
+    // with kTLS the kernel encrypts what is written to the socket
+    Transport* recv = tls;
+    Transport* send = tls && !tls->ktls_send() ? tls : nullptr;
+
+    if (COMPRESSION_NONE != compressionOptions.algorithm) {
+        delete compression;
+        compression = new CompressionTransport(compressionOptions, socket);
+        compression->set_lower(recv, send);
+        recv = compression;
+        send = compression;
+    }
+
+    rbuffer.set_transport(recv);
+    wbuffer.set_transport(send);
+}
+
+//------------------------------------------------------------------------------
+
+void Client::ClientImpl::close()
+{
+    if (tls) {
+        tls->shutdown();
+        delete tls;
+        tls = nullptr;
+    }
+    delete compression;
+    compression = nullptr;
+
+    socket_close(socket);
+    socket = INVALID_SOCKET;
+    metrics_add(METRIC_DISCONNECTS);
+    metrics_add(METRIC_CONNECTIONS, -1);
+}
+
+//------------------------------------------------------------------------------
+
 bool Client::connect(char const* host, int port)
 {
     if (p->socket != INVALID_SOCKET) {
         return true;
     }
 
-    p->socket = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == p->socket) {
-        log_last_socket_error();
+    struct in_addr address;
+    if (!p->resolver->lookup(host, address)) {
         return false;
     }
 
-    struct sockaddr_in server;
-    ::memset(&server, 0, sizeof(server));
-    server.sin_addr.s_addr = ::inet_addr(host);
+    if (!p->connect(address, port, host)) {
+        return false;
+    }
 
-    if (INADDR_NONE == server.sin_addr.s_addr) {
-        struct hostent* he;
-        struct in_addr** addr_list;
+    p->attach(rbuffer, wbuffer);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool Client::connect_async(char const* host, int port)
+{
+    if (p->socket != INVALID_SOCKET || !p->host.empty()) {
+        return true;
+    }
 
-        // resolve the hostname
-        if ((he = ::gethostbyname(host)) == NULL) {
-            LOG_ERR_F(u8"Failed to resolve \"%s\".", host);
+    struct in_addr address;
+    switch (p->resolver->lookup_cached(host, address)) {
+    case 1:
+    {
+        if (!p->connect(address, port, host)) {
             return false;
         }
 
-        // We currently only support IPv4
-        if (he->h_addrtype != AF_INET) {
-            LOG_ERR("Only IPv4 supported!");
+        p->attach(rbuffer, wbuffer);
+        onConnected();
+        return true;
+    } break;
+    case 0:
+    {
+        return false;
+    } break;
+    default: // -1
+    {
+        if (INVALID_SOCKET == p->notify[0] && !socket_pair(p->notify)) {
+            log_last_socket_error();
             return false;
         }
 
-        addr_list = (struct in_addr**)he->h_addr_list;
+        p->host = host;
+        p->port = port;
+        p->resolver->resolve_async(host, p->notify[1]);
+        return true;
+    } break;
+    }
+}
 
-        for (int i = 0; addr_list[i]; ++i) {
-            server.sin_addr = *addr_list[i];
-            break;
-        }
+//------------------------------------------------------------------------------
+
+bool Client::set_resolver(Resolver* resolver)
+{
+    // the pending lookup would never complete
+    if (!p->host.empty()) {
+        return false;
     }
 
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
+    p->resolver = resolver;
+    return true;
+}
 
-    int ret = ::connect(p->socket, (struct sockaddr*)&server, sizeof(server));
-    if (ret != 0) {
-#ifdef _WIN32
-        if (WSAGetLastError() != WSAECONNREFUSED) {
-#else
-        if (errno != ECONNREFUSED) {
-#endif
-            log_last_socket_error();
-        }
+//------------------------------------------------------------------------------
 
-        socket_close(p->socket);
-        p->socket = INVALID_SOCKET;
+bool Client::set_tls(TlsContext* context)
+{
+    if (context && (!context->native() || context->is_server())) {
+        LOG_ERR(u8"TLS context is not initialized as client");
         return false;
     }
 
-    wbuffer.set_socket(p->socket);
-    rbuffer.set_socket(p->socket);
+    p->tlsContext = context;
+    return true;
+}
+
+//------------------------------------------------------------------------------
 
+bool Client::set_compression(CompressionOptions const& options)
+{
+    if (!compression_supported(options.algorithm)) {
+        LOG_ERR(u8"Compression algorithm not supported by this build");
+        return false;
+    }
+
+    p->compressionOptions = options;
     return true;
 }
 
@@ -127,7 +288,54 @@ bool Client::connect(char const* host, int port)
 bool Client::run()
 {
     if (INVALID_SOCKET == p->socket) {
-        return false;
+        if (p->host.empty()) {
+            return false;
+        }
+
+        // wait for the pending name resolution
+        fd_set rset;
+        FD_ZERO(&rset);
+        FD_SET(p->notify[0], &rset);
+#ifdef _WIN32
+        if (::select(0, &rset, nullptr, nullptr, nullptr) == -1) {
+#else
+        if (::select(p->notify[0] + 1, &rset, nullptr, nullptr, nullptr) == -1) {
+#endif
+            log_last_socket_error();
+            return false;
+        }
+
+        char drain[16];
+        while (::recv(p->notify[0], drain, sizeof(drain), 0) > 0);
+
+        std::string host;
+        host.swap(p->host);
+
+        struct in_addr address;
+        switch (p->resolver->lookup_cached(host.c_str(), address)) {
+        case 1:
+        {
+            if (!p->connect(address, p->port, host.c_str())) {
+                onDisconnected();
+                return false;
+            }
+
+            p->attach(rbuffer, wbuffer);
+            onConnected();
+            return true;
+        } break;
+        case 0:
+        {
+            onDisconnected();
+            return false;
+        } break;
+        default: // -1, expired before we got here
+        {
+            p->host.swap(host);
+            p->resolver->resolve_async(p->host.c_str(), p->notify[1]);
+            return true;
+        } break;
+        }
     }
 
     fd_set rset, wset;
@@ -137,7 +345,7 @@ bool Client::run()
     fd_set* rset_ptr = &rset;
     fd_set* wset_ptr = nullptr;
 
-    if (wbuffer.available() > 0) {
+    if (wbuffer.pending()) {
         FD_ZERO(&wset);
         FD_SET(p->socket, &wset);
         wset_ptr = &wset;
@@ -170,8 +378,9 @@ bool Client::run()
     } break;
     case 0:
     {
-        socket_close(p->socket);
-        p->socket = INVALID_SOCKET;
+        p->close();
+        rbuffer.set_transport(nullptr);
+        wbuffer.set_transport(nullptr);
         onDisconnected();
         rbuffer.clear();
         wbuffer.clear();
@@ -0,0 +1,264 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/Cursor.h"
+
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+static size_t const c_max_varint = 10;
+
+//------------------------------------------------------------------------------
+
+ReadCursor::ReadCursor(Buffer const& buffer, size_t offset)
+    : m_buffer(buffer), m_offset(0), m_ptr(nullptr), m_end(nullptr), m_error(false)
+{
+    seek(offset);
+}
+
+//------------------------------------------------------------------------------
+
+void ReadCursor::seek(size_t offset)
+{
+    m_offset = offset;
+
+    size_t bytes;
+    m_ptr = m_buffer.peek(offset, bytes);
+    m_end = m_ptr + bytes;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReadCursor::read_bytes(unsigned char* dest, size_t bytes)
+{
+    if (remaining() < bytes) {
+        return false;
+    }
+
+    size_t offset = m_offset;
+    while (bytes > 0) {
+        size_t contiguous;
+        unsigned char const* src = m_buffer.peek(offset, contiguous);
+        size_t to_copy = std::min(bytes, contiguous);
+        ::memcpy(dest, src, to_copy);
+        dest += to_copy;
+        offset += to_copy;
+        bytes -= to_copy;
+    }
+
+    seek(offset);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReadCursor::skip(size_t bytes)
+{
+    if (remaining() < bytes) {
+        return false;
+    }
+
+    seek(m_offset + bytes);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReadCursor::read_varint(uint64_t& value)
+{
+    uint64_t result = 0;
+
+    // the longest varint is within the current chunk
+    if (static_cast<size_t>(m_end - m_ptr) >= c_max_varint) {
+        for (size_t i = 0; i < c_max_varint; ++i) {
+            unsigned char byte = m_ptr[i];
+            result |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+            if (0 == (byte & 0x80)) {
+                m_ptr += i + 1;
+                m_offset += i + 1;
+                value = result;
+                return true;
+            }
+        }
+
+        m_error = true;
+        return false;
+    }
+
+    size_t start = m_offset;
+    for (size_t i = 0; i < c_max_varint; ++i) {
+        uint8_t byte;
+        if (!read<uint8_t, true>(byte)) {
+            seek(start);
+            return false;
+        }
+
+        result |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (0 == (byte & 0x80)) {
+            value = result;
+            return true;
+        }
+    }
+
+    seek(start);
+    m_error = true;
+    return false;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReadCursor::read_svarint(int64_t& value)
+{
+    uint64_t zigzag;
+    if (!read_varint(zigzag)) {
+        return false;
+    }
+
+    value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReadCursor::read_string(std::string& string, size_t max)
+{
+    size_t start = m_offset;
+
+    uint64_t length;
+    if (!read_varint(length)) {
+        return false;
+    }
+
+    if (length > max) {
+        seek(start);
+        m_error = true;
+        return false;
+    }
+
+    if (remaining() < length) {
+        seek(start);
+        return false;
+    }
+
+    string.resize(static_cast<size_t>(length));
+    if (length > 0) {
+        read_bytes(reinterpret_cast<unsigned char*>(&string[0]), static_cast<size_t>(length));
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+WriteCursor::WriteCursor(Buffer& buffer)
+    : m_buffer(buffer), m_start(nullptr), m_ptr(nullptr), m_end(nullptr), m_written(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+WriteCursor::~WriteCursor()
+{
+    commit();
+}
+
+//------------------------------------------------------------------------------
+
+void WriteCursor::commit()
+{
+    size_t bytes = static_cast<size_t>(m_ptr - m_start);
+    if (bytes > 0) {
+        m_buffer.commit(bytes);
+        m_written += bytes;
+        m_start = m_ptr;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void WriteCursor::write_bytes(unsigned char const* src, size_t bytes)
+{
+    while (bytes > 0) {
+        if (m_ptr == m_end) {
+            // the chunk is full, continue in the next one
+            commit();
+            size_t free;
+            m_ptr = m_buffer.tail(free);
+            m_start = m_ptr;
+            m_end = m_ptr + free;
+        }
+
+        size_t to_copy = std::min(bytes, static_cast<size_t>(m_end - m_ptr));
+        ::memcpy(m_ptr, src, to_copy);
+        m_ptr += to_copy;
+        src += to_copy;
+        bytes -= to_copy;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void WriteCursor::write_varint(uint64_t value)
+{
+    unsigned char bytes[c_max_varint];
+    bool direct = static_cast<size_t>(m_end - m_ptr) >= c_max_varint;
+    unsigned char* dest = direct ? m_ptr : bytes;
+
+    size_t length = 0;
+    while (value >= 0x80) {
+        dest[length++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    dest[length++] = static_cast<unsigned char>(value);
+
+    if (direct) {
+        m_ptr += length;
+    } else {
+        write_bytes(bytes, length);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void WriteCursor::write_svarint(int64_t value)
+{
+    write_varint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+//------------------------------------------------------------------------------
+
+void WriteCursor::write_string(char const* string, size_t length)
+{
+    write_varint(length);
+    write_bytes(reinterpret_cast<unsigned char const*>(string), length);
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
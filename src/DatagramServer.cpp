@@ -0,0 +1,493 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/DatagramServer.h"
+#include "nbbt/BasicServer.h"
+#include "nbbt/metrics.h"
+#include "log.h"
+
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+// receive buffer size with GRO, the kernel coalesces up to 64 KiB
+static size_t const c_gro_buffer = 65536;
+
+// limits of a single GSO message
+static size_t const c_gso_max_segments = 64;
+static size_t const c_gso_max_bytes = 65507;
+
+static size_t const c_recv_control = CMSG_SPACE(sizeof(int));
+static size_t const c_send_control = CMSG_SPACE(sizeof(uint16_t));
+
+//------------------------------------------------------------------------------
+
+struct DatagramServer::DatagramServerImpl
+{
+    bool same_address(size_t a, size_t b) const;
+    void compact(size_t sent);
+    void watch_writable(bool writable);
+
+    socket_t socket_ = INVALID_SOCKET;
+    ServerBase* server_ = nullptr;
+    bool writable_ = false;     // waiting for EPOLLOUT
+
+    size_t batch_;
+    size_t size_;
+    bool wantGro_ = false;
+    bool wantGso_ = false;
+    bool gro_ = false;
+    bool gso_ = false;
+
+    // receive buffers
+    size_t rsize_ = 0;
+    std::vector<unsigned char> rdata_;
+    std::vector<struct mmsghdr> rmsgs_;
+    std::vector<struct iovec> riov_;
+    std::vector<struct sockaddr_storage> raddr_;
+    std::vector<char> rcontrol_;
+    std::vector<Datagram> datagrams_;
+
+    // queued datagrams
+    size_t wcount_ = 0;
+    std::vector<unsigned char> wdata_;
+    std::vector<size_t> wbytes_;
+    std::vector<struct sockaddr_storage> waddr_;
+    std::vector<socklen_t> waddrlen_;
+
+    // messages of a sendmmsg() call
+    std::vector<struct mmsghdr> wmsgs_;
+    std::vector<struct iovec> wiov_;
+    std::vector<char> wcontrol_;
+    std::vector<size_t> wfirst_;    // first datagram of each message
+};
+
+//------------------------------------------------------------------------------
+
+DatagramServer::DatagramServer(size_t batch, size_t size)
+    : p(new DatagramServerImpl)
+{
+    p->batch_ = std::max<size_t>(batch, 1);
+    p->size_ = std::min(size, c_gso_max_bytes);
+}
+
+//------------------------------------------------------------------------------
+
+DatagramServer::~DatagramServer()
+{
+    if (INVALID_SOCKET != p->socket_) {
+        if (p->server_) {
+            p->server_->unwatch(p->socket_);
+        }
+        socket_close(p->socket_);
+    }
+
+    delete p;
+}
+
+//------------------------------------------------------------------------------
+
+void DatagramServer::set_offload(bool gro, bool gso)
+{
+    p->wantGro_ = gro;
+    p->wantGso_ = gso;
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::init(int port, int domain)
+{
+    if (INVALID_SOCKET != p->socket_) {
+        return false;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t length;
+    ::memset(&address, 0, sizeof(address));
+    if (AF_INET6 == domain) {
+        struct sockaddr_in6* in6 = reinterpret_cast<struct sockaddr_in6*>(&address);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(port);
+        length = sizeof(*in6);
+    } else {
+        struct sockaddr_in* in = reinterpret_cast<struct sockaddr_in*>(&address);
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = INADDR_ANY;
+        in->sin_port = htons(port);
+        length = sizeof(*in);
+    }
+
+    p->socket_ = ::socket(domain, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (INVALID_SOCKET == p->socket_) {
+        log_last_socket_error();
+        return false;
+    }
+
+    if (-1 == ::bind(p->socket_, reinterpret_cast<struct sockaddr*>(&address), length)) {
+        log_last_socket_error();
+        socket_close(p->socket_);
+        p->socket_ = INVALID_SOCKET;
+        return false;
+    }
+
+    if (p->wantGro_) {
+        int one = 1;
+        p->gro_ = 0 == ::setsockopt(p->socket_, SOL_UDP, UDP_GRO, &one, sizeof(one));
+    }
+
+    if (p->wantGso_) {
+        // supported if the option is known
+        int segment;
+        socklen_t size = sizeof(segment);
+        p->gso_ = 0 == ::getsockopt(p->socket_, SOL_UDP, UDP_SEGMENT, &segment, &size);
+    }
+
+    LOG_DBG_F(u8"Datagram socket on port %d (GRO:%d GSO:%d)", port, p->gro_, p->gso_);
+
+    // all buffers are allocated once
+    size_t batch = p->batch_;
+    p->rsize_ = p->gro_ ? c_gro_buffer : p->size_;
+    p->rdata_.resize(batch * p->rsize_);
+    p->rmsgs_.resize(batch);
+    p->riov_.resize(batch);
+    p->raddr_.resize(batch);
+    p->rcontrol_.resize(batch * c_recv_control);
+    p->datagrams_.reserve(batch);
+
+    for (size_t i = 0; i < batch; ++i) {
+        p->riov_[i].iov_base = &p->rdata_[i * p->rsize_];
+        p->riov_[i].iov_len = p->rsize_;
+        ::memset(&p->rmsgs_[i], 0, sizeof(p->rmsgs_[i]));
+        p->rmsgs_[i].msg_hdr.msg_iov = &p->riov_[i];
+        p->rmsgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    p->wdata_.resize(batch * p->size_);
+    p->wbytes_.resize(batch);
+    p->waddr_.resize(batch);
+    p->waddrlen_.resize(batch);
+    p->wmsgs_.resize(batch);
+    p->wiov_.resize(batch);
+    p->wcontrol_.resize(batch * c_send_control);
+    p->wfirst_.resize(batch);
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::attach(ServerBase& server)
+{
+    if (INVALID_SOCKET == p->socket_ || p->server_) {
+        return false;
+    }
+
+    bool ret = server.watch(p->socket_, EPOLLIN | EPOLLET, [this](uint32_t events) {
+        if (events & EPOLLOUT) {
+            if (-1 == flush()) {
+                log_last_socket_error();
+            }
+        }
+        if (events & EPOLLIN) {
+            if (-1 == read()) {
+                log_last_socket_error();
+            }
+        }
+    });
+
+    if (ret) {
+        p->server_ = &server;
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+
+int DatagramServer::read()
+{
+    for (;;) {
+        for (size_t i = 0; i < p->batch_; ++i) {
+            struct msghdr& msg = p->rmsgs_[i].msg_hdr;
+            msg.msg_name = &p->raddr_[i];
+            msg.msg_namelen = sizeof(p->raddr_[i]);
+            msg.msg_control = p->gro_ ? &p->rcontrol_[i * c_recv_control] : nullptr;
+            msg.msg_controllen = p->gro_ ? c_recv_control : 0;
+            msg.msg_flags = 0;
+        }
+
+        metrics_add(METRIC_RECV_CALLS);
+        int received = ::recvmmsg(p->socket_, p->rmsgs_.data(), p->batch_, MSG_DONTWAIT, nullptr);
+        if (-1 == received) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_add(METRIC_EAGAIN);
+                return 1;
+            }
+            return -1;
+        }
+
+        p->datagrams_.clear();
+        for (int i = 0; i < received; ++i) {
+            struct msghdr const& msg = p->rmsgs_[i].msg_hdr;
+            size_t bytes = p->rmsgs_[i].msg_len;
+            metrics_add(METRIC_BYTES_IN, bytes);
+
+            if (msg.msg_flags & MSG_TRUNC) {
+                LOG_DBG(u8"Dropped truncated datagram");
+                continue;
+            }
+
+            // size of the coalesced datagrams, the last one may be smaller
+            size_t segment = bytes;
+            if (p->gro_) {
+                for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<struct msghdr*>(&msg), cmsg)) {
+                    if (SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type) {
+                        int size;
+                        ::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                        if (size > 0) {
+                            segment = static_cast<size_t>(size);
+                        }
+                    }
+                }
+            }
+
+            unsigned char const* data = static_cast<unsigned char const*>(p->riov_[i].iov_base);
+            size_t offset = 0;
+            do {
+                Datagram datagram;
+                datagram.data = data + offset;
+                datagram.bytes = std::min(segment, bytes - offset);
+                datagram.address = static_cast<struct sockaddr const*>(msg.msg_name);
+                datagram.addrlen = msg.msg_namelen;
+                p->datagrams_.push_back(datagram);
+                offset += segment;
+            } while (offset < bytes);
+        }
+
+        if (!p->datagrams_.empty()) {
+            onReceived(p->datagrams_.data(), p->datagrams_.size());
+        }
+
+        // replies of this batch
+        if (-1 == flush()) {
+            log_last_socket_error();
+        }
+
+        // Drained, new datagrams trigger the next event.
+        if (static_cast<size_t>(received) < p->batch_) {
+            return 1;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::send(Datagram const& to, unsigned char const* src, size_t bytes)
+{
+    return send(to.address, to.addrlen, src, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::send(struct sockaddr const* address, socklen_t addrlen, unsigned char const* src, size_t bytes)
+{
+    if (bytes > p->size_ || addrlen > sizeof(struct sockaddr_storage) || INVALID_SOCKET == p->socket_) {
+        return false;
+    }
+
+    if (p->wcount_ == p->batch_ && (flush() < 0 || p->wcount_ == p->batch_)) {
+        return false;
+    }
+
+    size_t index = p->wcount_++;
+    ::memcpy(&p->wdata_[index * p->size_], src, bytes);
+    ::memcpy(&p->waddr_[index], address, addrlen);
+    p->waddrlen_[index] = addrlen;
+    p->wbytes_[index] = bytes;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+int DatagramServer::flush()
+{
+    while (p->wcount_ > 0) {
+        size_t messages = 0;
+        size_t index = 0;
+        while (index < p->wcount_) {
+            size_t first = index;
+            size_t segment = p->wbytes_[index];
+            size_t total = segment;
+            p->wiov_[index].iov_base = &p->wdata_[index * p->size_];
+            p->wiov_[index].iov_len = p->wbytes_[index];
+            ++index;
+
+            // same destination and size (the last one may be smaller)
+            while (p->gso_ && segment > 0 && index < p->wcount_
+                    && index - first < c_gso_max_segments
+                    && p->wbytes_[index] > 0 && p->wbytes_[index] <= segment
+                    && total + p->wbytes_[index] <= c_gso_max_bytes
+                    && p->same_address(first, index)) {
+                p->wiov_[index].iov_base = &p->wdata_[index * p->size_];
+                p->wiov_[index].iov_len = p->wbytes_[index];
+                total += p->wbytes_[index];
+                ++index;
+                if (p->wbytes_[index - 1] < segment) {
+                    break;
+                }
+            }
+
+            struct msghdr& msg = p->wmsgs_[messages].msg_hdr;
+            ::memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &p->waddr_[first];
+            msg.msg_namelen = p->waddrlen_[first];
+            msg.msg_iov = &p->wiov_[first];
+            msg.msg_iovlen = index - first;
+
+            if (index - first > 1) {
+                msg.msg_control = &p->wcontrol_[messages * c_send_control];
+                msg.msg_controllen = c_send_control;
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t size = static_cast<uint16_t>(segment);
+                ::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+            }
+
+            p->wfirst_[messages++] = first;
+        }
+
+        metrics_add(METRIC_SEND_CALLS);
+        int sent = ::sendmmsg(p->socket_, p->wmsgs_.data(), messages, MSG_DONTWAIT);
+        if (-1 == sent) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_add(METRIC_EAGAIN);
+                p->watch_writable(true);
+                return 0;
+            }
+
+            // drop the message that fails, otherwise it blocks the queue
+            int error = errno;
+            p->compact(messages > 1 ? p->wfirst_[1] : p->wcount_);
+            errno = error;
+            return -1;
+        }
+
+        size_t datagrams = static_cast<size_t>(sent) < messages ? p->wfirst_[sent] : p->wcount_;
+        for (int i = 0; i < sent; ++i) {
+            metrics_add(METRIC_BYTES_OUT, p->wmsgs_[i].msg_len);
+        }
+        p->compact(datagrams);
+    }
+
+    p->watch_writable(false);
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+
+size_t DatagramServer::queued() const
+{
+    return p->wcount_;
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::gro() const
+{
+    return p->gro_;
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::gso() const
+{
+    return p->gso_;
+}
+
+//------------------------------------------------------------------------------
+
+socket_t DatagramServer::socket() const
+{
+    return p->socket_;
+}
+
+//------------------------------------------------------------------------------
+
+bool DatagramServer::DatagramServerImpl::same_address(size_t a, size_t b) const
+{
+    return waddrlen_[a] == waddrlen_[b] && 0 == ::memcmp(&waddr_[a], &waddr_[b], waddrlen_[a]);
+}
+
+//------------------------------------------------------------------------------
+
+void DatagramServer::DatagramServerImpl::compact(size_t sent)
+{
+    if (sent >= wcount_) {
+        wcount_ = 0;
+        return;
+    }
+
+    // only after a partial send
+    size_t rest = wcount_ - sent;
+    ::memmove(&wdata_[0], &wdata_[sent * size_], rest * size_);
+    std::copy(wbytes_.begin() + sent, wbytes_.begin() + wcount_, wbytes_.begin());
+    std::copy(waddr_.begin() + sent, waddr_.begin() + wcount_, waddr_.begin());
+    std::copy(waddrlen_.begin() + sent, waddrlen_.begin() + wcount_, waddrlen_.begin());
+    wcount_ = rest;
+}
+
+//------------------------------------------------------------------------------
+
+void DatagramServer::DatagramServerImpl::watch_writable(bool writable)
+{
+    if (server_ && writable != writable_) {
+        uint32_t events = EPOLLIN | EPOLLET | (writable ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        if (server_->watch(socket_, events, nullptr)) {
+            writable_ = writable;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
@@ -0,0 +1,306 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/Multiplexer.h"
+#include "nbbt/Cursor.h"
+
+#include <algorithm>
+#include <tuple>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+static uint8_t const c_data = 0;
+static uint8_t const c_window = 1;
+static uint8_t const c_close = 2;
+
+static size_t const c_header = 9;
+static size_t const c_max_frame = 16 << 10;
+
+//------------------------------------------------------------------------------
+
+Multiplexer::Multiplexer(Buffer& wbuffer, bool initiator, uint32_t window)
+    : m_wbuffer(wbuffer),
+      m_window(std::max<uint32_t>(window, 1)),
+      m_nextId(initiator ? 1 : 2),
+      m_lastPeerId(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+uint32_t Multiplexer::open(handler_t handler)
+{
+    uint32_t id = m_nextId;
+    m_nextId += 2;
+    create(id).handler = std::move(handler);
+    return id;
+}
+
+//------------------------------------------------------------------------------
+
+void Multiplexer::set_accept(accept_t accept)
+{
+    m_accept = std::move(accept);
+}
+
+//------------------------------------------------------------------------------
+
+bool Multiplexer::set_handler(uint32_t stream, handler_t handler)
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end()) {
+        return false;
+    }
+
+    it->second.handler = std::move(handler);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool Multiplexer::send(uint32_t stream, unsigned char const* src, size_t bytes)
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end() || it->second.closing) {
+        return false;
+    }
+
+    it->second.queue.append(src, bytes);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool Multiplexer::close(uint32_t stream)
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end() || it->second.closing) {
+        return false;
+    }
+
+    it->second.closing = true;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool Multiplexer::process(Buffer& rbuffer)
+{
+    while (rbuffer.available() >= c_header) {
+        ReadCursor cursor(rbuffer);
+        uint8_t type;
+        uint32_t id;
+        uint32_t length;
+        if (!cursor.read_be(type) || !cursor.read_be(id) || !cursor.read_be(length)) {
+            break;
+        }
+
+        if (type == c_data) {
+            if (length > c_max_frame) {
+                return false;
+            }
+            if (rbuffer.available() < c_header + length) {
+                break;
+            }
+
+            Stream* stream = incoming(id);
+            if (!stream || stream->closeReceived || length > stream->recvWindow) {
+                return false;
+            }
+
+            rbuffer.remove(c_header);
+            stream->recvWindow -= length;
+
+            // The handler may take data itself, only the rest is removed.
+            size_t available = rbuffer.available();
+            if (stream->handler && length > 0) {
+                stream->handler(rbuffer, length);
+            }
+            size_t taken = available - std::min(available, rbuffer.available());
+            if (taken < length) {
+                rbuffer.remove(length - taken);
+            }
+
+            // Grant the window again once half of it is processed.
+            stream->consumed += length;
+            if (stream->consumed >= m_window / 2) {
+                write_header(c_window, id, 4);
+                WriteCursor(m_wbuffer).write_be(stream->consumed);
+                stream->recvWindow += stream->consumed;
+                stream->consumed = 0;
+            }
+        } else if (type == c_window) {
+            if (length != 4) {
+                return false;
+            }
+            if (rbuffer.available() < c_header + 4) {
+                break;
+            }
+
+            uint32_t increment;
+            if (!cursor.read_be(increment)) {
+                break;
+            }
+            rbuffer.remove(c_header + 4);
+
+            // Window updates may cross the release of the stream.
+            auto it = m_streams.find(id);
+            if (it != m_streams.end()) {
+                Stream& stream = it->second;
+                if (increment > UINT32_MAX - stream.sendWindow) {
+                    return false;
+                }
+                stream.sendWindow += increment;
+            }
+        } else if (type == c_close) {
+            if (length != 0) {
+                return false;
+            }
+
+            Stream* stream = incoming(id);
+            if (!stream || stream->closeReceived) {
+                return false;
+            }
+
+            rbuffer.remove(c_header);
+            stream->closeReceived = true;
+
+            // The handler may close the stream, which releases it on flush().
+            handler_t handler = stream->handler;
+            if (stream->closeSent) {
+                m_streams.erase(id);
+            }
+            if (handler) {
+                handler(rbuffer, 0);
+            }
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+size_t Multiplexer::queued(uint32_t stream) const
+{
+    auto it = m_streams.find(stream);
+    return it == m_streams.end() ? 0 : it->second.queue.available();
+}
+
+//------------------------------------------------------------------------------
+
+Multiplexer::Stream& Multiplexer::create(uint32_t id)
+{
+    Stream& stream = m_streams.emplace(std::piecewise_construct,
+                                       std::forward_as_tuple(id),
+                                       std::forward_as_tuple()).first->second;
+    stream.sendWindow = m_window;
+    stream.recvWindow = m_window;
+    return stream;
+}
+
+//------------------------------------------------------------------------------
+
+Multiplexer::Stream* Multiplexer::incoming(uint32_t id)
+{
+    auto it = m_streams.find(id);
+    if (it != m_streams.end()) {
+        return &it->second;
+    }
+
+    // The peer opens streams of its own parity in ascending order only.
+    if (id == 0 || (id & 1) == (m_nextId & 1) || id <= m_lastPeerId) {
+        return nullptr;
+    }
+
+    m_lastPeerId = id;
+    Stream& stream = create(id);
+    if (m_accept) {
+        m_accept(id);
+    }
+
+    return &stream;
+}
+
+//------------------------------------------------------------------------------
+
+void Multiplexer::flush()
+{
+    // One frame per stream and round, until no stream can send anymore.
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        for (auto it = m_streams.begin(); it != m_streams.end();) {
+            Stream& stream = it->second;
+
+            size_t bytes = std::min<size_t>(stream.queue.available(), stream.sendWindow);
+            bytes = std::min(bytes, c_max_frame);
+
+            if (bytes > 0) {
+                write_header(c_data, it->first, static_cast<uint32_t>(bytes));
+                for (size_t offset = 0; offset < bytes;) {
+                    size_t n;
+                    unsigned char const* ptr = stream.queue.peek(offset, n);
+                    n = std::min(n, bytes - offset);
+                    m_wbuffer.append(ptr, n);
+                    offset += n;
+                }
+                stream.queue.remove(bytes);
+                stream.sendWindow -= static_cast<uint32_t>(bytes);
+                progress = true;
+            } else if (stream.closing && !stream.closeSent && stream.queue.available() == 0) {
+                write_header(c_close, it->first, 0);
+                stream.closeSent = true;
+            }
+
+            if (stream.closeSent && stream.closeReceived) {
+                it = m_streams.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Multiplexer::write_header(uint8_t type, uint32_t stream, uint32_t length)
+{
+    WriteCursor cursor(m_wbuffer);
+    cursor.write_be(type);
+    cursor.write_be(stream);
+    cursor.write_be(length);
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
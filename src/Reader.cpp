@@ -0,0 +1,103 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/Reader.h"
+
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+void Reader::read_exact(size_t bytes, handler_t handler)
+{
+    m_operations.push_back(Operation{ bytes, -1, std::move(handler) });
+}
+
+//------------------------------------------------------------------------------
+
+void Reader::read_until(unsigned char delim, handler_t handler)
+{
+    m_operations.push_back(Operation{ 0, delim, std::move(handler) });
+}
+
+//------------------------------------------------------------------------------
+
+void Reader::process(Buffer& buffer)
+{
+    // data removed by others moves the position searched so far
+    if (buffer.available() < m_available) {
+        m_scanned = 0;
+    }
+
+    while (!m_operations.empty()) {
+        Operation& op = m_operations.front();
+
+        size_t bytes;
+        if (-1 == op.delim) {
+            if (buffer.available() < op.bytes) {
+                break;
+            }
+            bytes = op.bytes;
+        } else {
+            size_t offset;
+            if (!buffer.find(static_cast<unsigned char>(op.delim), offset, m_scanned)) {
+                // continue searching here next time
+                m_scanned = buffer.available();
+                break;
+            }
+            bytes = offset + 1;
+        }
+
+        // The handler may queue the next operation.
+        handler_t handler = std::move(op.handler);
+        m_operations.pop_front();
+        m_scanned = 0;
+
+        // The handler may take data itself, only the rest is removed.
+        size_t available = buffer.available();
+        handler(buffer, bytes);
+        size_t taken = available - std::min(available, buffer.available());
+        if (taken < bytes) {
+            buffer.remove(bytes - taken);
+        }
+    }
+
+    m_available = buffer.available();
+}
+
+//------------------------------------------------------------------------------
+
+void Reader::clear()
+{
+    m_operations.clear();
+    m_scanned = 0;
+    m_available = 0;
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
@@ -0,0 +1,277 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/Resolver.h"
+#include "log.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+Resolver::Resolver(unsigned ttl, unsigned negative_ttl)
+    : m_ttl(ttl), m_negative_ttl(negative_ttl), m_stop(false)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+Resolver::~Resolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_one();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+Resolver& Resolver::instance()
+{
+    static Resolver resolver;
+    return resolver;
+}
+
+//------------------------------------------------------------------------------
+
+bool Resolver::lookup(char const* host, struct in_addr& address)
+{
+    address.s_addr = ::inet_addr(host);
+    if (INADDR_NONE != address.s_addr) {
+        return true;
+    }
+
+    std::string name(host);
+    int ret;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ret = _lookup_cached(name, address);
+    }
+
+    if (-1 == ret) {
+        _resolve(name);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ret = _lookup_cached(name, address);
+    }
+
+    return 1 == ret;
+}
+
+//------------------------------------------------------------------------------
+
+int Resolver::lookup_cached(char const* host, struct in_addr& address)
+{
+    address.s_addr = ::inet_addr(host);
+    if (INADDR_NONE != address.s_addr) {
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return _lookup_cached(host, address);
+}
+
+//------------------------------------------------------------------------------
+
+bool Resolver::addresses(char const* host, std::vector<struct in_addr>& addresses)
+{
+    addresses.clear();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_cache.find(host);
+    if (it == m_cache.end() || it->second.expires <= clock::now()) {
+        return false;
+    }
+
+    addresses = it->second.addresses;
+    return !addresses.empty();
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::resolve_async(char const* host, socket_t notify)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // join a pending request for the same name
+        auto it = std::find_if(m_requests.begin(), m_requests.end(),
+                               [host](Request const& r) { return r.host == host; });
+        if (it != m_requests.end()) {
+            it->notify.push_back(notify);
+            return;
+        }
+
+        Request request;
+        request.host = host;
+        request.notify.push_back(notify);
+        m_requests.push_back(std::move(request));
+
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&Resolver::_worker, this);
+        }
+    }
+    m_cond.notify_one();
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::cancel(socket_t notify)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (Request& request : m_requests) {
+        request.notify.erase(std::remove(request.notify.begin(), request.notify.end(), notify),
+                             request.notify.end());
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::insert(char const* host, std::vector<struct in_addr> const& addresses, unsigned ttl)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry& entry = m_cache[host];
+    entry.addresses = addresses;
+    entry.expires = clock::now() + std::chrono::seconds(ttl);
+    entry.next = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cache.clear();
+}
+
+//------------------------------------------------------------------------------
+
+int Resolver::_lookup_cached(std::string const& host, struct in_addr& address)
+{
+    auto it = m_cache.find(host);
+    if (it == m_cache.end()) {
+        return -1;
+    }
+
+    Entry& entry = it->second;
+    if (entry.expires <= clock::now()) {
+        m_cache.erase(it);
+        return -1;
+    }
+
+    if (entry.addresses.empty()) {
+        return 0;
+    }
+
+    // rotate through all address records
+    address = entry.addresses[entry.next];
+    entry.next = (entry.next + 1) % entry.addresses.size();
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::_resolve(std::string const& host)
+{
+    struct addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+
+    // We currently only support IPv4
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result = nullptr;
+    int ret = ::getaddrinfo(host.c_str(), nullptr, &hints, &result);
+
+    std::vector<struct in_addr> addresses;
+    if (0 != ret) {
+        LOG_ERR_F(u8"Failed to resolve \"%s\": %s", host.c_str(), ::gai_strerror(ret));
+    } else {
+        for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+            struct in_addr address = reinterpret_cast<struct sockaddr_in*>(ai->ai_addr)->sin_addr;
+
+            // getaddrinfo() may report the same address once per protocol
+            if (std::find_if(addresses.begin(), addresses.end(),
+                             [&address](struct in_addr const& a) { return a.s_addr == address.s_addr; })
+                    == addresses.end()) {
+                addresses.push_back(address);
+            }
+        }
+        ::freeaddrinfo(result);
+    }
+
+    insert(host.c_str(), addresses, addresses.empty() ? m_negative_ttl : m_ttl);
+}
+
+//------------------------------------------------------------------------------
+
+void Resolver::_worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_cond.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+        if (m_stop) {
+            return;
+        }
+
+        std::string host = m_requests.front().host;
+
+        lock.unlock();
+        _resolve(host);
+        lock.lock();
+
+        // Notify everyone who joined the request while it was resolved.
+        Request request = std::move(m_requests.front());
+        m_requests.pop_front();
+
+        for (socket_t notify : request.notify) {
+            char const c = 0;
+#ifdef _WIN32
+            ::send(notify, &c, 1, 0);
+#else
+            ssize_t ret = ::write(notify, &c, 1);
+            (void)ret; // a full pipe already signals readiness
+#endif
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
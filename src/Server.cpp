@@ -23,12 +23,31 @@
  */
 
 #include "nbbt/Server.h"
-#include "Buffer.h"
+#include "nbbt/Buffer.h"
+#include "nbbt/capture.h"
+#include "nbbt/compression.h"
+#include "nbbt/histogram.h"
+#include "nbbt/metrics.h"
+#include "nbbt/numa.h"
+#include "nbbt/socket.h"
+#include "nbbt/spill.h"
+#include "nbbt/tls.h"
+#include "nbbt/TokenBucket.h"
 #include "log.h"
-#include "socket.h"
+#include "pool.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
 #include <map>
+#include <memory>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
 
 //------------------------------------------------------------------------------
 
@@ -38,57 +57,254 @@ namespace nbbt {
 
 static size_t const c_epoll_queue_len = 1024;
 
+// bytes mapped at once for buffer chunks, see set_affinity()
+static size_t const c_arena_slab = 2 << 20;
+
+// default of set_accept_budget()
+static size_t const c_accept_budget = 64;
+
+// closed connections whose memory is kept for reuse
+static size_t const c_client_pool = 1024;
+
+// bytes moved from a relayed socket into its pipe at once (default pipe size)
+static size_t const c_relay_splice = 64 << 10;
+
+// number of connections listed by the admin socket
+static size_t const c_admin_top_connections = 10;
+
+// handoff protocol, see Server::init_handoff()
+static char const c_handoff_request_listener = 'L';
+static char const c_handoff_request_connections = 'C';
+static uint32_t const c_handoff_listener = 1;
+static uint32_t const c_handoff_connection = 2;
+static uint32_t const c_handoff_end = 3;
+
+struct HandoffRecord
+{
+    uint32_t type;
+    int32_t domain;
+    uint64_t rbytes;    // read buffer contents following the record
+    uint64_t wbytes;    // write buffer contents following the read buffer
+};
+
 //------------------------------------------------------------------------------
 
-struct Client
+/**
+ * One direction of ServerBase::relay(), owned by the connection the data comes
+ * from.
+ */
+struct Relay
 {
-    socket_t socket;
-    client_t id;
-    struct epoll_event event;
-    Buffer rbuffer;
-    Buffer wbuffer;
+    Relay() : peer(nullptr), pipe{ -1, -1 } {}
+
+    // what is still in the pipe is lost
+    ~Relay()
+    {
+        if (-1 != pipe[0]) {
+            ::close(pipe[0]);
+            ::close(pipe[1]);
+        }
+    }
+
+    ClientData* peer;       // where the data goes
+    int pipe[2];
+    size_t piped = 0;       // bytes in the pipe
+};
+
+//------------------------------------------------------------------------------
+
+/**
+ * Message boundaries of the write lanes of a connection, see BasicServer::send().
+ */
+struct WriteLanes
+{
+    struct Lane
+    {
+        std::unique_ptr<Buffer> buffer; // nullptr for lane 0 (ClientData::wbuffer)
+        std::vector<uint64_t> ends;     // where the queued messages end
+        size_t first = 0;               // first entry of ends not passed yet
+        uint64_t sent = 0;              // bytes taken from the lane
+        uint64_t reached = 0;           // end of the last message sent completely
+    };
+
+    Lane lanes[c_write_lanes];
 };
 
 //------------------------------------------------------------------------------
 
-struct Server::ServerImpl
+ClientData::~ClientData()
+{
+    if (tls) {
+        tls->shutdown();
+        delete tls;
+    }
+    delete compression;
+    delete bucket;
+    delete capture;
+    delete rxDelay;
+    delete relay;
+    delete lanes;
+}
+
+//------------------------------------------------------------------------------
+
+struct ServerBase::ServerImpl
 {
-    Client* accept();
-    void disconnected(Client* client);
+    typedef std::chrono::steady_clock clock;
+
+    bool listen(int domain, struct sockaddr const* address, socklen_t length);
+    bool create_epoll();
+    bool watch_listener();
+    bool set_incoming_cpu();
+    socket_t listen_unix(char const* path);
+    ClientData* add(socket_t socket, bool fresh);
+    ClientData* create_client(socket_t socket);
+    void destroy_client(ClientData* client);
+    void set_transports(ClientData* client);
+    void serve_handoff(std::vector<client_t>& moved);
+    int handshake(ClientData* client);
+    ClientData* accept(socket_t& rejected);
+    void pause_listener(bool pause);
+    void open_spare();
+    void disconnected(ClientData* client);
+    void unpair(ClientData* peer);
+    int pump(ClientData* from);
+    ClientData* find(client_t client) const;
+    bool flush(ClientData* client);
+    WriteLanes* lanes(ClientData* client);
+    Buffer* lane_buffer(ClientData* client, unsigned lane);
+    bool append(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes);
+    int flush_lanes(ClientData* client, size_t limit);
+    size_t buffered(ClientData* client) const;
+    bool shaped(ClientData* client) const;
+    void throttle(ClientData* client, clock::time_point now);
+    void unthrottle(ClientData* client, clock::time_point now);
+    void queue(ClientData* client);
+    void watch_writable(ClientData* client);
+    int timeout(int timeout) const;
+    int start_timer(int timeout, std::function<void()> callback);
+    void stop_timer(int timer);
+    void fire_timers();
+    void release_idle();
+    void serve_admin();
 
     int epoll_ = -1;
     struct epoll_event* events_ = nullptr;
+    size_t chunksize_;
 
     socket_t listener_ = INVALID_SOCKET;
-    std::map<socket_t, Client*> clients_;
-    std::map<client_t, Client*> idMapping_;
+    std::string listenerPath_;
+    int domain_ = AF_INET;
+    bool reuseport_ = false;
+    bool nodelay_ = false;
+    int incomingCpu_ = -1;
+    bool hugepages_ = false;
+    PoolMap<socket_t, ClientData*> clients_;
+    PoolMap<client_t, ClientData*> idMapping_;
+    client_t nextId_ = 0;
+
+    // timers ordered by expiry, the timer id makes the key unique
+    PoolMap<std::pair<clock::time_point, int>, std::function<void()>> timers_;
+    PoolMap<int, clock::time_point> timerExpiry_;
+    int nextTimer_ = 0;
+
+    socket_t admin_ = INVALID_SOCKET;
+    std::string adminPath_;
+
+    socket_t handoff_ = INVALID_SOCKET;
+    std::string handoffPath_;
+
+    TlsContext* tls_ = nullptr;
+    CompressionOptions compression_;
+    CaptureWriter* capture_ = nullptr;
+
+    // rate limit of all connections together
+    TokenBucket bucket_;
+
+    // chunk memory on the node of the pinned CPUs, see set_affinity()
+    std::unique_ptr<NodeChunkAllocator> allocator_;
+
+    // see set_idle_release()
+    int idleTimeout_ = 0;
+    int idleTimer_ = -1;
+
+    // see set_rx_timestamps()
+    bool rxTimestamps_ = false;
+
+    // older write buffer chunks, see set_spill()
+    std::unique_ptr<SpillFile> spill_;
+    size_t spillBudget_ = 0;
+
+    // admission control, see set_max_connections()
+    size_t maxConnections_ = 0;
+    bool shed_ = false;
+    bool paused_ = false;
+    size_t acceptBudget_ = c_accept_budget;
+    size_t accepted_ = 0;   // in this iteration
+
+    // given up to accept a connection when out of file descriptors
+    int spare_ = -1;
+
+    // sockets served by callbacks, see ServerBase::watch()
+    std::map<socket_t, std::function<void(uint32_t)>> watched_;
+
+    // coalesced writes, see ServerTraits::coalesce
+    std::vector<ClientData*> queued_;
+    std::vector<ClientData*> flushing_; // swapped with queued_, keeps its capacity
+
+    // memory of closed connections for reuse
+    std::vector<void*> clientPool_;
+
+    LoopLatency latency_;
 };
 
 //------------------------------------------------------------------------------
 
-Server::Server()
+ServerBase::ServerBase(size_t chunksize)
     : p(new ServerImpl)
 {
-
+    p->chunksize_ = chunksize;
+    latency_ = &p->latency_;
 }
 
 //------------------------------------------------------------------------------
 
-Server::~Server()
+ServerBase::~ServerBase()
 {
     if (INVALID_SOCKET != p->listener_) {
         socket_close(p->listener_);
+        if (!p->listenerPath_.empty()) {
+            ::unlink(p->listenerPath_.c_str());
+        }
+    }
+
+    if (INVALID_SOCKET != p->admin_) {
+        socket_close(p->admin_);
+        ::unlink(p->adminPath_.c_str());
+    }
+
+    if (INVALID_SOCKET != p->handoff_) {
+        socket_close(p->handoff_);
+        ::unlink(p->handoffPath_.c_str());
     }
 
     if (-1 != p->epoll_) {
         socket_close(p->epoll_);
     }
 
+    if (-1 != p->spare_) {
+        ::close(p->spare_);
+    }
+
     for (auto& client : p->clients_) {
+        metrics_add(METRIC_CONNECTIONS, -1);
+        p->destroy_client(client.second);
         if (client.first != INVALID_SOCKET) {
             socket_close(client.first);
         }
-        delete client.second;
+    }
+    for (void* memory : p->clientPool_) {
+        ::operator delete(memory);
     }
 
     if (p->events_) {
@@ -100,206 +316,1882 @@ Server::~Server()
 
 //------------------------------------------------------------------------------
 
-bool Server::init(int port, int domain)
+bool ServerBase::init(int port, int domain)
+{
+    struct sockaddr_in address;
+    ::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    return p->listen(domain, (struct sockaddr*)&address, sizeof(address));
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::init(char const* path)
 {
-    // dDon't call again, when already listening.
-    if (p->listener_ != INVALID_SOCKET) {
+    struct sockaddr_un address;
+    ::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (::strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERR_F(u8"Socket path too long: \"%s\"", path);
         return false;
     }
+    ::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
 
-    if ((p->listener_ = ::socket(domain, SOCK_STREAM | SOCK_NONBLOCK, 0)) == INVALID_SOCKET) {
-        goto init_socket_failed;
+    if (!p->listen(AF_UNIX, (struct sockaddr*)&address, sizeof(address))) {
+        return false;
     }
 
-    int one = 1;
-    if (::setsockopt(p->listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
-        goto init_socket_failed;
+    p->listenerPath_ = path;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_reuseport(bool enable)
+{
+    p->reuseport_ = enable;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_nodelay(bool enable)
+{
+    p->nodelay_ = enable;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_affinity(std::vector<int> const& cpus)
+{
+    if (cpus.empty() || !p->clients_.empty()) {
+        LOG_ERR(u8"Set the affinity before connections exist");
+        return false;
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    if (!thread_set_affinity(cpus)) {
+        return false;
+    }
 
-    if (::bind(p->listener_, (struct sockaddr*)&address, sizeof(address)) == -1) {
-        goto init_socket_failed;
+    p->allocator_.reset(new NodeChunkAllocator(cpu_node(cpus.front()), c_arena_slab, p->hugepages_));
+
+    p->incomingCpu_ = 1 == cpus.size() ? cpus.front() : -1;
+    if (INVALID_SOCKET != p->listener_ && !p->set_incoming_cpu()) {
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_hugepages(bool enable)
+{
+    if (!p->clients_.empty()) {
+        LOG_ERR(u8"Enable huge pages before connections exist");
+        return false;
     }
 
-    if (::listen(p->listener_, SOMAXCONN) == -1) {
-        goto init_socket_failed;
+    p->hugepages_ = enable;
+    int node = p->allocator_ ? p->allocator_->node() : -1;
+    p->allocator_.reset(new NodeChunkAllocator(node, c_arena_slab, enable));
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_idle_release(int timeout)
+{
+    if (-1 != p->idleTimer_) {
+        p->stop_timer(p->idleTimer_);
+        p->idleTimer_ = -1;
     }
 
-    p->epoll_ = ::epoll_create1(0);
-    if (-1 == p->epoll_) {
-        goto init_socket_failed;
+    p->idleTimeout_ = timeout;
+    if (timeout > 0) {
+        p->idleTimer_ = p->start_timer(timeout, [this]() { p->release_idle(); });
     }
+}
 
-    struct epoll_event event;
-    event.data.fd = p->listener_;
-    event.events = EPOLLIN | EPOLLET;
-    if (-1 == ::epoll_ctl(p->epoll_, EPOLL_CTL_ADD, p->listener_, &event)) {
-        goto init_socket_failed;
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_spill(size_t budget, size_t capacity, char const* directory)
+{
+    if (0 == budget) {
+        // existing connections keep using the file
+        p->spillBudget_ = 0;
+        return true;
     }
 
-    p->events_ = new struct epoll_event[c_epoll_queue_len];
+    if (!p->spill_) {
+        std::unique_ptr<SpillFile> spill(new SpillFile);
+        if (!spill->open(directory, size_t(1) << p->chunksize_, capacity)) {
+            return false;
+        }
+        p->spill_ = std::move(spill);
+    }
 
+    p->spillBudget_ = budget;
     return true;
+}
 
-init_socket_failed:
-    log_last_socket_error();
-    if (p->listener_ != INVALID_SOCKET) {
-        socket_close(p->listener_);
+//------------------------------------------------------------------------------
+
+void ServerBase::set_max_connections(size_t max, bool shed)
+{
+    p->maxConnections_ = max;
+    p->shed_ = shed;
+
+    bool full = max > 0 && !shed && p->clients_.size() >= max;
+    if (full != p->paused_) {
+        p->pause_listener(full);
     }
-    return false;
 }
 
 //------------------------------------------------------------------------------
 
-bool Server::run(int timeout)
+void ServerBase::set_accept_budget(size_t accepts)
 {
-    if (nullptr == p->events_) {
+    p->acceptBudget_ = accepts;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::flush(client_t client)
+{
+    ClientData* data = p->find(client);
+    return data && p->flush(data);
+}
+
+//------------------------------------------------------------------------------
+
+Buffer* ServerBase::read_buffer(client_t client)
+{
+    ClientData* data = p->find(client);
+    return data ? &data->rbuffer : nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+Buffer* ServerBase::write_buffer(client_t client)
+{
+    ClientData* data = p->find(client);
+    return data ? &data->wbuffer : nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::connect(struct sockaddr const* address, socklen_t length, client_t& client)
+{
+    socket_t socket = ::socket(address->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (INVALID_SOCKET == socket) {
+        log_last_socket_error();
         return false;
     }
 
-    int nfds = ::epoll_wait(p->epoll_, p->events_, c_epoll_queue_len, timeout);
-    if (-1 == nfds) {
+    if (!socket_set_nonblocking(socket)) {
         log_last_socket_error();
+        socket_close(socket);
         return false;
     }
 
-    for (int i = 0; i < nfds; ++i) {
-        struct epoll_event const& event = p->events_[i];
+    if (-1 == ::connect(socket, address, length) && EINPROGRESS != errno) {
+        log_last_socket_error();
+        socket_close(socket);
+        return false;
+    }
 
-        if (event.data.fd == p->listener_) {
-            // new client connects
-            ClientData* client;
-            while (client = p->accept()) {
-                onConnected(&(client->client));
-            }
-            continue;
+    if (p->nodelay_ && AF_UNIX != address->sa_family) {
+        int one = 1;
+        if (-1 == ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+            log_last_socket_error();
         }
+    }
 
-        // client socket
-        auto it = p->clients_.find(event.data.fd);
-        if (it == p->clients_.end()) {
-            LOG_ERR(u8"unknown socket");
-            break;
-        }
-        ClientData* client = (*it).second;
+    // the transports of accepted connections are server side only
+    ClientData* data = p->add(socket, false);
+    if (!data) {
+        return false;
+    }
 
-        // socket has disconnected
-        if (event.events & (EPOLLERR | EPOLLHUP)) {
-            LOG_WARN_F(u8"Socket error (events:%u)", event.events);
-            p->disconnected(client);
-            onDisconnected(&(client->client));
-            continue;
+    metrics_add(METRIC_CONNECTS);
+    client = data->id;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::relay(client_t a, client_t b)
+{
+    ClientData* clients[2] = { p->find(a), p->find(b) };
+    if (!clients[0] || !clients[1] || clients[0] == clients[1]) {
+        return false;
+    }
+
+    for (ClientData* client : clients) {
+        if (client->relay || client->handshake || client->tls || client->compression
+                || client->capture || p->shaped(client)) {
+            return false;
         }
+    }
 
-        if (event.events & EPOLLRDHUP) {
-            // client closed the connection
-            p->disconnected(client);
-            onDisconnected(&(client->client));
-            continue;
+    Relay* relays[2] = { new Relay, new Relay };
+    for (int i = 0; i < 2; ++i) {
+        if (-1 == ::pipe2(relays[i]->pipe, O_NONBLOCK | O_CLOEXEC)) {
+            log_last_socket_error();
+            delete relays[0];
+            delete relays[1];
+            return false;
         }
+    }
 
-        // data available to read from client/slave
-        if (event.events & EPOLLIN) {
-            size_t read;
-            if (client->client.rbuffer.read(read) < 1) {
-                log_last_socket_error();
-                continue;
-            }
+    for (int i = 0; i < 2; ++i) {
+        ClientData* from = clients[i];
+        ClientData* to = clients[1 - i];
+        relays[i]->peer = to;
+        from->relay = relays[i];
 
-            onReadyRead(&(client->client));
-        }
+        // the message passed to onMessage() has been taken already
+        from->rbuffer.remove(std::min(from->handling, from->rbuffer.available()));
 
-        // write buffer has more space
-        if (event.events & EPOLLOUT) {
-            // write more data
-            switch (client->client.wbuffer.flush()) {
-            case 0: // socket disconnected
-            {
-                p->disconnected(client);
-                onDisconnected(&(client->client));
-                continue;
-            }
-            case -1:
-            {
-                log_last_socket_error();
-            } break;
-            default:
-            {
-                // noop
-            }
-            } // switch
+        // what the application has not taken goes out first, by copy, after
+        // what has been queued on lane 0
+        size_t bytes;
+        unsigned char const* data;
+        while (from->rbuffer.available() > 0 && (data = from->rbuffer.peek(0, bytes))) {
+            p->append(to, 0, data, bytes);
+            from->rbuffer.remove(bytes);
+        }
+        from->rbuffer.clear();
+    }
 
-            // if no more data needs to be written, we can remove the EPOLLOUT flag
-            if (client->client.wbuffer.available() == 0) {
-                client->event.events &= ~EPOLLOUT;
-                if (-1 == ::epoll_ctl(p->epoll_, EPOLL_CTL_MOD, client->socket, &client->event)) {
-                    log_last_socket_error();
-                }
-            }
+    // the write buffers are sent on EPOLLOUT, then pump() takes over
+    for (ClientData* client : clients) {
+        client->event.events |= EPOLLOUT;
+        if (-1 == ::epoll_ctl(p->epoll_, EPOLL_CTL_MOD, client->socket, &client->event)) {
+            log_last_socket_error();
         }
     }
 
     return true;
 }
 
-bool Server::send(client_t client, const unsigned char* src, size_t bytes)
+//------------------------------------------------------------------------------
+
+int ServerBase::start_timer(int timeout, std::function<void()> callback)
 {
+    return p->start_timer(timeout, std::move(callback));
+}
+
+//------------------------------------------------------------------------------
 
+void ServerBase::stop_timer(int timer)
+{
+    p->stop_timer(timer);
 }
 
 //------------------------------------------------------------------------------
 
-void Server::ServerImpl::disconnected(ClientData* client)
+bool ServerBase::stats(client_t client, ConnectionStats& stats) const
 {
-    if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_DEL, client->socket, nullptr)) {
-        log_last_socket_error();
+    ClientData* data = p->find(client);
+    if (!data) {
+        return false;
     }
-    socket_close(client->socket);
-    clients_.erase(client->socket);
-    delete client;
+
+    stats.rbuffered = data->rbuffer.available();
+    stats.wbuffered = p->buffered(data);
+    stats.rcapacity = data->rbuffer.capacity();
+    stats.wcapacity = data->wbuffer.capacity();
+    stats.throttled = data->throttled;
+    if (0 != data->throttledSince) {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    ServerImpl::clock::now().time_since_epoch()).count();
+        stats.throttled += static_cast<uint64_t>(now - data->throttledSince);
+    }
+    return true;
 }
 
 //------------------------------------------------------------------------------
 
-ClientData* Server::ServerImpl::accept()
+bool ServerBase::init_admin(char const* path)
 {
-    socket_t socket = ::accept(listener_, nullptr, nullptr);
-    if (INVALID_SOCKET == socket) {
-        if (errno == EAGAIN) {
-            // we have processed all incoming connections
-        } else {
-            log_last_socket_error();
-        }
-        return nullptr;
-    } else {
-        ClientData* client = new ClientData;
-        client->socket = socket;
-        client->client.wbuffer.set_socket(socket);
-        client->client.rbuffer.set_socket(socket);
-        client->event.data.fd = socket;
-        client->event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-
-        if (!socket_set_nonblocking(socket)) {
-            socket_close(socket);
-            delete client;
-            return nullptr;
-        }
+    if (INVALID_SOCKET != p->admin_) {
+        return false;
+    }
 
-        if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &client->event)) {
-            log_last_socket_error();
-            socket_close(socket);
-            delete client;
-            return nullptr;
-        }
+    p->admin_ = p->listen_unix(path);
+    if (INVALID_SOCKET == p->admin_) {
+        return false;
+    }
 
-        clients_[socket] = client;
+    p->adminPath_ = path;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_tls(TlsContext* context)
+{
+    if (context && (!context->native() || !context->is_server())) {
+        LOG_ERR(u8"TLS context is not initialized as server");
+        return false;
+    }
 
-        return client;
+    p->tls_ = context;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_compression(CompressionOptions const& options)
+{
+    if (!compression_supported(options.algorithm)) {
+        LOG_ERR(u8"Compression algorithm not supported by this build");
+        return false;
     }
+
+    p->compression_ = options;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_capture(CaptureWriter* capture)
+{
+    p->capture_ = capture;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_rate_limit(uint64_t rate, uint64_t burst)
+{
+    p->bucket_.set_rate(rate, burst);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::set_rate_limit(client_t client, uint64_t rate, uint64_t burst)
+{
+    ClientData* data = p->find(client);
+    if (!data) {
+        return false;
+    }
+
+    // relayed data does not pass the write buffers
+    if (data->relay && 0 != rate) {
+        return false;
+    }
+
+    if (0 == rate) {
+        delete data->bucket;
+        data->bucket = nullptr;
+    } else if (data->bucket) {
+        data->bucket->set_rate(rate, burst);
+    } else {
+        data->bucket = new TokenBucket(rate, burst);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::init_handoff(char const* path)
+{
+    if (INVALID_SOCKET != p->handoff_) {
+        return false;
+    }
+
+    p->handoff_ = p->listen_unix(path);
+    if (INVALID_SOCKET == p->handoff_) {
+        return false;
+    }
+
+    p->handoffPath_ = path;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool recv_buffer(socket_t socket, Buffer& buffer, uint64_t bytes)
+{
+    unsigned char data[16384];
+    while (bytes > 0) {
+        ssize_t read = ::recv(socket, data, std::min<uint64_t>(bytes, sizeof(data)), 0);
+        if (read <= 0) {
+            if (-1 == read && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer.append(data, static_cast<size_t>(read));
+        bytes -= static_cast<uint64_t>(read);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::takeover(char const* path, bool connections, std::vector<client_t>& received)
+{
+    if (INVALID_SOCKET != p->listener_) {
+        return false;
+    }
+
+    struct sockaddr_un address;
+    ::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    ::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    socket_t socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (INVALID_SOCKET == socket) {
+        log_last_socket_error();
+        return false;
+    }
+
+    char request = connections ? c_handoff_request_connections : c_handoff_request_listener;
+    if (-1 == ::connect(socket, (struct sockaddr*)&address, sizeof(address))
+            || !socket_send_fd(socket, INVALID_SOCKET, &request, 1)) {
+        log_last_socket_error();
+        socket_close(socket);
+        return false;
+    }
+
+    for (;;) {
+        HandoffRecord record;
+        socket_t fd;
+        if (!socket_recv_fd(socket, fd, &record, sizeof(record))) {
+            LOG_ERR(u8"Handoff aborted");
+            if (INVALID_SOCKET != fd) {
+                socket_close(fd);
+            }
+            break;
+        }
+
+        if (c_handoff_end == record.type) {
+            break;
+        }
+
+        if (INVALID_SOCKET == fd) {
+            LOG_ERR(u8"Handoff record without socket");
+            break;
+        }
+
+        if (c_handoff_listener == record.type) {
+            p->listener_ = fd;
+            p->domain_ = record.domain;
+            if (!socket_set_nonblocking(fd) || !p->watch_listener()) {
+                log_last_socket_error();
+                socket_close(fd);
+                p->listener_ = INVALID_SOCKET;
+                break;
+            }
+        } else if (c_handoff_connection == record.type) {
+            if (-1 == p->epoll_) {
+                // the listener always comes first
+                socket_close(fd);
+                break;
+            }
+
+            ClientData* client = p->add(fd, false);
+            if (!client) {
+                break;
+            }
+
+            // pending data of the previous process
+            if (!recv_buffer(socket, client->rbuffer, record.rbytes)
+                    || !recv_buffer(socket, client->wbuffer, record.wbytes)) {
+                LOG_ERR(u8"Handoff aborted");
+                received.push_back(client->id);
+                break;
+            }
+
+            p->watch_writable(client);
+            received.push_back(client->id);
+        } else {
+            socket_close(fd);
+        }
+    }
+
+    socket_close(socket);
+
+    return INVALID_SOCKET != p->listener_;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::watch(socket_t socket, uint32_t events, std::function<void(uint32_t)> callback)
+{
+    if (!p->create_epoll()) {
+        log_last_socket_error();
+        return false;
+    }
+
+    struct epoll_event event;
+    event.data.fd = socket;
+    event.events = events;
+
+    auto it = p->watched_.find(socket);
+    if (it != p->watched_.end()) {
+        // keep the callback, it might be the caller
+        if (-1 == ::epoll_ctl(p->epoll_, EPOLL_CTL_MOD, socket, &event)) {
+            log_last_socket_error();
+            return false;
+        }
+        return true;
+    }
+
+    if (-1 == ::epoll_ctl(p->epoll_, EPOLL_CTL_ADD, socket, &event)) {
+        log_last_socket_error();
+        return false;
+    }
+
+    p->watched_[socket] = std::move(callback);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::unwatch(socket_t socket)
+{
+    auto it = p->watched_.find(socket);
+    if (it != p->watched_.end()) {
+        ::epoll_ctl(p->epoll_, EPOLL_CTL_DEL, socket, nullptr);
+        p->watched_.erase(it);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::listening() const
+{
+    return INVALID_SOCKET != p->listener_;
+}
+
+//------------------------------------------------------------------------------
+
+size_t ServerBase::connections() const
+{
+    return p->clients_.size();
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::latency(LoopLatency& latency) const
+{
+    latency = p->latency_;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::set_rx_timestamps(bool enable)
+{
+    p->rxTimestamps_ = enable;
+}
+
+//------------------------------------------------------------------------------
+
+Histogram const* ServerBase::rx_delay(client_t client) const
+{
+    ClientData* data = p->find(client);
+    return data ? data->rxDelay : nullptr;
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::wait(int timeout)
+{
+    if (nullptr == p->events_) {
+        return -1;
+    }
+
+    p->accepted_ = 0;
+
+    NBBT_LATENCY_START(wait_start);
+    int nfds = ::epoll_wait(p->epoll_, p->events_, c_epoll_queue_len, p->timeout(timeout));
+    NBBT_LATENCY_RECORD(p->latency_.wait, wait_start);
+    if (-1 == nfds) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        log_last_socket_error();
+    }
+
+    return nfds;
+}
+
+//------------------------------------------------------------------------------
+
+ServerBase::EventType ServerBase::event(int index, ClientData*& client, uint32_t& events)
+{
+    struct epoll_event const& event = p->events_[index];
+
+    if (event.data.fd == p->listener_) {
+        return EVENT_LISTENER;
+    }
+
+    if (event.data.fd == p->admin_) {
+        p->serve_admin();
+        return EVENT_NONE;
+    }
+
+    if (event.data.fd == p->handoff_) {
+        return EVENT_HANDOFF;
+    }
+
+    if (!p->watched_.empty()) {
+        auto it = p->watched_.find(event.data.fd);
+        if (it != p->watched_.end()) {
+            it->second(event.events);
+            return EVENT_NONE;
+        }
+    }
+
+    // client socket
+    auto it = p->clients_.find(event.data.fd);
+    if (it == p->clients_.end()) {
+        // disconnected or handed off earlier in this iteration
+        LOG_DBG(u8"unknown socket");
+        return EVENT_NONE;
+    }
+
+    client = it->second;
+    client->active = true;
+    events = event.events;
+    return EVENT_CLIENT;
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::accept(socket_t& rejected)
+{
+    return p->accept(rejected);
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::reject(socket_t socket)
+{
+    socket_close(socket);
+    metrics_add(METRIC_REJECTS);
+
+    if (-1 == p->spare_) {
+        p->open_spare();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::handshake(ClientData* client)
+{
+    return p->handshake(client);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::exists(socket_t socket) const
+{
+    return p->clients_.find(socket) != p->clients_.end();
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::disconnected(ClientData* client)
+{
+    p->disconnected(client);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::flush(ClientData* client)
+{
+    return p->flush(client);
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::record_rx_delay(ClientData* client, size_t offset)
+{
+    uint64_t received;
+    if (!client->rbuffer.timestamp(offset, received)) {
+        return;
+    }
+
+    // kernel timestamps are CLOCK_REALTIME
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+    if (now < received) {
+        return;
+    }
+
+    client->rxDelay->record(now - received);
+    p->latency_.rxqueue.record(now - received);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::relay(ClientData* client, uint32_t events, client_t& peer)
+{
+    peer = client->relay->peer->id;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return false;
+    }
+
+    // the peer's data can go out again
+    if ((events & EPOLLOUT) && 1 != p->pump(client->relay->peer)) {
+        return false;
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && 1 != p->pump(client)) {
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::flush_queued(std::vector<client_t>& failed)
+{
+    // flush() may disconnect, which modifies queued_
+    std::vector<ClientData*>& queued = p->flushing_;
+    queued.swap(p->queued_);
+
+    for (ClientData* client : queued) {
+        client->queued = false;
+    }
+
+    for (ClientData* client : queued) {
+        if (!p->flush(client)) {
+            failed.push_back(client->id);
+            p->disconnected(client);
+        }
+    }
+    queued.clear();
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::fire_timers()
+{
+    p->fire_timers();
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::serve_handoff(std::vector<client_t>& moved)
+{
+    p->serve_handoff(moved);
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::find(client_t client) const
+{
+    return p->find(client);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::send(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes)
+{
+    // only flush() respects the rate limit and the order of the lanes
+    if (p->shaped(client) || client->lanes || 0 != lane) {
+        return p->append(client, lane, src, bytes) && p->flush(client);
+    }
+
+    switch (client->wbuffer.send(src, bytes)) {
+    case 1:
+    {
+        // the lanes need to know where queued messages end
+        if (client->wbuffer.available() > 0) {
+            p->lanes(client);
+        }
+        p->watch_writable(client);
+        return true;
+    }
+    case 0: // socket disconnected
+    {
+        return false;
+    }
+    default: // -1
+    {
+        log_last_socket_error();
+        return false;
+    }
+    } // switch
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::append(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes)
+{
+    return p->append(client, lane, src, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::queue(ClientData* client)
+{
+    p->queue(client);
+}
+
+//------------------------------------------------------------------------------
+
+template class BasicServer<Server>;
+
+//------------------------------------------------------------------------------
+
+Server::Server()
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+Server::~Server()
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+bool Server::send(client_t client, const unsigned char* src, size_t bytes)
+{
+    return BasicServer::send(client, src, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+bool Server::memcpy(client_t client, unsigned char* dest, size_t bytes) const
+{
+    return BasicServer::memcpy(client, dest, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+void Server::remove(client_t client, size_t bytes)
+{
+    BasicServer::remove(client, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+size_t Server::available(client_t client) const
+{
+    return BasicServer::available(client);
+}
+
+//------------------------------------------------------------------------------
+
+bool Server::get_string(client_t client, std::string& string, bool take)
+{
+    return BasicServer::get_string(client, string, take);
+}
+
+//------------------------------------------------------------------------------
+
+bool Server::send(client_t client, unsigned lane, unsigned char const* src, size_t bytes)
+{
+    return BasicServer::send(client, lane, src, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::listen(int domain, struct sockaddr const* address, socklen_t length)
+{
+    // Don't call again, when already listening.
+    if (listener_ != INVALID_SOCKET) {
+        return false;
+    }
+
+    int one = 1;
+
+    if ((listener_ = ::socket(domain, SOCK_STREAM | SOCK_NONBLOCK, 0)) == INVALID_SOCKET) {
+        goto init_socket_failed;
+    }
+
+    if (AF_UNIX == domain) {
+        // remove a stale socket of a previous run
+        ::unlink(reinterpret_cast<struct sockaddr_un const*>(address)->sun_path);
+    } else if (::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+        goto init_socket_failed;
+    }
+
+    // lets several servers (one per thread) accept on the same port
+    if (reuseport_ && ::setsockopt(listener_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        goto init_socket_failed;
+    }
+
+    if (AF_UNIX != domain && !set_incoming_cpu()) {
+        goto init_socket_failed;
+    }
+
+    if (::bind(listener_, address, length) == -1) {
+        goto init_socket_failed;
+    }
+
+    if (::listen(listener_, SOMAXCONN) == -1) {
+        goto init_socket_failed;
+    }
+
+    if (!watch_listener()) {
+        goto init_socket_failed;
+    }
+
+    domain_ = domain;
+
+    return true;
+
+init_socket_failed:
+    log_last_socket_error();
+    if (listener_ != INVALID_SOCKET) {
+        socket_close(listener_);
+        listener_ = INVALID_SOCKET;
+    }
+    if (-1 != epoll_) {
+        socket_close(epoll_);
+        epoll_ = -1;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::set_incoming_cpu()
+{
+    if (-1 == incomingCpu_) {
+        return true;
+    }
+
+    if (-1 == ::setsockopt(listener_, SOL_SOCKET, SO_INCOMING_CPU, &incomingCpu_, sizeof(incomingCpu_))) {
+        log_last_socket_error();
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::create_epoll()
+{
+    if (-1 == epoll_) {
+        epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (-1 == epoll_) {
+            return false;
+        }
+    }
+
+    if (!events_) {
+        events_ = new struct epoll_event[c_epoll_queue_len];
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::watch_listener()
+{
+    if (!create_epoll()) {
+        return false;
+    }
+
+    if (-1 == spare_) {
+        open_spare();
+    }
+
+    // level triggered, connections left by the accept budget are reported
+    // again by the next epoll_wait()
+    struct epoll_event event;
+    event.data.fd = listener_;
+    event.events = EPOLLIN;
+    paused_ = false;
+    return 0 == ::epoll_ctl(epoll_, EPOLL_CTL_ADD, listener_, &event);
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::pause_listener(bool pause)
+{
+    if (INVALID_SOCKET == listener_) {
+        return;
+    }
+
+    // a listener without events stays registered
+    struct epoll_event event;
+    event.data.fd = listener_;
+    event.events = pause ? 0u : static_cast<uint32_t>(EPOLLIN);
+    if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_MOD, listener_, &event)) {
+        log_last_socket_error();
+        return;
+    }
+
+    paused_ = pause;
+    if (pause) {
+        LOG_WARN_F(u8"Connection limit of %zu reached, not accepting", maxConnections_);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::open_spare()
+{
+    spare_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (-1 == spare_) {
+        log_last_socket_error();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+socket_t ServerBase::ServerImpl::listen_unix(char const* path)
+{
+    if (-1 == epoll_) {
+        return INVALID_SOCKET;
+    }
+
+    struct sockaddr_un address;
+    ::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (::strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERR_F(u8"Socket path too long: \"%s\"", path);
+        return INVALID_SOCKET;
+    }
+    ::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    socket_t socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (INVALID_SOCKET == socket) {
+        log_last_socket_error();
+        return INVALID_SOCKET;
+    }
+
+    // remove a stale socket of a previous run
+    ::unlink(path);
+
+    struct epoll_event event;
+    event.data.fd = socket;
+    event.events = EPOLLIN | EPOLLET;
+
+    if (-1 == ::bind(socket, (struct sockaddr*)&address, sizeof(address))
+            || -1 == ::listen(socket, 16)
+            || -1 == ::epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event)) {
+        log_last_socket_error();
+        socket_close(socket);
+        return INVALID_SOCKET;
+    }
+
+    return socket;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::disconnected(ClientData* client)
+{
+    if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_DEL, client->socket, nullptr)) {
+        log_last_socket_error();
+    }
+    if (-1 != client->throttle) {
+        stop_timer(client->throttle);
+    }
+    unthrottle(client, clock::now());
+    if (client->relay) {
+        unpair(client->relay->peer);
+    }
+    if (client->queued) {
+        queued_.erase(std::find(queued_.begin(), queued_.end(), client));
+    }
+    socket_t socket = client->socket;
+    clients_.erase(socket);
+    idMapping_.erase(client->id);
+
+    // the transports may still write, e.g. the TLS close_notify
+    destroy_client(client);
+    socket_close(socket);
+
+    metrics_add(METRIC_DISCONNECTS);
+    metrics_add(METRIC_CONNECTIONS, -1);
+
+    if (paused_ && clients_.size() < maxConnections_) {
+        pause_listener(false);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::unpair(ClientData* peer)
+{
+    // the other side is closed, the peer is served through its buffers again
+    delete peer->relay;
+    peer->relay = nullptr;
+    watch_writable(peer);
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::ServerImpl::pump(ClientData* from)
+{
+    Relay* relay = from->relay;
+    ClientData* to = relay->peer;
+
+    // data buffered before relay() comes first
+    if (buffered(to) > 0) {
+        if (!flush(to)) {
+            return -1;
+        }
+        if (buffered(to) > 0) {
+            return 1;
+        }
+    }
+
+    int ret = 1;
+    for (;;) {
+        if (relay->piped > 0) {
+            ssize_t moved = ::splice(relay->pipe[0], nullptr, to->socket, nullptr, relay->piped,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (-1 == moved) {
+                if (EAGAIN != errno) {
+                    log_last_socket_error();
+                    ret = -1;
+                }
+                break; // to is full, from is read again on its EPOLLOUT
+            }
+
+            relay->piped -= static_cast<size_t>(moved);
+            metrics_add(METRIC_RELAYED_BYTES, moved);
+            continue;
+        }
+
+        ssize_t moved = ::splice(from->socket, nullptr, relay->pipe[1], nullptr, c_relay_splice,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (-1 == moved) {
+            if (EAGAIN != errno) {
+                log_last_socket_error();
+                ret = -1;
+            }
+            break;
+        }
+        if (0 == moved) {
+            // from closed and everything it sent has been passed on
+            ret = 0;
+            break;
+        }
+
+        relay->piped = static_cast<size_t>(moved);
+    }
+
+    // wait for EPOLLOUT while the pipe holds data
+    watch_writable(to);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::ServerImpl::accept(socket_t& rejected)
+{
+    rejected = INVALID_SOCKET;
+    if (paused_ || (acceptBudget_ > 0 && accepted_ >= acceptBudget_)) {
+        return nullptr;
+    }
+
+    socket_t socket = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (INVALID_SOCKET == socket) {
+        if (errno == EAGAIN) {
+            // we have processed all incoming connections
+        } else if ((errno == EMFILE || errno == ENFILE) && -1 != spare_) {
+            // Free a descriptor to take the connection off the backlog,
+            // otherwise the listener reports it forever. reject() reopens
+            // the spare descriptor.
+            ::close(spare_);
+            spare_ = -1;
+            rejected = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (INVALID_SOCKET == rejected) {
+                open_spare();
+            }
+            ++accepted_;
+        } else {
+            log_last_socket_error();
+        }
+        return nullptr;
+    }
+
+    ++accepted_;
+    metrics_add(METRIC_ACCEPTS);
+
+    if (maxConnections_ > 0 && clients_.size() >= maxConnections_) {
+        rejected = socket;
+        return nullptr;
+    }
+
+    if (nodelay_ && AF_UNIX != domain_) {
+        int one = 1;
+        if (-1 == ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+            log_last_socket_error();
+        }
+    }
+
+    ClientData* client = add(socket, true);
+    if (client && maxConnections_ > 0 && !shed_ && clients_.size() >= maxConnections_) {
+        pause_listener(true);
+    }
+    return client;
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::ServerImpl::add(socket_t socket, bool fresh)
+{
+    ClientData* client = create_client(socket);
+    client->event.data.fd = socket;
+    client->event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+
+    if (!socket_set_nonblocking(socket)) {
+        socket_close(socket);
+        destroy_client(client);
+        return nullptr;
+    }
+
+    if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &client->event)) {
+        log_last_socket_error();
+        socket_close(socket);
+        destroy_client(client);
+        return nullptr;
+    }
+
+    if (allocator_) {
+        client->rbuffer.set_allocator(allocator_.get());
+        client->wbuffer.set_allocator(allocator_.get());
+    }
+    if (spillBudget_ > 0) {
+        client->wbuffer.set_spill(spill_.get(), spillBudget_);
+    }
+
+    // connections of a previous process continue as they were
+    if (fresh && COMPRESSION_NONE != compression_.algorithm) {
+        client->compression = new CompressionTransport(compression_, socket);
+    }
+    if (capture_) {
+        client->capture = new CaptureTransport(*capture_, static_cast<uint32_t>(client->id), socket);
+    }
+    if (fresh && tls_) {
+        client->tls = new TlsSession(*tls_, socket);
+        client->handshake = true;
+    } else {
+        set_transports(client);
+    }
+
+    // a transport reads without control messages
+    if (rxTimestamps_ && !client->tls && !client->compression && !client->capture) {
+        if (client->rbuffer.set_timestamps(true)) {
+            client->rxDelay = new Histogram;
+        } else {
+            log_last_socket_error();
+        }
+    }
+
+    clients_[socket] = client;
+    idMapping_[client->id] = client;
+
+    metrics_add(METRIC_CONNECTIONS, 1);
+
+    return client;
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::ServerImpl::create_client(socket_t socket)
+{
+    void* memory;
+    if (clientPool_.empty()) {
+        memory = ::operator new(sizeof(ClientData));
+    } else {
+        memory = clientPool_.back();
+        clientPool_.pop_back();
+    }
+
+    return new (memory) ClientData(socket, nextId_++, chunksize_);
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::destroy_client(ClientData* client)
+{
+    client->~ClientData();
+    if (clientPool_.size() < c_client_pool) {
+        clientPool_.push_back(client);
+    } else {
+        ::operator delete(client);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+ClientData* ServerBase::ServerImpl::find(client_t client) const
+{
+    auto it = idMapping_.find(client);
+    return it == idMapping_.end() ? nullptr : it->second;
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::flush(ClientData* client)
+{
+    client->active = true;
+
+    size_t limit = SIZE_MAX;
+    clock::time_point now;
+    if (shaped(client)) {
+        now = clock::now();
+        limit = bucket_.available(now);
+        if (client->bucket) {
+            limit = std::min(limit, client->bucket->available(now));
+        }
+    }
+
+    size_t before = buffered(client);
+    NBBT_LATENCY_START(flush_start);
+    int ret = client->lanes ? flush_lanes(client, limit) : client->wbuffer.flush(limit);
+    NBBT_LATENCY_RECORD(latency_.flush, flush_start);
+
+    if (SIZE_MAX != limit) {
+        size_t sent = before - buffered(client);
+        bucket_.consume(sent);
+        if (client->bucket) {
+            client->bucket->consume(sent);
+        }
+
+        // stopped by the limit rather than by the socket
+        if (sent == limit && buffered(client) > 0) {
+            throttle(client, now);
+        } else {
+            unthrottle(client, now);
+        }
+    }
+
+    switch (ret) {
+    case 0: // socket disconnected
+    {
+        return false;
+    }
+    case -1:
+    {
+        log_last_socket_error();
+        return false;
+    }
+    default:
+    {
+        // noop
+    }
+    } // switch
+
+    watch_writable(client);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+WriteLanes* ServerBase::ServerImpl::lanes(ClientData* client)
+{
+    if (!client->lanes) {
+        client->lanes = new WriteLanes;
+
+        // what is buffered already counts as one message, maybe sent in part
+        if (client->wbuffer.available() > 0) {
+            client->lanes->lanes[0].ends.push_back(client->wbuffer.available());
+            client->lanes->lanes[0].reached = UINT64_MAX;
+        }
+    }
+    return client->lanes;
+}
+
+//------------------------------------------------------------------------------
+
+Buffer* ServerBase::ServerImpl::lane_buffer(ClientData* client, unsigned lane)
+{
+    if (0 == lane) {
+        return &client->wbuffer;
+    }
+
+    std::unique_ptr<Buffer>& buffer = client->lanes->lanes[lane].buffer;
+    if (!buffer) {
+        buffer.reset(new Buffer(client->socket, chunksize_));
+        if (allocator_) {
+            buffer->set_allocator(allocator_.get());
+        }
+        buffer->set_transport(client->wbuffer.transport());
+    }
+    return buffer.get();
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::append(ClientData* client, unsigned lane, unsigned char const* src, size_t bytes)
+{
+    if (lane >= c_write_lanes) {
+        return false;
+    }
+
+    if (!client->lanes && 0 == lane && 0 == client->wbuffer.available()) {
+        client->wbuffer.append(src, bytes);
+        return true;
+    }
+
+    WriteLanes::Lane& state = lanes(client)->lanes[lane];
+    Buffer* buffer = lane_buffer(client, lane);
+    buffer->append(src, bytes);
+    state.ends.push_back(state.sent + buffer->available());
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::ServerImpl::flush_lanes(ClientData* client, size_t limit)
+{
+    WriteLanes::Lane* lanes = client->lanes->lanes;
+
+    for (;;) {
+        // finish the message being written, then take the most urgent one
+        int current = -1;
+        int urgent = -1;
+        for (int i = c_write_lanes - 1; i >= 0; --i) {
+            Buffer const* buffer = i > 0 ? lanes[i].buffer.get() : &client->wbuffer;
+            if (!buffer || 0 == buffer->available()) {
+                continue;
+            }
+            if (-1 == urgent) {
+                urgent = i;
+            }
+            if (lanes[i].sent != lanes[i].reached) {
+                current = i;
+            }
+        }
+        if (-1 == current) {
+            current = urgent;
+        }
+        if (-1 == current) {
+            // data a transport could not write yet
+            return client->wbuffer.flush(limit);
+        }
+
+        // only stop at the end of a message if a more urgent one waits
+        WriteLanes::Lane& lane = lanes[current];
+        Buffer* buffer = lane_buffer(client, current);
+        size_t wanted = std::min(buffer->available(), limit);
+        if (urgent > current && lane.first < lane.ends.size()) {
+            wanted = static_cast<size_t>(std::min<uint64_t>(lane.ends[lane.first] - lane.sent, wanted));
+        }
+
+        size_t before = buffer->available();
+        int ret = buffer->flush(wanted);
+        size_t sent = before - buffer->available();
+        lane.sent += sent;
+        limit -= sent;
+
+        while (lane.first < lane.ends.size() && lane.ends[lane.first] <= lane.sent) {
+            lane.reached = lane.ends[lane.first];
+            ++lane.first;
+        }
+        if (0 == buffer->available()) {
+            lane.reached = lane.sent;
+        }
+        if (lane.first == lane.ends.size()) {
+            lane.ends.clear();
+            lane.first = 0;
+        } else if (lane.first >= 16 && lane.first * 2 >= lane.ends.size()) {
+            lane.ends.erase(lane.ends.begin(), lane.ends.begin() + lane.first);
+            lane.first = 0;
+        }
+
+        // socket full, limit reached or error
+        if (1 != ret || sent < wanted || 0 == limit) {
+            return ret;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+size_t ServerBase::ServerImpl::buffered(ClientData* client) const
+{
+    size_t bytes = client->wbuffer.available();
+    if (client->lanes) {
+        for (unsigned i = 1; i < c_write_lanes; ++i) {
+            Buffer const* buffer = client->lanes->lanes[i].buffer.get();
+            bytes += buffer ? buffer->available() : 0;
+        }
+    }
+    return bytes;
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::ServerImpl::handshake(ClientData* client)
+{
+    int ret = client->tls->handshake();
+    if (1 == ret) {
+        client->handshake = false;
+        set_transports(client);
+    }
+
+    watch_writable(client);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::set_transports(ClientData* client)
+{
+    // with kTLS the kernel encrypts what is written to the socket
+    Transport* recv = client->tls;
+    Transport* send = client->tls && !client->tls->ktls_send() ? client->tls : nullptr;
+
+    if (client->compression) {
+        client->compression->set_lower(recv, send);
+        recv = client->compression;
+        send = client->compression;
+    }
+
+    if (client->capture) {
+        client->capture->set_lower(recv, send);
+        recv = client->capture;
+        send = client->capture;
+    }
+
+    client->rbuffer.set_transport(recv);
+    client->wbuffer.set_transport(send);
+    if (client->lanes) {
+        for (unsigned i = 1; i < c_write_lanes; ++i) {
+            if (client->lanes->lanes[i].buffer) {
+                client->lanes->lanes[i].buffer->set_transport(send);
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool ServerBase::ServerImpl::shaped(ClientData* client) const
+{
+    return bucket_.limited() || client->bucket;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::throttle(ClientData* client, clock::time_point now)
+{
+    if (0 == client->throttledSince) {
+        client->throttledSince = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now.time_since_epoch()).count();
+        metrics_add(METRIC_THROTTLES);
+    }
+
+    if (-1 != client->throttle) {
+        return;
+    }
+
+    // wait for a chunk rather than sending single bytes
+    size_t wanted = std::min(buffered(client), size_t(1) << chunksize_);
+    int delay = bucket_.delay(wanted);
+    if (client->bucket) {
+        delay = std::max(delay, client->bucket->delay(wanted));
+    }
+
+    client->throttle = start_timer(std::max(delay, 1), [this, client]() {
+        client->throttle = -1;
+        queue(client);
+    });
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::unthrottle(ClientData* client, clock::time_point now)
+{
+    if (0 == client->throttledSince) {
+        return;
+    }
+
+    int64_t since = client->throttledSince;
+    client->throttledSince = 0;
+    int64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now.time_since_epoch()).count() - since;
+    if (waited > 0) {
+        client->throttled += static_cast<uint64_t>(waited);
+        metrics_add(METRIC_THROTTLED_NS, waited);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::queue(ClientData* client)
+{
+    if (!client->queued) {
+        client->queued = true;
+        queued_.push_back(client);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::watch_writable(ClientData* client)
+{
+    // Only wait for EPOLLOUT while there is data left to write and the rate
+    // limit allows to write it.
+    uint32_t events = client->event.events & ~EPOLLOUT;
+    if (((client->wbuffer.pending() || buffered(client) > 0) && -1 == client->throttle)
+            || (client->tls && client->tls->want_write())
+            || (client->relay && client->relay->peer->relay->piped > 0)) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != client->event.events) {
+        client->event.events = events;
+        if (-1 == ::epoll_ctl(epoll_, EPOLL_CTL_MOD, client->socket, &client->event)) {
+            log_last_socket_error();
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::ServerImpl::timeout(int timeout) const
+{
+    if (timers_.empty()) {
+        return timeout;
+    }
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                timers_.begin()->first.first - clock::now()).count();
+    if (remaining < 0) {
+        remaining = 0;
+    }
+
+    if (timeout < 0 || remaining < timeout) {
+        // round up, otherwise we wake up just before the timer expires
+        return static_cast<int>(remaining) + 1;
+    }
+
+    return timeout;
+}
+
+//------------------------------------------------------------------------------
+
+int ServerBase::ServerImpl::start_timer(int timeout, std::function<void()> callback)
+{
+    int timer = nextTimer_++;
+    clock::time_point expiry = clock::now() + std::chrono::milliseconds(timeout);
+    timers_[std::make_pair(expiry, timer)] = std::move(callback);
+    timerExpiry_[timer] = expiry;
+    return timer;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::stop_timer(int timer)
+{
+    auto it = timerExpiry_.find(timer);
+    if (it != timerExpiry_.end()) {
+        timers_.erase(std::make_pair(it->second, timer));
+        timerExpiry_.erase(it);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::fire_timers()
+{
+    clock::time_point now = clock::now();
+    while (!timers_.empty() && timers_.begin()->first.first <= now) {
+        auto it = timers_.begin();
+        std::function<void()> callback = std::move(it->second);
+        timerExpiry_.erase(it->first.second);
+        timers_.erase(it);
+
+        // the callback may start or stop timers
+        callback();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::release_idle()
+{
+    // A sweep instead of a timer per connection: a connection is idle if it
+    // had no event since the previous sweep.
+    for (auto& it : clients_) {
+        ClientData* client = it.second;
+        if (client->active) {
+            client->active = false;
+        } else {
+            client->rbuffer.shrink();
+            client->wbuffer.shrink();
+            if (client->lanes) {
+                for (unsigned i = 1; i < c_write_lanes; ++i) {
+                    if (client->lanes->lanes[i].buffer) {
+                        client->lanes->lanes[i].buffer->shrink();
+                    }
+                }
+            }
+        }
+    }
+
+    idleTimer_ = start_timer(idleTimeout_, [this]() { release_idle(); });
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::serve_admin()
+{
+    std::string text;
+    for (;;) {
+        socket_t socket = ::accept4(admin_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (INVALID_SOCKET == socket) {
+            if (errno != EAGAIN) {
+                log_last_socket_error();
+            }
+            return;
+        }
+
+        if (text.empty()) {
+            MetricsSnapshot snapshot;
+            metrics_snapshot(snapshot);
+            metrics_format_prometheus(snapshot, text);
+
+            // the connections holding the most buffer memory
+            std::vector<ClientData*> top;
+            for (auto& client : clients_) {
+                top.push_back(client.second);
+            }
+            size_t n = std::min(top.size(), c_admin_top_connections);
+            std::partial_sort(top.begin(), top.begin() + n, top.end(), [](ClientData* a, ClientData* b) {
+                return a->rbuffer.capacity() + a->wbuffer.capacity() > b->rbuffer.capacity() + b->wbuffer.capacity();
+            });
+
+            char line[256];
+            text += "# HELP nbbt_connection_buffer_memory_bytes Bytes allocated by the largest connections.\n"
+                    "# TYPE nbbt_connection_buffer_memory_bytes gauge\n";
+            for (size_t i = 0; i < n; ++i) {
+                snprintf(line, sizeof(line), "nbbt_connection_buffer_memory_bytes{client=\"%d\",buffer=\"read\"} %zu\n"
+                         "nbbt_connection_buffer_memory_bytes{client=\"%d\",buffer=\"write\"} %zu\n",
+                         top[i]->id, top[i]->rbuffer.capacity(), top[i]->id, top[i]->wbuffer.capacity());
+                text += line;
+            }
+        }
+
+        // The socket is blocking, the text is written at once.
+        if (::send(socket, text.data(), text.size(), MSG_NOSIGNAL) == -1) {
+            log_last_socket_error();
+        }
+        socket_close(socket);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+static bool send_buffer(socket_t socket, Buffer& buffer)
+{
+    size_t offset = 0;
+    size_t bytes;
+    unsigned char const* data;
+    while ((data = buffer.peek(offset, bytes))) {
+        if (!socket_send_fd(socket, INVALID_SOCKET, data, bytes)) {
+            return false;
+        }
+        offset += bytes;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void ServerBase::ServerImpl::serve_handoff(std::vector<client_t>& moved)
+{
+    socket_t socket = ::accept4(handoff_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (INVALID_SOCKET == socket) {
+        if (errno != EAGAIN) {
+            log_last_socket_error();
+        }
+        return;
+    }
+
+    // The transfer blocks this loop, it only happens once.
+    char request;
+    socket_t none;
+    bool received = socket_recv_fd(socket, none, &request, 1);
+    if (INVALID_SOCKET != none) {
+        // the request carries no descriptor
+        socket_close(none);
+    }
+    if (!received) {
+        log_last_socket_error();
+        socket_close(socket);
+        return;
+    }
+
+    HandoffRecord record;
+    ::memset(&record, 0, sizeof(record));
+
+    if (INVALID_SOCKET != listener_) {
+        record.type = c_handoff_listener;
+        record.domain = domain_;
+        if (!socket_send_fd(socket, listener_, &record, sizeof(record))) {
+            log_last_socket_error();
+            socket_close(socket);
+            return;
+        }
+
+        // Stop accepting, pending connections are accepted by the new process.
+        ::epoll_ctl(epoll_, EPOLL_CTL_DEL, listener_, nullptr);
+        socket_close(listener_);
+        listener_ = INVALID_SOCKET;
+        listenerPath_.clear(); // belongs to the new process now
+    }
+
+    if (c_handoff_request_connections == request) {
+        std::vector<ClientData*> clients;
+        for (auto& client : clients_) {
+            clients.push_back(client.second);
+        }
+
+        for (ClientData* client : clients) {
+            if (client->tls || client->compression || client->relay
+                    || buffered(client) > client->wbuffer.available()) {
+                // the stream state lives in this process, serve until closed
+                continue;
+            }
+
+            record.type = c_handoff_connection;
+            record.domain = domain_;
+            record.rbytes = client->rbuffer.available();
+            record.wbytes = client->wbuffer.available();
+            if (!socket_send_fd(socket, client->socket, &record, sizeof(record))
+                    || !send_buffer(socket, client->rbuffer)
+                    || !send_buffer(socket, client->wbuffer)) {
+                log_last_socket_error();
+                break;
+            }
+
+            // the connection stays open in the new process
+            moved.push_back(client->id);
+            disconnected(client);
+        }
+    }
+
+    record.type = c_handoff_end;
+    record.rbytes = 0;
+    record.wbytes = 0;
+    if (!socket_send_fd(socket, INVALID_SOCKET, &record, sizeof(record))) {
+        log_last_socket_error();
+    }
+    socket_close(socket);
+
+    // only a single handoff
+    ::epoll_ctl(epoll_, EPOLL_CTL_DEL, handoff_, nullptr);
+    socket_close(handoff_);
+    ::unlink(handoffPath_.c_str());
+    handoff_ = INVALID_SOCKET;
 }
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/TokenBucket.h"
+
+#include <algorithm>
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+static uint64_t const c_ns_per_s = 1000000000;
+
+//------------------------------------------------------------------------------
+
+TokenBucket::TokenBucket()
+    : m_rate(0), m_burst(0), m_tokens(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+{
+    set_rate(rate, burst);
+}
+
+//------------------------------------------------------------------------------
+
+void TokenBucket::set_rate(uint64_t rate, uint64_t burst)
+{
+    m_rate = rate;
+    m_burst = std::max<uint64_t>(burst, 1);
+    m_tokens = m_burst;
+    m_last = clock::now();
+}
+
+//------------------------------------------------------------------------------
+
+size_t TokenBucket::available(clock::time_point now)
+{
+    if (!limited()) {
+        return SIZE_MAX;
+    }
+
+    if (now > m_last) {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last).count();
+        uint64_t missing = m_burst - m_tokens;
+
+        // also keeps the product below from overflowing
+        if (elapsed >= (missing * c_ns_per_s + m_rate - 1) / m_rate) {
+            m_tokens = m_burst;
+            m_last = now;
+        } else {
+            uint64_t tokens = elapsed * m_rate / c_ns_per_s;
+            m_tokens += tokens;
+
+            // keep the fraction of a token for the next refill
+            m_last += std::chrono::nanoseconds(tokens * c_ns_per_s / m_rate);
+        }
+    }
+
+    return static_cast<size_t>(std::min<uint64_t>(m_tokens, SIZE_MAX));
+}
+
+//------------------------------------------------------------------------------
+
+void TokenBucket::consume(size_t bytes)
+{
+    if (limited()) {
+        m_tokens -= std::min<uint64_t>(bytes, m_tokens);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int TokenBucket::delay(size_t bytes) const
+{
+    uint64_t needed = std::min<uint64_t>(bytes, m_burst);
+    if (!limited() || m_tokens >= needed) {
+        return 0;
+    }
+
+    uint64_t ms = ((needed - m_tokens) * 1000 + m_rate - 1) / m_rate;
+    return static_cast<int>(std::min<uint64_t>(ms, INT32_MAX));
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
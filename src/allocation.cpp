@@ -0,0 +1,123 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/allocation.h"
+
+#include <cstdlib>
+#include <new>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+#ifdef NBBT_ALLOCATION_AUDIT
+
+// Plain counters, a thread_local with a constructor could itself allocate.
+static thread_local uint64_t t_allocations = 0;
+static thread_local uint64_t t_deallocations = 0;
+static thread_local uint64_t t_bytes = 0;
+
+static void* audited_new(size_t bytes)
+{
+    ++t_allocations;
+    t_bytes += bytes;
+
+    void* p = std::malloc(bytes ? bytes : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static void audited_delete(void* p)
+{
+    if (p) {
+        ++t_deallocations;
+        std::free(p);
+    }
+}
+
+bool allocation_audit_enabled()
+{
+    return true;
+}
+
+void allocation_stats(AllocationStats& stats)
+{
+    stats.allocations = t_allocations;
+    stats.deallocations = t_deallocations;
+    stats.bytes = t_bytes;
+}
+
+#else
+
+bool allocation_audit_enabled()
+{
+    return false;
+}
+
+void allocation_stats(AllocationStats& stats)
+{
+    stats = AllocationStats();
+}
+
+#endif // NBBT_ALLOCATION_AUDIT
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#ifdef NBBT_ALLOCATION_AUDIT
+
+// Linked into the program together with allocation_stats().
+void* operator new(size_t bytes) { return nbbt::audited_new(bytes); }
+void* operator new[](size_t bytes) { return nbbt::audited_new(bytes); }
+void* operator new(size_t bytes, std::nothrow_t const&) noexcept
+{
+    try {
+        return nbbt::audited_new(bytes);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t bytes, std::nothrow_t const&) noexcept
+{
+    try {
+        return nbbt::audited_new(bytes);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void operator delete(void* p) noexcept { nbbt::audited_delete(p); }
+void operator delete[](void* p) noexcept { nbbt::audited_delete(p); }
+void operator delete(void* p, size_t) noexcept { nbbt::audited_delete(p); }
+void operator delete[](void* p, size_t) noexcept { nbbt::audited_delete(p); }
+void operator delete(void* p, std::nothrow_t const&) noexcept { nbbt::audited_delete(p); }
+void operator delete[](void* p, std::nothrow_t const&) noexcept { nbbt::audited_delete(p); }
+
+#endif // NBBT_ALLOCATION_AUDIT
@@ -0,0 +1,253 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/capture.h"
+#include "nbbt/Cursor.h"
+#include "nbbt/histogram.h"
+
+#include "log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+static char const c_magic[8] = { 'N', 'B', 'B', 'T', 'C', 'A', 'P', '1' };
+static size_t const c_record_header = 8 + 4 + 1 + 4;
+static size_t const c_write_size = 64 << 10;
+
+//------------------------------------------------------------------------------
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+//------------------------------------------------------------------------------
+
+bool CaptureWriter::open(char const* path)
+{
+    close();
+
+    m_fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (-1 == m_fd) {
+        LOG_ERR_F(u8"Cannot open capture %s: %s", path, ::strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (0 == ::fstat(m_fd, &st) && 0 == st.st_size) {
+        m_buffer.insert(m_buffer.end(), c_magic, c_magic + sizeof(c_magic));
+    }
+
+    m_buffer.reserve(c_write_size + c_record_header);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void CaptureWriter::close()
+{
+    if (-1 == m_fd) {
+        return;
+    }
+
+    flush();
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+//------------------------------------------------------------------------------
+
+void CaptureWriter::record(uint32_t connection, CaptureType type, void const* data, size_t bytes)
+{
+    if (-1 == m_fd) {
+        return;
+    }
+
+    unsigned char header[c_record_header];
+    detail::store<uint64_t, false>(header, clock_ns());
+    detail::store<uint32_t, false>(header + 8, connection);
+    detail::store<uint8_t, false>(header + 12, static_cast<uint8_t>(type));
+    detail::store<uint32_t, false>(header + 13, static_cast<uint32_t>(bytes));
+
+    m_buffer.insert(m_buffer.end(), header, header + c_record_header);
+    if (bytes > 0) {
+        unsigned char const* src = static_cast<unsigned char const*>(data);
+        m_buffer.insert(m_buffer.end(), src, src + bytes);
+    }
+    m_bytes += c_record_header + bytes;
+
+    if (m_buffer.size() >= c_write_size) {
+        flush();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool CaptureWriter::flush()
+{
+    size_t written = 0;
+    while (written < m_buffer.size()) {
+        ssize_t ret = ::write(m_fd, &m_buffer[written], m_buffer.size() - written);
+        if (-1 == ret) {
+            if (EINTR == errno) {
+                continue;
+            }
+            LOG_ERR_F(u8"Capture write failed: %s", ::strerror(errno));
+            m_buffer.clear();
+            return false;
+        }
+        written += static_cast<size_t>(ret);
+    }
+
+    m_buffer.clear();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+CaptureReader::~CaptureReader()
+{
+    if (m_file) {
+        ::fclose(m_file);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool CaptureReader::open(char const* path)
+{
+    if (m_file) {
+        ::fclose(m_file);
+    }
+
+    m_file = ::fopen(path, "rb");
+    if (!m_file) {
+        return false;
+    }
+
+    char magic[sizeof(c_magic)];
+    if (1 != ::fread(magic, sizeof(magic), 1, m_file)
+            || 0 != ::memcmp(magic, c_magic, sizeof(magic))) {
+        ::fclose(m_file);
+        m_file = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool CaptureReader::next(CaptureRecord& record)
+{
+    unsigned char header[c_record_header];
+    if (!m_file || 1 != ::fread(header, sizeof(header), 1, m_file)) {
+        return false;
+    }
+
+    uint8_t type = detail::load<uint8_t, false>(header + 12);
+    if (type > CAPTURE_CLOSE) {
+        return false;
+    }
+
+    record.time = detail::load<uint64_t, false>(header);
+    record.connection = detail::load<uint32_t, false>(header + 8);
+    record.type = static_cast<CaptureType>(type);
+    record.data.resize(detail::load<uint32_t, false>(header + 13));
+
+    return record.data.empty()
+            || 1 == ::fread(&record.data[0], record.data.size(), 1, m_file);
+}
+
+//------------------------------------------------------------------------------
+
+CaptureTransport::CaptureTransport(CaptureWriter& writer, uint32_t connection, socket_t socket)
+    : m_writer(writer), m_connection(connection), m_socket(socket)
+{
+    m_writer.record(m_connection, CAPTURE_OPEN);
+}
+
+//------------------------------------------------------------------------------
+
+CaptureTransport::~CaptureTransport()
+{
+    m_writer.record(m_connection, CAPTURE_CLOSE);
+}
+
+//------------------------------------------------------------------------------
+
+void CaptureTransport::set_lower(Transport* recv, Transport* send)
+{
+    m_recv = recv;
+    m_send = send;
+}
+
+//------------------------------------------------------------------------------
+
+long CaptureTransport::recv(void* dest, size_t bytes)
+{
+    long received = m_recv ? m_recv->recv(dest, bytes) : ::recv(m_socket, dest, bytes, 0);
+    if (received > 0) {
+        m_writer.record(m_connection, CAPTURE_IN, dest, static_cast<size_t>(received));
+    }
+    return received;
+}
+
+//------------------------------------------------------------------------------
+
+long CaptureTransport::send(void const* src, size_t bytes)
+{
+    long sent = m_send ? m_send->send(src, bytes) : ::send(m_socket, src, bytes, 0);
+    if (sent > 0) {
+        m_writer.record(m_connection, CAPTURE_OUT, src, static_cast<size_t>(sent));
+    }
+    return sent;
+}
+
+//------------------------------------------------------------------------------
+
+int CaptureTransport::flush()
+{
+    return m_send ? m_send->flush() : 1;
+}
+
+//------------------------------------------------------------------------------
+
+bool CaptureTransport::pending() const
+{
+    return m_send && m_send->pending();
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
@@ -0,0 +1,451 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/compression.h"
+#include "log.h"
+
+#ifdef NBBT_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef NBBT_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+static size_t const c_header = 5;
+
+// input of a single frame, larger writes are split
+static size_t const c_max_frame_input = 65536;
+
+static size_t const c_read_size = 16384;
+
+// frame types
+static int const c_frame_raw = 0;
+static int const c_frame_deflate = 1;
+static int const c_frame_zstd = 2;
+
+//------------------------------------------------------------------------------
+
+bool compression_supported(Compression algorithm)
+{
+    switch (algorithm) {
+    case COMPRESSION_NONE:
+        return true;
+#ifdef NBBT_HAS_ZLIB
+    case COMPRESSION_DEFLATE:
+        return true;
+#endif
+#ifdef NBBT_HAS_ZSTD
+    case COMPRESSION_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+struct CompressionTransport::Codec
+{
+#ifdef NBBT_HAS_ZLIB
+    z_stream deflate;
+    z_stream inflate;
+    bool deflateInit = false;
+    bool inflateInit = false;
+#endif
+#ifdef NBBT_HAS_ZSTD
+    ZSTD_CCtx* compress = nullptr;
+    ZSTD_DCtx* decompress = nullptr;
+#endif
+};
+
+//------------------------------------------------------------------------------
+
+CompressionTransport::CompressionTransport(CompressionOptions const& options, socket_t socket)
+    : m_options(options), m_socket(socket), m_recv(nullptr), m_send(nullptr)
+    , m_codec(new Codec), m_outpos(0), m_inpos(0), m_frameType(c_frame_raw)
+    , m_frameRemaining(0), m_decoderFull(false), m_bytesIn(0), m_bytesOut(0)
+{
+    if (!compression_supported(m_options.algorithm)) {
+        LOG_WARN_F(u8"Compression %d not supported, sending raw", m_options.algorithm);
+        m_options.algorithm = COMPRESSION_NONE;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+CompressionTransport::~CompressionTransport()
+{
+#ifdef NBBT_HAS_ZLIB
+    if (m_codec->deflateInit) {
+        ::deflateEnd(&m_codec->deflate);
+    }
+    if (m_codec->inflateInit) {
+        ::inflateEnd(&m_codec->inflate);
+    }
+#endif
+#ifdef NBBT_HAS_ZSTD
+    ::ZSTD_freeCCtx(m_codec->compress);
+    ::ZSTD_freeDCtx(m_codec->decompress);
+#endif
+    delete m_codec;
+}
+
+//------------------------------------------------------------------------------
+
+void CompressionTransport::set_lower(Transport* recv, Transport* send)
+{
+    m_recv = recv;
+    m_send = send;
+}
+
+//------------------------------------------------------------------------------
+
+long CompressionTransport::send(void const* src, size_t bytes)
+{
+    // frames of previous calls first
+    if (pending()) {
+        int ret = flush();
+        if (0 == ret) {
+            errno = EAGAIN;
+            return -1;
+        } else if (ret < 0) {
+            return -1;
+        }
+    }
+
+    size_t take = std::min(bytes, c_max_frame_input);
+    if (!encode(static_cast<unsigned char const*>(src), take)) {
+        errno = EIO;
+        return -1;
+    }
+    m_bytesIn += take;
+
+    // accepted, even if the frame cannot be written completely yet
+    if (flush() < 0) {
+        return -1;
+    }
+    return static_cast<long>(take);
+}
+
+//------------------------------------------------------------------------------
+
+int CompressionTransport::flush()
+{
+    while (m_outpos < m_out.size()) {
+        long sent = lower_send(&m_out[m_outpos], m_out.size() - m_outpos);
+        if (sent > 0) {
+            m_outpos += static_cast<size_t>(sent);
+            m_bytesOut += static_cast<uint64_t>(sent);
+            continue;
+        }
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (0 == sent) {
+            errno = EPIPE;
+        }
+        return -1;
+    }
+
+    // keeps the capacity
+    m_out.clear();
+    m_outpos = 0;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+
+long CompressionTransport::recv(void* dest, size_t bytes)
+{
+    unsigned char* out = static_cast<unsigned char*>(dest);
+    size_t produced = 0;
+    for (;;) {
+        long decoded = decode(out + produced, bytes - produced);
+        if (decoded < 0) {
+            errno = EIO;
+            return -1;
+        }
+        produced += static_cast<size_t>(decoded);
+        if (produced == bytes) {
+            return static_cast<long>(produced);
+        }
+
+        // all input decoded
+        if (m_inpos == m_in.size()) {
+            m_in.clear();
+            m_inpos = 0;
+        } else if (m_inpos >= c_max_frame_input) {
+            m_in.erase(m_in.begin(), m_in.begin() + m_inpos);
+            m_inpos = 0;
+        }
+
+        size_t size = m_in.size();
+        m_in.resize(size + c_read_size);
+        long received = lower_recv(&m_in[size], c_read_size);
+        m_in.resize(size + std::max<long>(received, 0));
+
+        if (received > 0) {
+            continue;
+        }
+
+        if (0 == received) {
+            return static_cast<long>(produced);
+        }
+
+        if (produced > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return static_cast<long>(produced);
+        }
+        return -1;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+long CompressionTransport::lower_recv(void* dest, size_t bytes)
+{
+    return m_recv ? m_recv->recv(dest, bytes) : ::recv(m_socket, dest, bytes, 0);
+}
+
+//------------------------------------------------------------------------------
+
+long CompressionTransport::lower_send(void const* src, size_t bytes)
+{
+    return m_send ? m_send->send(src, bytes) : ::send(m_socket, src, bytes, 0);
+}
+
+//------------------------------------------------------------------------------
+
+bool CompressionTransport::encode(unsigned char const* src, size_t bytes)
+{
+    int type = c_frame_raw;
+    if (bytes >= m_options.threshold) {
+        if (COMPRESSION_DEFLATE == m_options.algorithm) {
+            type = c_frame_deflate;
+        } else if (COMPRESSION_ZSTD == m_options.algorithm) {
+            type = c_frame_zstd;
+        }
+    }
+
+    size_t header = m_out.size();
+    m_out.resize(header + c_header);
+
+    switch (type) {
+#ifdef NBBT_HAS_ZLIB
+    case c_frame_deflate:
+    {
+        z_stream& z = m_codec->deflate;
+        if (!m_codec->deflateInit) {
+            ::memset(&z, 0, sizeof(z));
+            if (Z_OK != ::deflateInit(&z, m_options.level)) {
+                LOG_ERR(u8"deflateInit failed");
+                return false;
+            }
+            m_codec->deflateInit = true;
+        }
+
+        z.next_in = const_cast<unsigned char*>(src);
+        z.avail_in = static_cast<uInt>(bytes);
+        do {
+            // the sync flush marker is not part of deflateBound()
+            size_t size = m_out.size();
+            size_t space = ::deflateBound(&z, z.avail_in) + 16;
+            m_out.resize(size + space);
+            z.next_out = &m_out[size];
+            z.avail_out = static_cast<uInt>(space);
+            if (Z_STREAM_ERROR == ::deflate(&z, Z_SYNC_FLUSH)) {
+                LOG_ERR(u8"deflate failed");
+                return false;
+            }
+            m_out.resize(size + space - z.avail_out);
+        } while (z.avail_in > 0 || z.avail_out == 0);
+    } break;
+#endif
+#ifdef NBBT_HAS_ZSTD
+    case c_frame_zstd:
+    {
+        if (!m_codec->compress) {
+            m_codec->compress = ::ZSTD_createCCtx();
+            if (!m_codec->compress) {
+                return false;
+            }
+            ::ZSTD_CCtx_setParameter(m_codec->compress, ZSTD_c_compressionLevel,
+                                     m_options.level < 0 ? 0 : m_options.level);
+        }
+
+        ZSTD_inBuffer in = { src, bytes, 0 };
+        size_t remaining;
+        do {
+            size_t size = m_out.size();
+            size_t space = ::ZSTD_compressBound(bytes - in.pos) + 64;
+            m_out.resize(size + space);
+            ZSTD_outBuffer out = { &m_out[size], space, 0 };
+            remaining = ::ZSTD_compressStream2(m_codec->compress, &out, &in, ZSTD_e_flush);
+            m_out.resize(size + out.pos);
+            if (::ZSTD_isError(remaining)) {
+                LOG_ERR_F(u8"zstd: %s", ::ZSTD_getErrorName(remaining));
+                return false;
+            }
+        } while (remaining > 0);
+    } break;
+#endif
+    default:
+    {
+        type = c_frame_raw;
+        m_out.insert(m_out.end(), src, src + bytes);
+    } break;
+    }
+
+    size_t length = m_out.size() - header - c_header;
+    m_out[header] = static_cast<unsigned char>(type);
+    m_out[header + 1] = static_cast<unsigned char>(length >> 24);
+    m_out[header + 2] = static_cast<unsigned char>(length >> 16);
+    m_out[header + 3] = static_cast<unsigned char>(length >> 8);
+    m_out[header + 4] = static_cast<unsigned char>(length);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+long CompressionTransport::decode(unsigned char* dest, size_t bytes)
+{
+    size_t produced = 0;
+    while (produced < bytes) {
+        if (0 == m_frameRemaining && !m_decoderFull) {
+            if (m_in.size() - m_inpos < c_header) {
+                break;
+            }
+
+            unsigned char const* header = &m_in[m_inpos];
+            m_frameType = header[0];
+            m_frameRemaining = (size_t(header[1]) << 24) | (size_t(header[2]) << 16)
+                             | (size_t(header[3]) << 8) | size_t(header[4]);
+            m_inpos += c_header;
+
+            if (c_frame_raw != m_frameType
+                    && !(c_frame_deflate == m_frameType && compression_supported(COMPRESSION_DEFLATE))
+                    && !(c_frame_zstd == m_frameType && compression_supported(COMPRESSION_ZSTD))) {
+                LOG_ERR_F(u8"Unsupported frame type %d", m_frameType);
+                return -1;
+            }
+            continue;
+        }
+
+        size_t input = std::min(m_frameRemaining, m_in.size() - m_inpos);
+        if (0 == input && !m_decoderFull) {
+            break;
+        }
+
+        size_t consumed = 0;
+        size_t output = 0;
+        switch (m_frameType) {
+#ifdef NBBT_HAS_ZLIB
+        case c_frame_deflate:
+        {
+            z_stream& z = m_codec->inflate;
+            if (!m_codec->inflateInit) {
+                ::memset(&z, 0, sizeof(z));
+                if (Z_OK != ::inflateInit(&z)) {
+                    return -1;
+                }
+                m_codec->inflateInit = true;
+            }
+
+            z.next_in = input > 0 ? &m_in[m_inpos] : nullptr;
+            z.avail_in = static_cast<uInt>(input);
+            z.next_out = dest + produced;
+            z.avail_out = static_cast<uInt>(bytes - produced);
+            int ret = ::inflate(&z, Z_SYNC_FLUSH);
+            if (Z_OK != ret && Z_BUF_ERROR != ret) {
+                LOG_ERR_F(u8"inflate failed (%d)", ret);
+                return -1;
+            }
+            consumed = input - z.avail_in;
+            output = (bytes - produced) - z.avail_out;
+            m_decoderFull = 0 == z.avail_out;
+        } break;
+#endif
+#ifdef NBBT_HAS_ZSTD
+        case c_frame_zstd:
+        {
+            if (!m_codec->decompress) {
+                m_codec->decompress = ::ZSTD_createDCtx();
+                if (!m_codec->decompress) {
+                    return -1;
+                }
+            }
+
+            ZSTD_inBuffer in = { input > 0 ? &m_in[m_inpos] : nullptr, input, 0 };
+            ZSTD_outBuffer out = { dest + produced, bytes - produced, 0 };
+            size_t ret = ::ZSTD_decompressStream(m_codec->decompress, &out, &in);
+            if (::ZSTD_isError(ret)) {
+                LOG_ERR_F(u8"zstd: %s", ::ZSTD_getErrorName(ret));
+                return -1;
+            }
+            consumed = in.pos;
+            output = out.pos;
+            m_decoderFull = out.pos == out.size;
+        } break;
+#endif
+        default:
+        {
+            consumed = std::min(input, bytes - produced);
+            ::memcpy(dest + produced, &m_in[m_inpos], consumed);
+            output = consumed;
+            m_decoderFull = false;
+        } break;
+        }
+
+        m_inpos += consumed;
+        m_frameRemaining -= consumed;
+        produced += output;
+
+        if (0 == consumed && 0 == output) {
+            // the decoder needs more input
+            m_decoderFull = false;
+            if (0 == m_frameRemaining) {
+                continue;
+            }
+            break;
+        }
+    }
+
+    return static_cast<long>(produced);
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
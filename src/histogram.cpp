@@ -0,0 +1,168 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/histogram.h"
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+int const Histogram::c_sub_bucket_bits;
+size_t const Histogram::c_sub_buckets;
+size_t const Histogram::c_buckets;
+
+//------------------------------------------------------------------------------
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+//------------------------------------------------------------------------------
+
+Histogram::Histogram(Histogram const& other)
+{
+    reset();
+    merge(other);
+}
+
+//------------------------------------------------------------------------------
+
+Histogram& Histogram::operator=(Histogram const& other)
+{
+    if (this != &other) {
+        reset();
+        merge(other);
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+
+void Histogram::merge(Histogram const& other)
+{
+    for (size_t i = 0; i < c_buckets; ++i) {
+        uint64_t count = other.m_counts[i].load(std::memory_order_relaxed);
+        if (count > 0) {
+            m_counts[i].fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+
+    m_count.fetch_add(other.count(), std::memory_order_relaxed);
+    m_sum.fetch_add(other.sum(), std::memory_order_relaxed);
+
+    uint64_t max = other.max();
+    if (max > m_max.load(std::memory_order_relaxed)) {
+        m_max.store(max, std::memory_order_relaxed);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Histogram::reset()
+{
+    for (auto& count : m_counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t Histogram::percentile(double percentile) const
+{
+    // Sum the buckets instead of using m_count, they may be updated while we
+    // are reading them.
+    uint64_t total = 0;
+    for (auto const& count : m_counts) {
+        total += count.load(std::memory_order_relaxed);
+    }
+
+    if (0 == total) {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < c_buckets; ++i) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            // upper bound of the bucket, but never more than the largest value
+            uint64_t upper = (i + 1 < c_buckets) ? bucket_lower(i + 1) - 1 : UINT64_MAX;
+            uint64_t max = this->max();
+            return (max > 0 && upper > max) ? max : upper;
+        }
+    }
+
+    return max();
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t Histogram::bucket_lower(size_t bucket)
+{
+    if (bucket < c_sub_buckets) {
+        return bucket;
+    }
+
+    size_t shift = bucket / c_sub_buckets - 1;
+    uint64_t sub = bucket % c_sub_buckets + c_sub_buckets;
+    return sub << shift;
+}
+
+//------------------------------------------------------------------------------
+
+void LoopLatency::merge(LoopLatency const& other)
+{
+    wait.merge(other.wait);
+    iteration.merge(other.iteration);
+    read.merge(other.read);
+    callback.merge(other.callback);
+    flush.merge(other.flush);
+    rxqueue.merge(other.rxqueue);
+}
+
+//------------------------------------------------------------------------------
+
+void LoopLatency::reset()
+{
+    wait.reset();
+    iteration.reset();
+    read.reset();
+    callback.reset();
+    flush.reset();
+    rxqueue.reset();
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
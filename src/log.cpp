@@ -22,7 +22,7 @@
  * SOFTWARE.
  */
 
-#include "nbbt/log.h"
+#include "log.h"
 
 #ifndef _WIN32
 #include <syslog.h>
@@ -32,8 +32,14 @@
 #include "shared/win32_utf8.h"
 #endif
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
-#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
 
 #ifndef va_copy
 #define va_copy(d, s) ((d) = (s))
@@ -57,32 +63,249 @@ static int S_loglevel_syslog_codes[] = {
 
 //------------------------------------------------------------------------------
 
-void _log_message(int level, char const* format, va_list& ap) {
-    static char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, ap);
+namespace {
 
+static size_t const c_log_slots = 1024;         // must be a power of two
+static size_t const c_log_message_len = 256;
+
+/**
+ * Bounded multi producer queue of preformatted messages (Vyukov). Every slot
+ * carries a sequence number telling whether it is free for the producer of
+ * a given position or ready for the consumer.
+ */
+struct Logger
+{
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        int level;
+        char text[c_log_message_len];
+    };
+
+    Logger()
+    {
+        for (size_t i = 0; i < c_log_slots; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    Slot* acquire();
+    void publish(Slot* slot);
+    void run();
+    bool drain();
+    void stop();
+
+    Slot slots[c_log_slots];
+    std::atomic<size_t> head{0};    // next position to write (producers)
+    size_t tail = 0;                // next position to read (consumer)
+
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> published{0};
+
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> stopped{false};
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+//------------------------------------------------------------------------------
+
+Logger& logger()
+{
+    // Never destroyed, other threads may still log during exit. The
+    // background thread is stopped by an atexit() handler instead.
+    static Logger* logger = [] {
+        Logger* l = new Logger;
+        l->thread = std::thread(&Logger::run, l);
+        std::atexit([] { nbbt::logger().stop(); });
+        return l;
+    }();
+    return *logger;
+}
+
+//------------------------------------------------------------------------------
+
+Logger::Slot* Logger::acquire()
+{
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot* slot = &slots[pos & (c_log_slots - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (0 == diff) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            // full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void Logger::publish(Slot* slot)
+{
+    size_t pos = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    published.fetch_add(1, std::memory_order_relaxed);
+
+    // pairs with the fence in run(), either we see the flag or it sees the slot
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_one();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool Logger::drain()
+{
+    uint64_t count = 0;
+    for (;;) {
+        Slot& slot = slots[tail & (c_log_slots - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1) {
+            break;
+        }
+
+#ifndef _WIN32
+        syslog(S_loglevel_syslog_codes[slot.level], "%s", slot.text);
+#endif
+        fprintf(stdout, "%s: %s\n", S_loglevel_names[slot.level], slot.text);
+
+        // hand the slot back to the producers
+        slot.seq.store(tail + c_log_slots, std::memory_order_release);
+        ++tail;
+        ++count;
+    }
+
+    if (0 == count) {
+        return false;
+    }
+
+    // log_flush() returns once the messages have left stdout's buffer
+    fflush(stdout);
+    written.fetch_add(count, std::memory_order_relaxed);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void Logger::run()
+{
+    while (!stopped.load(std::memory_order_acquire)) {
+        if (drain()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // a message may have been published before we set the flag
+        Slot& slot = slots[tail & (c_log_slots - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1) {
+            cond.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    drain();
+}
+
+//------------------------------------------------------------------------------
+
+void Logger::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped.store(true, std::memory_order_release);
+        cond.notify_one();
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void _enqueue(int level, char const* format, va_list* ap, char const* message)
+{
+    Logger& l = logger();
+
+    if (l.stopped.load(std::memory_order_acquire)) {
+        // during exit write directly
+        char buffer[c_log_message_len];
+        if (ap) {
+            vsnprintf(buffer, sizeof(buffer), format, *ap);
+            message = buffer;
+        }
 #ifndef _WIN32
-    syslog(S_loglevel_syslog_codes[level], "%s", buffer);
+        syslog(S_loglevel_syslog_codes[level], "%s", message);
 #endif
-    std::cout << S_loglevel_names[level] << ": " << buffer << std::endl;
+        fprintf(stdout, "%s: %s\n", S_loglevel_names[level], message);
+        return;
+    }
+
+    Logger::Slot* slot = l.acquire();
+    if (!slot) {
+        return;
+    }
+
+    slot->level = level;
+    if (ap) {
+        vsnprintf(slot->text, sizeof(slot->text), format, *ap);
+    } else {
+        strncpy(slot->text, message, sizeof(slot->text) - 1);
+        slot->text[sizeof(slot->text) - 1] = '\0';
+    }
+
+    l.publish(slot);
 }
 
+} // namespace
+
 //------------------------------------------------------------------------------
 
 void log_message_f(int level, const char* format, ...) {
     va_list ap;
     va_start(ap, format);
-    _log_message(level, format, ap);
+    _enqueue(level, format, &ap, nullptr);
     va_end(ap);
 }
 
 //------------------------------------------------------------------------------
 
 void log_message(int level, const char* message) {
-#ifndef _WIN32
-    syslog(S_loglevel_syslog_codes[level], "%s", message);
-#endif
-    std::cout << S_loglevel_names[level] << ": " << message << std::endl;
+    _enqueue(level, nullptr, nullptr, message);
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t log_dropped() {
+    return logger().dropped.load(std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+
+void log_flush() {
+    Logger& l = logger();
+    uint64_t target = l.published.load(std::memory_order_relaxed);
+    while (l.written.load(std::memory_order_relaxed) < target
+           && !l.stopped.load(std::memory_order_acquire)) {
+        {
+            std::lock_guard<std::mutex> lock(l.mutex);
+            l.cond.notify_one();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -97,8 +320,25 @@ void log_win32_error(int level, unsigned long error) {
 //------------------------------------------------------------------------------
 
 #ifndef _WIN32
+namespace {
+
+// GNU strerror_r() (_GNU_SOURCE, the default of g++) returns the message
+inline char const* _strerror(char const* ret, char const* buffer) {
+    (void)buffer;
+    return ret;
+}
+
+// XSI strerror_r() returns 0 and fills the buffer
+inline char const* _strerror(int ret, char const* buffer) {
+    return 0 == ret ? buffer : "Unknown error";
+}
+
+} // namespace
+
 void log_errno(int level, int error) {
-    log_message(level, strerror(error));
+    // strerror() is not thread safe
+    char buffer[128];
+    log_message(level, _strerror(strerror_r(error, buffer, sizeof(buffer)), buffer));
 }
 #endif
 
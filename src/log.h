@@ -29,43 +29,98 @@
 
 #include "nbbt/socket.h"
 
+#include <cstdint>
 #include <string>
 
 //------------------------------------------------------------------------------
 
-namespace nbbt {
+/**
+ * Messages are formatted on the calling thread into a slot of a lock-free
+ * ring buffer and written to syslog and stdout by a background thread. If the
+ * ring buffer is full, the message is dropped and counted (see
+ * log_dropped()), the calling thread never blocks.
+ *
+ * Levels above NBBT_LOG_LEVEL are compiled away:
+ * 0 = errors, 1 = warnings, 2 = info (default), 3 = debug
+ */
+#ifndef NBBT_LOG_LEVEL
+#define NBBT_LOG_LEVEL 2
+#endif
 
 //------------------------------------------------------------------------------
 
-#define LOG_INFO_F(format, ...) log_message_f(2, format, __VA_ARGS__)
-#define LOG_INFO(message) log_message(2, message)
+namespace nbbt {
 
-#define LOG_WARN_F(format, ...) log_message_f(1, format, __VA_ARGS__)
-#define LOG_WARN(message) log_message(1, message)
+//------------------------------------------------------------------------------
 
-#define LOG_ERR_F(format, ...) log_message_f(0, format, __VA_ARGS__)
-#define LOG_ERR(message) log_message(0, message)
+#if NBBT_LOG_LEVEL >= 3
+#define LOG_DBG_F(format, ...) ::nbbt::log_message_f(3, format, __VA_ARGS__)
+#define LOG_DBG(message) ::nbbt::log_message(3, message)
+#else
+#define LOG_DBG_F(format, ...) ((void)0)
+#define LOG_DBG(message) ((void)0)
+#endif
+
+#if NBBT_LOG_LEVEL >= 2
+#define LOG_INFO_F(format, ...) ::nbbt::log_message_f(2, format, __VA_ARGS__)
+#define LOG_INFO(message) ::nbbt::log_message(2, message)
+#else
+#define LOG_INFO_F(format, ...) ((void)0)
+#define LOG_INFO(message) ((void)0)
+#endif
+
+#if NBBT_LOG_LEVEL >= 1
+#define LOG_WARN_F(format, ...) ::nbbt::log_message_f(1, format, __VA_ARGS__)
+#define LOG_WARN(message) ::nbbt::log_message(1, message)
+#else
+#define LOG_WARN_F(format, ...) ((void)0)
+#define LOG_WARN(message) ((void)0)
+#endif
+
+#define LOG_ERR_F(format, ...) ::nbbt::log_message_f(0, format, __VA_ARGS__)
+#define LOG_ERR(message) ::nbbt::log_message(0, message)
 
 void log_message_f(int level, char const* format, ...);
 void log_message(int level, char const* message);
 
+/**
+ * Number of messages dropped because the ring buffer was full.
+ */
+uint64_t log_dropped();
+
+/**
+ * Block until all queued messages have been written.
+ */
+void log_flush();
+
 //------------------------------------------------------------------------------
 
 #ifdef _WIN32
-#define LOG_INFO_LASTERROR(error) log_win32_error(2, error)
-#define LOG_WARN_LASTERROR(error) log_win32_error(1, error)
-#define LOG_ERR_LASTERROR(error) log_win32_error(0, error)
+#define LOG_INFO_LASTERROR(error) ::nbbt::log_win32_error(2, error)
+#define LOG_WARN_LASTERROR(error) ::nbbt::log_win32_error(1, error)
+#define LOG_ERR_LASTERROR(error) ::nbbt::log_win32_error(0, error)
 
 void log_win32_error(int level, unsigned long error);
-#endif // _WIN32
+#else
 
 //------------------------------------------------------------------------------
 
-#define LOG_INFO_LASTERROR(error) log_errno(2, error)
-#define LOG_WARN_LASTERROR(error) log_errno(1, error)
-#define LOG_ERR_LASTERROR(error) log_errno(0, error)
+#if NBBT_LOG_LEVEL >= 2
+#define LOG_INFO_LASTERROR(error) ::nbbt::log_errno(2, error)
+#else
+#define LOG_INFO_LASTERROR(error) ((void)0)
+#endif
+
+#if NBBT_LOG_LEVEL >= 1
+#define LOG_WARN_LASTERROR(error) ::nbbt::log_errno(1, error)
+#else
+#define LOG_WARN_LASTERROR(error) ((void)0)
+#endif
+
+#define LOG_ERR_LASTERROR(error) ::nbbt::log_errno(0, error)
 
 void log_errno(int level, int error);
+#endif // _WIN32
 
 //------------------------------------------------------------------------------
 
@@ -0,0 +1,159 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/metrics.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<MetricsBlock*> blocks;
+    int64_t retired[METRIC_COUNT] = {};
+};
+
+Registry& registry()
+{
+    // never destroyed, threads may exit after static destruction
+    static Registry* registry = new Registry;
+    return *registry;
+}
+
+struct ThreadMetrics
+{
+    ThreadMetrics()
+    {
+        for (auto& value : block.values) {
+            value.store(0, std::memory_order_relaxed);
+        }
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.blocks.push_back(&block);
+    }
+
+    ~ThreadMetrics()
+    {
+        // keep the values of exited threads
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (int i = 0; i < METRIC_COUNT; ++i) {
+            r.retired[i] += block.values[i].load(std::memory_order_relaxed);
+        }
+        for (auto it = r.blocks.begin(); it != r.blocks.end(); ++it) {
+            if (*it == &block) {
+                r.blocks.erase(it);
+                break;
+            }
+        }
+    }
+
+    MetricsBlock block;
+};
+
+struct MetricInfo
+{
+    char const* name;
+    char const* type;
+    char const* help;
+};
+
+MetricInfo const S_metric_info[METRIC_COUNT] = {
+    { "nbbt_bytes_in_total", "counter", "Bytes received." },
+    { "nbbt_bytes_out_total", "counter", "Bytes sent." },
+    { "nbbt_recv_calls_total", "counter", "Calls to recv()." },
+    { "nbbt_send_calls_total", "counter", "Calls to send()." },
+    { "nbbt_eagain_total", "counter", "Calls to recv() or send() that returned EAGAIN." },
+    { "nbbt_accepts_total", "counter", "Accepted connections." },
+    { "nbbt_connects_total", "counter", "Connections established by clients." },
+    { "nbbt_disconnects_total", "counter", "Closed connections." },
+    { "nbbt_rejects_total", "counter", "Connections closed right after accepting (server full)." },
+    { "nbbt_throttles_total", "counter", "Connections stopped by a rate limit." },
+    { "nbbt_throttled_nanoseconds_total", "counter", "Time connections waited for a rate limit." },
+    { "nbbt_relayed_bytes_total", "counter", "Bytes passed between relayed connections without copying." },
+    { "nbbt_connections", "gauge", "Open connections." },
+    { "nbbt_buffered_bytes", "gauge", "Bytes stored in buffers." },
+    { "nbbt_buffer_memory_bytes", "gauge", "Bytes allocated for buffer chunks." },
+    { "nbbt_arena_memory_bytes", "gauge", "Bytes mapped by chunk allocators." },
+    { "nbbt_hugepage_memory_bytes", "gauge", "Bytes mapped by chunk allocators on huge pages (MAP_HUGETLB or MADV_HUGEPAGE)." },
+    { "nbbt_spilled_memory_bytes", "gauge", "Bytes of buffer chunks moved to spill files." },
+};
+
+} // namespace
+
+//------------------------------------------------------------------------------
+
+MetricsBlock& metrics_block()
+{
+    static thread_local ThreadMetrics metrics;
+    return metrics.block;
+}
+
+//------------------------------------------------------------------------------
+
+void metrics_snapshot(MetricsSnapshot& snapshot)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    for (int i = 0; i < METRIC_COUNT; ++i) {
+        snapshot.values[i] = r.retired[i];
+    }
+
+    for (MetricsBlock* block : r.blocks) {
+        for (int i = 0; i < METRIC_COUNT; ++i) {
+            snapshot.values[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void metrics_format_prometheus(MetricsSnapshot const& snapshot, std::string& text)
+{
+    text.clear();
+
+    char line[256];
+    for (int i = 0; i < METRIC_COUNT; ++i) {
+        MetricInfo const& info = S_metric_info[i];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %" PRId64 "\n",
+                 info.name, info.help, info.name, info.type, info.name, snapshot.values[i]);
+        text += line;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
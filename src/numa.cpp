@@ -0,0 +1,222 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/numa.h"
+#include "nbbt/metrics.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+// see set_mempolicy(2), <numaif.h> is part of libnuma
+static int const c_mpol_preferred = 1;
+
+static size_t const c_huge_page = 2 << 20;
+
+//------------------------------------------------------------------------------
+
+bool thread_set_affinity(std::vector<int> const& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            LOG_ERR_F(u8"Invalid CPU %d", cpu);
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+
+    int ret = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if (0 != ret) {
+        LOG_ERR_F(u8"pthread_setaffinity_np: %s", ::strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+int cpu_node(int cpu)
+{
+    // /sys/devices/system/cpu/cpuN/nodeM
+    char path[64];
+    ::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = ::opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    int node = 0;
+    while (struct dirent* entry = ::readdir(dir)) {
+        if (1 == ::sscanf(entry->d_name, "node%d", &node)) {
+            break;
+        }
+    }
+    ::closedir(dir);
+    return node;
+}
+
+//------------------------------------------------------------------------------
+
+NodeChunkAllocator::NodeChunkAllocator(int node, size_t slab, bool hugepages)
+    : m_node(node), m_hugepages(hugepages), m_tryHugetlb(hugepages)
+    , m_slab(hugepages ? (slab + c_huge_page - 1) / c_huge_page * c_huge_page : slab)
+    , m_offset(m_slab), m_used(0), m_hugetlb(0), m_transparent(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+NodeChunkAllocator::~NodeChunkAllocator()
+{
+    for (unsigned char* slab : m_slabs) {
+        ::munmap(slab, m_slab);
+    }
+
+    metrics_add(METRIC_ARENA_MEMORY, -static_cast<int64_t>(reserved()));
+    metrics_add(METRIC_HUGEPAGE_MEMORY, -static_cast<int64_t>(m_hugetlb + m_transparent));
+}
+
+//------------------------------------------------------------------------------
+
+unsigned char* NodeChunkAllocator::allocate(size_t bytes)
+{
+    unsigned char* chunk;
+
+    auto it = m_free.find(bytes);
+    if (it != m_free.end() && !it->second.empty()) {
+        chunk = it->second.back();
+        it->second.pop_back();
+    } else if (bytes > m_slab) {
+        throw std::bad_alloc();
+    } else {
+        if (m_slab - m_offset < bytes && !map_slab()) {
+            throw std::bad_alloc();
+        }
+        chunk = m_slabs.back() + m_offset;
+        m_offset += bytes;
+    }
+
+    m_used += bytes;
+    return chunk;
+}
+
+//------------------------------------------------------------------------------
+
+void NodeChunkAllocator::deallocate(unsigned char* chunk, size_t bytes)
+{
+    m_free[bytes].push_back(chunk);
+    m_used -= bytes;
+}
+
+//------------------------------------------------------------------------------
+
+void* NodeChunkAllocator::map_huge()
+{
+    if (m_tryHugetlb) {
+        void* slab = ::mmap(nullptr, m_slab, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED != slab) {
+            m_hugetlb += m_slab;
+            metrics_add(METRIC_HUGEPAGE_MEMORY, m_slab);
+            return slab;
+        }
+
+        LOG_WARN_F(u8"MAP_HUGETLB: %s, using transparent huge pages", ::strerror(errno));
+        m_tryHugetlb = false;
+    }
+
+    // align to the huge page size, otherwise the first and last pages of the
+    // slab cannot become huge pages
+    size_t length = m_slab + c_huge_page;
+    void* mapped = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mapped) {
+        return MAP_FAILED;
+    }
+
+    unsigned char* start = static_cast<unsigned char*>(mapped);
+    unsigned char* slab = reinterpret_cast<unsigned char*>(
+                (reinterpret_cast<uintptr_t>(start) + c_huge_page - 1) & ~(c_huge_page - 1));
+    if (slab > start) {
+        ::munmap(start, slab - start);
+    }
+    ::munmap(slab + m_slab, start + length - (slab + m_slab));
+
+    if (0 == ::madvise(slab, m_slab, MADV_HUGEPAGE)) {
+        m_transparent += m_slab;
+        metrics_add(METRIC_HUGEPAGE_MEMORY, m_slab);
+    } else {
+        LOG_DBG_F(u8"MADV_HUGEPAGE: %s", ::strerror(errno));
+    }
+    return slab;
+}
+
+//------------------------------------------------------------------------------
+
+bool NodeChunkAllocator::map_slab()
+{
+    void* slab = m_hugepages ? map_huge()
+                             : ::mmap(nullptr, m_slab, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == slab) {
+        LOG_ERR_F(u8"mmap: %s", ::strerror(errno));
+        return false;
+    }
+
+    // Pages are placed when touched first, the policy makes that happen on
+    // the node even if another thread touches them.
+    if (m_node >= 0 && m_node < static_cast<int>(sizeof(unsigned long) * 8) - 1) {
+        unsigned long mask = 1UL << m_node;
+        if (-1 == ::syscall(SYS_mbind, slab, m_slab, c_mpol_preferred, &mask, sizeof(mask) * 8, 0)) {
+            LOG_DBG_F(u8"mbind: %s", ::strerror(errno));
+        }
+    }
+
+    m_slabs.push_back(static_cast<unsigned char*>(slab));
+    m_offset = 0;
+    metrics_add(METRIC_ARENA_MEMORY, m_slab);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
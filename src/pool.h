@@ -0,0 +1,141 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LIBNBBT_POOL_H
+#define LIBNBBT_POOL_H
+
+//------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <new>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+/**
+ * @brief allocator that keeps freed objects for reuse.
+ *
+ * For node based containers (std::map), which allocate one node at a time:
+ * freed nodes go to a free list of their type on the freeing thread and are
+ * handed out again, so a container that stays about the same size does not
+ * allocate. The free lists are released when the thread exits.
+ *
+ * std::map<int, int, std::less<int>, PoolAllocator<std::pair<int const, int>>> map;
+ */
+template <class T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator() = default;
+    template <class U> PoolAllocator(PoolAllocator<U> const&) {}
+
+    T* allocate(size_t n)
+    {
+        if (1 != n) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        FreeList& list = free_list();
+        if (!released() && list.head) {
+            Node* node = list.head;
+            list.head = node->next;
+            return reinterpret_cast<T*>(node);
+        }
+        return static_cast<T*>(::operator new(std::max(sizeof(T), sizeof(Node))));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (1 != n || released()) {
+            ::operator delete(p);
+            return;
+        }
+
+        FreeList& list = free_list();
+        Node* node = reinterpret_cast<Node*>(p);
+        node->next = list.head;
+        list.head = node;
+    }
+
+private:
+    struct Node
+    {
+        Node* next;
+    };
+
+    struct FreeList
+    {
+        Node* head = nullptr;
+
+        ~FreeList()
+        {
+            released() = true;
+            while (head) {
+                Node* next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+    };
+
+    // containers destroyed after the free list (statics) bypass it
+    static bool& released()
+    {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    static FreeList& free_list()
+    {
+        static thread_local FreeList list;
+        return list;
+    }
+}; // struct PoolAllocator
+
+template <class T, class U>
+inline bool operator==(PoolAllocator<T> const&, PoolAllocator<U> const&) { return true; }
+
+template <class T, class U>
+inline bool operator!=(PoolAllocator<T> const&, PoolAllocator<U> const&) { return false; }
+
+/**
+ * std::map with pooled nodes.
+ */
+template <class K, class V>
+using PoolMap = std::map<K, V, std::less<K>, PoolAllocator<std::pair<K const, V>>>;
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
+
+//------------------------------------------------------------------------------
+
+#endif // LIBNBBT_POOL_H
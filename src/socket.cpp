@@ -23,10 +23,11 @@
  */
 
 #include "nbbt/socket.h"
-#include "nbbt/log.h"
+#include "log.h"
 
 #ifndef _WIN32
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <cerrno>
 #endif
@@ -86,4 +87,146 @@ void socket_close(socket_t socket)
 
 //------------------------------------------------------------------------------
 
+bool socket_pair(socket_t sockets[2])
+{
+    sockets[0] = INVALID_SOCKET;
+    sockets[1] = INVALID_SOCKET;
+
+#ifdef _WIN32
+    // there is no socketpair(), connect through a loopback listener
+    socket_t listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (INVALID_SOCKET == listener) {
+        return false;
+    }
+
+    struct sockaddr_in address;
+    ::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    int length = sizeof(address);
+
+    bool connected = 0 == ::bind(listener, (struct sockaddr*)&address, sizeof(address))
+            && 0 == ::getsockname(listener, (struct sockaddr*)&address, &length)
+            && 0 == ::listen(listener, 1)
+            && INVALID_SOCKET != (sockets[0] = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))
+            && 0 == ::connect(sockets[0], (struct sockaddr*)&address, sizeof(address))
+            && INVALID_SOCKET != (sockets[1] = ::accept(listener, nullptr, nullptr));
+    ::closesocket(listener);
+#else
+    bool connected = 0 == ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+#endif
+
+    if (!connected || !socket_set_nonblocking(sockets[0]) || !socket_set_nonblocking(sockets[1])) {
+        for (int i = 0; i < 2; ++i) {
+            if (INVALID_SOCKET != sockets[i]) {
+                socket_close(sockets[i]);
+                sockets[i] = INVALID_SOCKET;
+            }
+        }
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+#ifndef _WIN32
+bool socket_send_fd(socket_t socket, socket_t fd, void const* data, size_t bytes)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = bytes;
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    ::memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (INVALID_SOCKET != fd) {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        ::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // the file descriptor is attached to the first byte
+    while (iov.iov_len > 0) {
+        ssize_t sent = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (-1 == sent) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        iov.iov_base = static_cast<char*>(iov.iov_base) + sent;
+        iov.iov_len -= static_cast<size_t>(sent);
+        msg.msg_control = nullptr;
+        msg.msg_controllen = 0;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool socket_recv_fd(socket_t socket, socket_t& fd, void* data, size_t bytes)
+{
+    fd = INVALID_SOCKET;
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = bytes;
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    while (iov.iov_len > 0) {
+        struct msghdr msg;
+        ::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        ssize_t read = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        if (-1 == read) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (0 == read) {
+            return false;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                ::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+
+        iov.iov_base = static_cast<char*>(iov.iov_base) + read;
+        iov.iov_len -= static_cast<size_t>(read);
+    }
+
+    return true;
+}
+#endif
+
+//------------------------------------------------------------------------------
+
 } // namespace nbbt
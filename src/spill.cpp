@@ -0,0 +1,151 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/spill.h"
+#include "nbbt/metrics.h"
+
+#include "log.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+SpillFile::~SpillFile()
+{
+    if (m_base) {
+        ::munmap(m_base, m_capacity);
+    }
+    if (-1 != m_fd) {
+        ::close(m_fd);
+    }
+    metrics_add(METRIC_SPILLED_MEMORY, -static_cast<int64_t>(m_used));
+}
+
+//------------------------------------------------------------------------------
+
+bool SpillFile::open(char const* directory, size_t slot, size_t capacity)
+{
+    if (m_base || 0 == slot || capacity < slot) {
+        return false;
+    }
+
+#ifdef O_TMPFILE
+    m_fd = ::open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (-1 == m_fd) {
+        // file systems without O_TMPFILE
+        std::string path = std::string(directory) + "/nbbt-spill-XXXXXX";
+        m_fd = ::mkostemp(&path[0], O_CLOEXEC);
+        if (-1 != m_fd) {
+            ::unlink(path.c_str());
+        }
+    }
+    if (-1 == m_fd) {
+        LOG_ERR_F(u8"Cannot create spill file in %s: %s", directory, ::strerror(errno));
+        return false;
+    }
+
+    capacity -= capacity % slot;
+    if (-1 == ::ftruncate(m_fd, static_cast<off_t>(capacity))) {
+        LOG_ERR_F(u8"ftruncate: %s", ::strerror(errno));
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    void* base = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (MAP_FAILED == base) {
+        LOG_ERR_F(u8"mmap: %s", ::strerror(errno));
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_base = static_cast<unsigned char*>(base);
+    m_slot = slot;
+    m_capacity = capacity;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+unsigned char* SpillFile::store(unsigned char const* chunk)
+{
+    unsigned char* slot;
+    if (!m_free.empty()) {
+        slot = m_free.back();
+        m_free.pop_back();
+    } else if (m_offset + m_slot <= m_capacity) {
+        slot = m_base + m_offset;
+        m_offset += m_slot;
+    } else {
+        return nullptr;
+    }
+
+    ::memcpy(slot, chunk, m_slot);
+#ifdef MADV_PAGEOUT
+    // otherwise the pages stay cached until the kernel needs the memory
+    ::madvise(slot, m_slot, MADV_PAGEOUT);
+#endif
+
+    m_used += m_slot;
+    metrics_add(METRIC_SPILLED_MEMORY, m_slot);
+    return slot;
+}
+
+//------------------------------------------------------------------------------
+
+void SpillFile::release(unsigned char* slot)
+{
+    // drops the pages and the blocks on disk
+    if (-1 == ::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          static_cast<off_t>(slot - m_base), static_cast<off_t>(m_slot))) {
+        ::madvise(slot, m_slot, MADV_DONTNEED);
+    }
+
+    m_free.push_back(slot);
+    m_used -= m_slot;
+    metrics_add(METRIC_SPILLED_MEMORY, -static_cast<int64_t>(m_slot));
+}
+
+//------------------------------------------------------------------------------
+
+void SpillFile::prefetch(unsigned char const* slot)
+{
+    ::madvise(const_cast<unsigned char*>(slot), m_slot, MADV_WILLNEED);
+}
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
@@ -0,0 +1,461 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "nbbt/tls.h"
+#include "log.h"
+
+#ifdef NBBT_HAS_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+
+//------------------------------------------------------------------------------
+
+namespace nbbt {
+
+//------------------------------------------------------------------------------
+
+#ifdef NBBT_HAS_TLS
+
+// validity of generated certificates
+static long const c_self_signed_days = 30;
+
+// largest plaintext of a single record
+static size_t const c_max_record = 16384;
+
+//------------------------------------------------------------------------------
+
+static void log_tls_error(char const* what)
+{
+    unsigned long error = ::ERR_get_error();
+    if (0 == error) {
+        LOG_ERR_F(u8"%s failed", what);
+        return;
+    }
+
+    while (0 != error) {
+        char message[256];
+        ::ERR_error_string_n(error, message, sizeof(message));
+        LOG_ERR_F(u8"%s failed: %s", what, message);
+        error = ::ERR_get_error();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+TlsContext::TlsContext()
+    : m_ctx(nullptr), m_server(false)
+{
+
+}
+
+//------------------------------------------------------------------------------
+
+TlsContext::~TlsContext()
+{
+    ::SSL_CTX_free(m_ctx);
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsContext::init(bool server)
+{
+    if (m_ctx) {
+        return false;
+    }
+
+    m_ctx = ::SSL_CTX_new(server ? ::TLS_server_method() : ::TLS_client_method());
+    if (!m_ctx) {
+        log_tls_error("SSL_CTX_new");
+        return false;
+    }
+    m_server = server;
+
+    ::SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // report a close without close_notify as a regular close
+    ::SSL_CTX_set_options(m_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    // Buffer::flush() continues a partial write from a different address.
+    ::SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    set_ktls(true);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsContext::init_server(char const* certificate, char const* key)
+{
+    if (!init(true)) {
+        return false;
+    }
+
+    if (1 != ::SSL_CTX_use_certificate_chain_file(m_ctx, certificate)
+            || 1 != ::SSL_CTX_use_PrivateKey_file(m_ctx, key, SSL_FILETYPE_PEM)
+            || 1 != ::SSL_CTX_check_private_key(m_ctx)) {
+        log_tls_error("Loading certificate");
+        return false;
+    }
+
+    BIO* bio = ::BIO_new(::BIO_s_mem());
+    if (bio && ::PEM_write_bio_X509(bio, ::SSL_CTX_get0_certificate(m_ctx))) {
+        char* data;
+        long bytes = BIO_get_mem_data(bio, &data);
+        m_certificate.assign(data, bytes);
+    }
+    ::BIO_free(bio);
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsContext::init_server_self_signed(char const* common_name)
+{
+    if (!init(true)) {
+        return false;
+    }
+
+    bool success = false;
+    EVP_PKEY* key = nullptr;
+    X509* certificate = nullptr;
+    X509_EXTENSION* san = nullptr;
+    BIO* bio = nullptr;
+    std::string names = std::string("DNS:") + common_name;
+
+    EVP_PKEY_CTX* keygen = ::EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!keygen
+            || 1 != ::EVP_PKEY_keygen_init(keygen)
+            || 1 != ::EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1)
+            || 1 != ::EVP_PKEY_keygen(keygen, &key)) {
+        goto done;
+    }
+
+    certificate = ::X509_new();
+    if (!certificate
+            || 1 != ::X509_set_version(certificate, 2)
+            || 1 != ::ASN1_INTEGER_set(::X509_get_serialNumber(certificate), 1)
+            || !::X509_gmtime_adj(::X509_getm_notBefore(certificate), 0)
+            || !::X509_gmtime_adj(::X509_getm_notAfter(certificate), c_self_signed_days * 24 * 3600)
+            || 1 != ::X509_set_pubkey(certificate, key)
+            || 1 != ::X509_NAME_add_entry_by_txt(::X509_get_subject_name(certificate), "CN", MBSTRING_UTF8,
+                                                 reinterpret_cast<unsigned char const*>(common_name), -1, -1, 0)
+            || 1 != ::X509_set_issuer_name(certificate, ::X509_get_subject_name(certificate))) {
+        goto done;
+    }
+
+    san = ::X509V3_EXT_conf_nid(nullptr, nullptr, NID_subject_alt_name, &names[0]);
+    if (!san
+            || 1 != ::X509_add_ext(certificate, san, -1)
+            || 0 == ::X509_sign(certificate, key, ::EVP_sha256())
+            || 1 != ::SSL_CTX_use_certificate(m_ctx, certificate)
+            || 1 != ::SSL_CTX_use_PrivateKey(m_ctx, key)) {
+        goto done;
+    }
+
+    bio = ::BIO_new(::BIO_s_mem());
+    if (!bio || !::PEM_write_bio_X509(bio, certificate)) {
+        goto done;
+    }
+
+    {
+        char* data;
+        long bytes = BIO_get_mem_data(bio, &data);
+        m_certificate.assign(data, bytes);
+    }
+    success = true;
+
+done:
+    if (!success) {
+        log_tls_error("Generating certificate");
+    }
+    ::BIO_free(bio);
+    ::X509_EXTENSION_free(san);
+    ::X509_free(certificate);
+    ::EVP_PKEY_free(key);
+    ::EVP_PKEY_CTX_free(keygen);
+    return success;
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsContext::init_client(char const* ca_file)
+{
+    if (!init(false)) {
+        return false;
+    }
+
+    ::SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER, nullptr);
+
+    int ret = ca_file ? ::SSL_CTX_load_verify_locations(m_ctx, ca_file, nullptr)
+                      : ::SSL_CTX_set_default_verify_paths(m_ctx);
+    if (1 != ret) {
+        log_tls_error("Loading trusted certificates");
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsContext::trust(std::string const& pem)
+{
+    if (!m_ctx) {
+        return false;
+    }
+
+    BIO* bio = ::BIO_new_mem_buf(pem.data(), static_cast<int>(pem.size()));
+    X509* certificate = bio ? ::PEM_read_bio_X509(bio, nullptr, nullptr, nullptr) : nullptr;
+    bool success = certificate && 1 == ::X509_STORE_add_cert(::SSL_CTX_get_cert_store(m_ctx), certificate);
+    if (!success) {
+        log_tls_error("Adding trusted certificate");
+    }
+
+    ::X509_free(certificate);
+    ::BIO_free(bio);
+    return success;
+}
+
+//------------------------------------------------------------------------------
+
+void TlsContext::set_ktls(bool enable)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable) {
+        ::SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    } else {
+        ::SSL_CTX_clear_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    (void)enable;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+TlsSession::TlsSession(TlsContext& context, socket_t socket, char const* servername)
+    : m_ssl(::SSL_new(context.native())), m_established(false), m_wantWrite(false), m_ahead(0)
+{
+    if (!m_ssl || 1 != ::SSL_set_fd(m_ssl, socket)) {
+        log_tls_error("SSL_new");
+        return;
+    }
+
+    if (context.is_server()) {
+        ::SSL_set_accept_state(m_ssl);
+    } else {
+        ::SSL_set_connect_state(m_ssl);
+        if (servername) {
+            ::SSL_set_tlsext_host_name(m_ssl, servername);
+            ::SSL_set1_host(m_ssl, servername);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+TlsSession::~TlsSession()
+{
+    ::SSL_free(m_ssl);
+}
+
+//------------------------------------------------------------------------------
+
+int TlsSession::handshake()
+{
+    if (!m_ssl) {
+        return -1;
+    }
+
+    ::ERR_clear_error();
+    int ret = ::SSL_do_handshake(m_ssl);
+    if (1 == ret) {
+        m_established = true;
+        m_wantWrite = false;
+        LOG_DBG_F(u8"TLS established (%s, kTLS send:%d recv:%d)",
+                  ::SSL_get_version(m_ssl), ktls_send(), ktls_recv());
+        return 1;
+    }
+
+    switch (::SSL_get_error(m_ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        m_wantWrite = false;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        m_wantWrite = true;
+        return 0;
+    default:
+        log_tls_error("TLS handshake");
+        return -1;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsSession::ktls_send() const
+{
+    return m_ssl && BIO_get_ktls_send(::SSL_get_wbio(m_ssl));
+}
+
+//------------------------------------------------------------------------------
+
+bool TlsSession::ktls_recv() const
+{
+    return m_ssl && BIO_get_ktls_recv(::SSL_get_rbio(m_ssl));
+}
+
+//------------------------------------------------------------------------------
+
+void TlsSession::shutdown()
+{
+    if (m_established) {
+        ::ERR_clear_error();
+        ::SSL_shutdown(m_ssl);
+        m_established = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+long TlsSession::recv(void* dest, size_t bytes)
+{
+    ::ERR_clear_error();
+    errno = 0;
+    int ret = ::SSL_read(m_ssl, dest, static_cast<int>(std::min(bytes, c_max_record)));
+    if (ret > 0) {
+        return ret;
+    }
+
+    switch (::SSL_get_error(m_ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (0 == errno) {
+            // closed without close_notify
+            return 0;
+        }
+        return -1;
+    default:
+        log_tls_error("SSL_read");
+        errno = EIO;
+        return -1;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+long TlsSession::send(void const* src, size_t bytes)
+{
+    // already sent by a repeated write
+    if (m_ahead > 0) {
+        size_t skip = std::min(m_ahead, bytes);
+        m_ahead -= skip;
+        return static_cast<long>(skip);
+    }
+
+    void const* data = src;
+    size_t size = std::min(bytes, c_max_record);
+    if (!m_retry.empty()) {
+        data = m_retry.data();
+        size = m_retry.size();
+    }
+
+    ::ERR_clear_error();
+    int ret = ::SSL_write(m_ssl, data, static_cast<int>(size));
+    if (ret > 0) {
+        m_retry.clear();
+        if (static_cast<size_t>(ret) > bytes) {
+            m_ahead = ret - bytes;
+            return static_cast<long>(bytes);
+        }
+        return ret;
+    }
+
+    switch (::SSL_get_error(m_ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        if (m_retry.empty()) {
+            m_retry.assign(reinterpret_cast<char const*>(src), size);
+        }
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        return -1;
+    default:
+        log_tls_error("SSL_write");
+        errno = EIO;
+        return -1;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+#else // NBBT_HAS_TLS
+
+TlsContext::TlsContext() : m_ctx(nullptr), m_server(false) {}
+TlsContext::~TlsContext() {}
+
+bool TlsContext::init(bool server)
+{
+    (void)server;
+    LOG_ERR(u8"Built without TLS support");
+    return false;
+}
+
+bool TlsContext::init_server(char const*, char const*) { return init(true); }
+bool TlsContext::init_server_self_signed(char const*) { return init(true); }
+bool TlsContext::init_client(char const*) { return init(false); }
+bool TlsContext::trust(std::string const&) { return false; }
+void TlsContext::set_ktls(bool) {}
+
+TlsSession::TlsSession(TlsContext&, socket_t, char const*)
+    : m_ssl(nullptr), m_established(false), m_wantWrite(false), m_ahead(0) {}
+TlsSession::~TlsSession() {}
+
+int TlsSession::handshake() { return -1; }
+bool TlsSession::ktls_send() const { return false; }
+bool TlsSession::ktls_recv() const { return false; }
+void TlsSession::shutdown() {}
+long TlsSession::recv(void*, size_t) { errno = EIO; return -1; }
+long TlsSession::send(void const*, size_t) { errno = EIO; return -1; }
+
+#endif // NBBT_HAS_TLS
+
+//------------------------------------------------------------------------------
+
+} // namespace nbbt
@@ -22,7 +22,7 @@
  * SOFTWARE.
  */
 
-#include "nbbt/win32_utf8.h"
+#include "win32_utf8.h"
 
 //------------------------------------------------------------------------------
 
@@ -26,25 +26,34 @@
 
 #include "nbbt/Server.h"
 #include "nbbt/Client.h"
+#include "nbbt/capture.h"
+#include "nbbt/histogram.h"
+#include "nbbt/metrics.h"
 
+#include <chrono>
 #include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 struct MyServer : public nbbt::Server
 {
-    void onConnected(Client* client) override
+    void onConnected(nbbt::client_t client) override
     {
         (void)client;
     }
 
-    void onDisconnected(Client* client) override
+    void onDisconnected(nbbt::client_t client) override
     {
         (void)client;
     }
 
-    void onReadyRead(Client* client) override
+    void onReadyRead(nbbt::client_t client) override
     {
         std::string msg;
-        if (client->rbuffer.get_string(msg, true)) {
+        if (get_string(client, msg, true)) {
             EXPECT_EQ(msg, std::string("Hello, World!"));
             stop = true;
         }
@@ -80,9 +89,607 @@ void client_thread() {
 TEST(Server, SingleClient)
 {
     MyServer server;
-    EXPECT_TRUE(server.init(55555, AF_INET, 32));
+    EXPECT_TRUE(server.init(55555, AF_INET));
     std::thread tserver = std::thread(&server_thread, &server);
     std::thread tclient = std::thread(&client_thread);
     tserver.join();
     tclient.join();
+
+    nbbt::LoopLatency latency;
+    server.latency(latency);
+    EXPECT_GT(latency.wait.count(), 0u);
+    EXPECT_GT(latency.callback.count(), 0u);
+}
+
+struct AsyncClient : public MyClient
+{
+    void onConnected() override
+    {
+        connected = true;
+    }
+
+    bool connected = false;
+};
+
+TEST(Client, ConnectAsync)
+{
+    MyServer server;
+    EXPECT_TRUE(server.init(55573, AF_INET));
+
+    nbbt::Resolver resolver;
+    nbbt::Resolver other;
+    AsyncClient client;
+    EXPECT_TRUE(client.set_resolver(&resolver));
+
+    // the lookup is waited for in run(), the resolver cannot change meanwhile
+    EXPECT_TRUE(client.connect_async("localhost", 55573));
+    EXPECT_FALSE(client.connected);
+    EXPECT_FALSE(client.set_resolver(&other));
+
+    for (int i = 0; i < 100 && !client.connected; ++i) {
+        client.run();
+    }
+    EXPECT_TRUE(client.connected);
+    EXPECT_TRUE(client.set_resolver(&other));
+}
+
+TEST(Server, Timer)
+{
+    MyServer server;
+    EXPECT_TRUE(server.init(55556, AF_INET));
+
+    int fired = 0;
+    server.start_timer(10, [&fired]() { fired += 1; });
+    int stopped = server.start_timer(10, [&fired]() { fired += 2; });
+    server.stop_timer(stopped);
+
+    while (0 == fired) {
+        EXPECT_TRUE(server.run(500));
+    }
+    EXPECT_EQ(fired, 1);
+}
+
+struct HandoffServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t client) override
+    {
+        last = client;
+        connected++;
+    }
+
+    void onDisconnected(nbbt::client_t client) override
+    {
+        (void)client;
+        disconnected++;
+    }
+
+    void onReadyRead(nbbt::client_t client) override
+    {
+        (void)client;
+        readyRead++;
+    }
+
+    nbbt::client_t last = 0;
+    int connected = 0;
+    int disconnected = 0;
+    int readyRead = 0;
+};
+
+static int connect_loopback(uint16_t port)
+{
+    int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (-1 == ::connect(sock, (struct sockaddr*)&address, sizeof(address))) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+TEST(Server, Handoff)
+{
+    char const* path = "/tmp/nbbt-test-handoff.sock";
+
+    HandoffServer old;
+    EXPECT_TRUE(old.init(55558, AF_INET));
+    EXPECT_TRUE(old.init_handoff(path));
+
+    int client = connect_loopback(55558);
+    ASSERT_NE(client, -1);
+    EXPECT_EQ(::send(client, "abc", 3, 0), 3);
+    while (old.connections() == 0 || old.available(old.last) < 3) {
+        EXPECT_TRUE(old.run(100));
+    }
+
+    HandoffServer server;
+    bool taken = false;
+    std::thread takeover([&]() { taken = server.takeover(path); });
+    while (old.listening()) {
+        EXPECT_TRUE(old.run(100));
+    }
+    takeover.join();
+
+    EXPECT_TRUE(taken);
+    EXPECT_EQ(old.connections(), 0u);
+    EXPECT_EQ(old.disconnected, 1);
+    EXPECT_TRUE(server.listening());
+    EXPECT_EQ(server.connections(), 1u);
+    EXPECT_EQ(server.connected, 1);
+    EXPECT_EQ(server.readyRead, 1);
+
+    // buffered data and the connection itself survive the handoff
+    EXPECT_EQ(::send(client, "def", 3, 0), 3);
+    while (server.available(server.last) < 6) {
+        EXPECT_TRUE(server.run(100));
+    }
+    unsigned char data[6];
+    EXPECT_TRUE(server.memcpy(server.last, data, sizeof(data)));
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(data), sizeof(data)), "abcdef");
+
+    // the listening socket is served by the new server
+    int second = connect_loopback(55558);
+    ASSERT_NE(second, -1);
+    while (server.connections() < 2) {
+        EXPECT_TRUE(server.run(100));
+    }
+
+    ::close(second);
+    ::close(client);
+}
+
+TEST(Server, RateLimit)
+{
+    HandoffServer server;
+    EXPECT_TRUE(server.init(55562, AF_INET));
+
+    int client = connect_loopback(55562);
+    ASSERT_NE(client, -1);
+    while (server.connections() == 0) {
+        EXPECT_TRUE(server.run(100));
+    }
+
+    // 256 KiB/s, the first 16 KiB are sent immediately
+    EXPECT_TRUE(server.set_rate_limit(server.last, 256 << 10, 16 << 10));
+    std::vector<unsigned char> data(64 << 10, 'x');
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(server.send(server.last, data.data(), data.size()));
+
+    size_t received = 0;
+    while (received < data.size()) {
+        EXPECT_TRUE(server.run(100));
+        char buffer[16384];
+        ssize_t ret = ::recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (ret > 0) {
+            received += static_cast<size_t>(ret);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_GE(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), 150);
+
+    nbbt::ConnectionStats stats;
+    EXPECT_TRUE(server.stats(server.last, stats));
+    EXPECT_GT(stats.throttled, 100000000u);
+    EXPECT_EQ(stats.wbuffered, 0u);
+
+    ::close(client);
+}
+
+TEST(Server, IdleRelease)
+{
+    HandoffServer server;
+    EXPECT_TRUE(server.init(55563, AF_INET));
+    server.set_idle_release(20);
+
+    int client = connect_loopback(55563);
+    ASSERT_NE(client, -1);
+
+    // tiny messages stay in the inline segment
+    EXPECT_EQ(::send(client, "abc", 3, 0), 3);
+    while (server.connections() == 0 || server.available(server.last) < 3) {
+        EXPECT_TRUE(server.run(100));
+    }
+    nbbt::ConnectionStats stats;
+    EXPECT_TRUE(server.stats(server.last, stats));
+    EXPECT_EQ(stats.rcapacity, 0u);
+
+    std::vector<char> data(32 << 10, 'x');
+    EXPECT_EQ(::send(client, data.data(), data.size(), 0), static_cast<ssize_t>(data.size()));
+    while (server.available(server.last) < data.size() + 3) {
+        EXPECT_TRUE(server.run(100));
+    }
+    server.remove(server.last, data.size());
+    EXPECT_TRUE(server.stats(server.last, stats));
+    EXPECT_GT(stats.rcapacity, 0u);
+
+    // idle for at least two sweeps
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(60)) {
+        EXPECT_TRUE(server.run(10));
+    }
+    EXPECT_TRUE(server.stats(server.last, stats));
+    EXPECT_EQ(stats.rcapacity, 0u);
+    EXPECT_EQ(stats.rbuffered, 3u);
+
+    ::close(client);
+}
+
+struct LimitedServer : public HandoffServer
+{
+    void onRejected(nbbt::socket_t socket) override
+    {
+        EXPECT_EQ(::send(socket, "busy", 4, 0), 4);
+        rejected++;
+    }
+
+    int rejected = 0;
+};
+
+TEST(Server, MaxConnections)
+{
+    LimitedServer server;
+    EXPECT_TRUE(server.init(55564, AF_INET));
+    server.set_max_connections(1);
+
+    int first = connect_loopback(55564);
+    int second = connect_loopback(55564);
+    ASSERT_NE(first, -1);
+    ASSERT_NE(second, -1);
+
+    // the second connection waits in the backlog
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_TRUE(server.run(10));
+    }
+    EXPECT_EQ(server.connected, 1);
+
+    ::close(first);
+    while (server.connected < 2) {
+        EXPECT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(server.disconnected, 1);
+
+    // over the limit, shed instead of waiting
+    server.set_max_connections(1, true);
+    int third = connect_loopback(55564);
+    ASSERT_NE(third, -1);
+    while (server.rejected == 0) {
+        EXPECT_TRUE(server.run(100));
+    }
+    char reply[8];
+    EXPECT_EQ(::recv(third, reply, sizeof(reply), 0), 4);
+    EXPECT_EQ(::recv(third, reply, sizeof(reply), 0), 0);
+    EXPECT_EQ(server.connections(), 1u);
+
+    ::close(third);
+    ::close(second);
+}
+
+TEST(Server, Capture)
+{
+    char const* path = "/tmp/nbbt-test-capture.cap";
+    ::unlink(path);
+
+    nbbt::CaptureWriter capture;
+    ASSERT_TRUE(capture.open(path));
+    int other = -1;
+    {
+        HandoffServer server;
+        EXPECT_TRUE(server.init(55565, AF_INET));
+        server.set_capture(&capture);
+
+        int client = connect_loopback(55565);
+        ASSERT_NE(client, -1);
+        EXPECT_EQ(::send(client, "ping", 4, 0), 4);
+        while (server.connections() == 0 || server.available(server.last) < 4) {
+            EXPECT_TRUE(server.run(100));
+        }
+        EXPECT_TRUE(server.send(server.last, reinterpret_cast<unsigned char const*>("pong!"), 5));
+        char reply[8];
+        EXPECT_EQ(::recv(client, reply, sizeof(reply), 0), 5);
+
+        ::close(client);
+        while (server.disconnected == 0) {
+            EXPECT_TRUE(server.run(100));
+        }
+
+        // still open when the server goes away
+        client = connect_loopback(55565);
+        ASSERT_NE(client, -1);
+        while (server.connections() == 0) {
+            EXPECT_TRUE(server.run(100));
+        }
+        other = client;
+    }
+    capture.close();
+    ::close(other);
+
+    nbbt::CaptureReader reader;
+    ASSERT_TRUE(reader.open(path));
+    std::vector<nbbt::CaptureRecord> records;
+    nbbt::CaptureRecord record;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    ASSERT_EQ(records.size(), 6u);
+    EXPECT_EQ(records[0].type, nbbt::CAPTURE_OPEN);
+    EXPECT_EQ(records[1].type, nbbt::CAPTURE_IN);
+    EXPECT_EQ(std::string(records[1].data.begin(), records[1].data.end()), "ping");
+    EXPECT_EQ(records[2].type, nbbt::CAPTURE_OUT);
+    EXPECT_EQ(std::string(records[2].data.begin(), records[2].data.end()), "pong!");
+    EXPECT_EQ(records[3].type, nbbt::CAPTURE_CLOSE);
+    EXPECT_LE(records[0].time, records[3].time);
+    EXPECT_EQ(records[4].type, nbbt::CAPTURE_OPEN);
+    EXPECT_EQ(records[5].type, nbbt::CAPTURE_CLOSE);
+    EXPECT_EQ(records[5].connection, records[4].connection);
+
+    ::unlink(path);
+}
+
+TEST(Server, RxTimestamps)
+{
+    HandoffServer server;
+    EXPECT_TRUE(server.init(55566, AF_INET));
+    server.set_rx_timestamps(true);
+
+    int client = connect_loopback(55566);
+    ASSERT_NE(client, -1);
+    while (server.connections() == 0) {
+        EXPECT_TRUE(server.run(100));
+    }
+
+    // the kernel turns timestamping on asynchronously, wait until it stamps
+    uint64_t stamp = 0;
+    for (int i = 0; i < 1000 && 0 == stamp; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        EXPECT_EQ(::send(client, "x", 1, 0), 1);
+        while (server.available(server.last) < 1) {
+            EXPECT_TRUE(server.run(100));
+        }
+        server.read_buffer(server.last)->timestamp(0, stamp);
+        server.remove(server.last, 1);
+    }
+    ASSERT_NE(stamp, 0u);
+    nbbt::Histogram const* delay = server.rx_delay(server.last);
+    ASSERT_NE(delay, nullptr);
+    uint64_t reads = delay->count();
+
+    // the data waits in the socket while the loop is busy
+    EXPECT_EQ(::send(client, "abc", 3, 0), 3);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    while (server.available(server.last) < 3) {
+        EXPECT_TRUE(server.run(100));
+    }
+
+    EXPECT_EQ(delay->count(), reads + 1);
+    EXPECT_GE(delay->max(), 20000000u);
+
+    nbbt::LoopLatency latency;
+    server.latency(latency);
+    EXPECT_EQ(latency.rxqueue.count(), reads + 1);
+
+    // the timestamp belongs to the bytes of the read
+    EXPECT_TRUE(server.read_buffer(server.last)->timestamp(2, stamp));
+    EXPECT_FALSE(server.read_buffer(server.last)->timestamp(3, stamp));
+    server.remove(server.last, 3);
+    EXPECT_FALSE(server.read_buffer(server.last)->timestamp(0, stamp));
+
+    ::close(client);
+}
+
+struct RelayServer : public HandoffServer
+{
+    void onReadyRead(nbbt::client_t client) override
+    {
+        // the first line decides where the rest goes
+        std::string line;
+        if (relayed || !get_string(client, line, true)) {
+            return;
+        }
+
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(55570);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_TRUE(connect((struct sockaddr*)&address, sizeof(address), backend));
+        relayed = relay(client, backend);
+    }
+
+    nbbt::client_t backend = -1;
+    bool relayed = false;
+};
+
+// moves data from one non-blocking socket to another while running server
+static bool transfer(RelayServer& server, int from, int to, size_t bytes, bool check)
+{
+    std::vector<unsigned char> data(bytes), received(bytes);
+    for (size_t i = 0; i < bytes; ++i) {
+        data[i] = static_cast<unsigned char>(i * 7 + i / 1000);
+    }
+
+    size_t sent = 0, got = 0;
+    for (int i = 0; i < 100000 && got < bytes; ++i) {
+        ssize_t ret = ::send(from, &data[sent], bytes - sent, 0);
+        sent += ret > 0 ? static_cast<size_t>(ret) : 0;
+        server.run(0);
+        ret = ::recv(to, &received[got], bytes - got, 0);
+        got += ret > 0 ? static_cast<size_t>(ret) : 0;
+    }
+    return got == bytes && (!check || data == received);
+}
+
+TEST(Server, Relay)
+{
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(55570);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(::bind(listener, (struct sockaddr*)&address, sizeof(address)), 0);
+    ASSERT_EQ(::listen(listener, 1), 0);
+
+    RelayServer server;
+    EXPECT_TRUE(server.init(55571, AF_INET));
+
+    int client = connect_loopback(55571);
+    ASSERT_NE(client, -1);
+    ::fcntl(client, F_SETFL, O_NONBLOCK);
+
+    // the bytes after the line are copied, the rest is spliced
+    std::string hello("backend\0early", 13);
+    EXPECT_EQ(::send(client, hello.data(), hello.size(), 0), 13);
+    while (!server.relayed) {
+        EXPECT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(server.connections(), 2u);
+
+    // relayed data would bypass a rate limit
+    EXPECT_FALSE(server.set_rate_limit(server.last, 1 << 20, 1 << 20));
+    EXPECT_TRUE(server.set_rate_limit(server.last, 0, 0));
+
+    int backend = ::accept(listener, nullptr, nullptr);
+    ASSERT_NE(backend, -1);
+    ::fcntl(backend, F_SETFL, O_NONBLOCK);
+
+    char early[5];
+    for (int i = 0; i < 1000 && ::recv(backend, early, 5, MSG_PEEK) < 5; ++i) {
+        server.run(1);
+    }
+    EXPECT_EQ(::recv(backend, early, 5, 0), 5);
+    EXPECT_EQ(std::string(early, 5), "early");
+
+    nbbt::MetricsSnapshot before;
+    nbbt::metrics_snapshot(before);
+    EXPECT_TRUE(transfer(server, client, backend, 4 << 20, true));
+    EXPECT_TRUE(transfer(server, backend, client, 1 << 20, true));
+    nbbt::MetricsSnapshot after;
+    nbbt::metrics_snapshot(after);
+    EXPECT_EQ(after.values[nbbt::METRIC_RELAYED_BYTES] - before.values[nbbt::METRIC_RELAYED_BYTES], 5 << 20);
+
+    // a backend that does not read stops the client, nothing is buffered
+    std::vector<unsigned char> data(64 << 10);
+    size_t sent = 0;
+    for (int i = 0; i < 1000; ++i) {
+        ssize_t ret = ::send(client, data.data(), data.size(), 0);
+        sent += ret > 0 ? static_cast<size_t>(ret) : 0;
+        server.run(0);
+    }
+    EXPECT_EQ(::send(client, data.data(), data.size(), 0), -1);
+    EXPECT_EQ(errno, EAGAIN);
+    EXPECT_LT(sent, 64u << 20);
+    nbbt::ConnectionStats stats;
+    ASSERT_TRUE(server.stats(server.last, stats));
+    EXPECT_EQ(stats.rbuffered, 0u);
+    ASSERT_TRUE(server.stats(server.backend, stats));
+    EXPECT_EQ(stats.wbuffered, 0u);
+
+    // the backend catches up
+    size_t received = 0;
+    for (int i = 0; i < 100000 && received < sent; ++i) {
+        ssize_t ret = ::recv(backend, data.data(), data.size(), 0);
+        received += ret > 0 ? static_cast<size_t>(ret) : 0;
+        server.run(0);
+    }
+    EXPECT_EQ(received, sent);
+
+    // closing one side closes the other
+    ::close(client);
+    while (server.connections() > 0) {
+        EXPECT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(server.disconnected, 2);
+    EXPECT_EQ(::recv(backend, data.data(), data.size(), 0), 0);
+
+    ::close(backend);
+    ::close(listener);
+}
+
+static size_t open_fds()
+{
+    size_t fds = 0;
+    DIR* dir = ::opendir("/proc/self/fd");
+    while (dir && ::readdir(dir)) {
+        ++fds;
+    }
+    if (dir) {
+        ::closedir(dir);
+    }
+    return fds;
+}
+
+TEST(Server, RelayShutdown)
+{
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(55570);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(::bind(listener, (struct sockaddr*)&address, sizeof(address)), 0);
+    ASSERT_EQ(::listen(listener, 1), 0);
+
+    // the pipes of a relay still paired are closed with the server
+    int client = -1;
+    size_t fds = open_fds();
+    {
+        RelayServer server;
+        EXPECT_TRUE(server.init(55571, AF_INET));
+
+        client = connect_loopback(55571);
+        ASSERT_NE(client, -1);
+        EXPECT_EQ(::send(client, "backend", 8, 0), 8);
+        while (!server.relayed) {
+            EXPECT_TRUE(server.run(100));
+        }
+    }
+    EXPECT_EQ(open_fds(), fds + 1);
+
+    ::close(client);
+    ::close(listener);
+}
+
+TEST(Server, WriteLanes)
+{
+    HandoffServer server;
+    EXPECT_TRUE(server.init(55572, AF_INET));
+
+    int client = connect_loopback(55572);
+    ASSERT_NE(client, -1);
+    while (server.connections() == 0) {
+        EXPECT_TRUE(server.run(100));
+    }
+
+    // a bulk transfer fills the socket, the rest waits in the write buffer
+    std::vector<unsigned char> bulk(64 << 10, 'b');
+    for (int i = 0; i < 64; ++i) {
+        EXPECT_TRUE(server.send(server.last, bulk.data(), bulk.size()));
+    }
+    nbbt::ConnectionStats stats;
+    ASSERT_TRUE(server.stats(server.last, stats));
+    EXPECT_GT(stats.wbuffered, 0u);
+
+    // the heartbeat overtakes the queued messages, but none is split
+    unsigned char const heartbeat[] = "PING";
+    EXPECT_TRUE(server.send(server.last, 2, heartbeat, 4));
+    EXPECT_FALSE(server.send(server.last, nbbt::c_write_lanes, heartbeat, 4));
+
+    std::vector<unsigned char> received;
+    std::vector<unsigned char> data(64 << 10);
+    while (received.size() < 64 * bulk.size() + 4) {
+        ssize_t ret = ::recv(client, data.data(), data.size(), 0);
+        ASSERT_GT(ret, 0);
+        received.insert(received.end(), data.begin(), data.begin() + ret);
+        EXPECT_TRUE(server.run(0));
+    }
+
+    size_t ping = std::string(received.begin(), received.end()).find("PING");
+    ASSERT_NE(ping, std::string::npos);
+    EXPECT_EQ(ping % bulk.size(), 0u);
+    EXPECT_LT(ping, 63 * bulk.size());
+
+    ::close(client);
 }
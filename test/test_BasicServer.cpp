@@ -0,0 +1,240 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/BasicServer.h"
+#include "nbbt/metrics.h"
+
+#include <cstring>
+#include <string>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+struct EchoTraits : public nbbt::ServerTraits
+{
+    typedef nbbt::LengthPrefixFraming framing;
+    static bool const coalesce = true;
+};
+
+struct EchoServer : public nbbt::BasicServer<EchoServer, EchoTraits>
+{
+    void onConnected(nbbt::client_t client)
+    {
+        last = client;
+    }
+
+    void onDisconnected(nbbt::client_t client)
+    {
+        (void)client;
+    }
+
+    void onMessage(nbbt::client_t client, nbbt::Buffer& buffer, size_t bytes)
+    {
+        unsigned char message[64];
+        ASSERT_LE(bytes + 4, sizeof(message));
+        message[0] = message[1] = message[2] = 0;
+        message[3] = static_cast<unsigned char>(bytes);
+        buffer.memcpy(message + 4, bytes);
+        send(client, message, bytes + 4);
+        messages++;
+    }
+
+    nbbt::client_t last = -1;
+    int messages = 0;
+};
+
+TEST(BasicServer, FramingAndCoalescing)
+{
+    EchoServer server;
+    ASSERT_TRUE(server.init("/tmp/nbbt-test-basic.sock"));
+
+    int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    ::strcpy(address.sun_path, "/tmp/nbbt-test-basic.sock");
+    ASSERT_EQ(::connect(sock, (struct sockaddr*)&address, sizeof(address)), 0);
+
+    while (server.last == -1) {
+        ASSERT_TRUE(server.run(100));
+    }
+
+    // three messages, the last one split
+    unsigned char const frames[] = "\0\0\0\3one\0\0\0\3two\0\0\0\5three";
+    size_t const size = sizeof(frames) - 1;
+    ASSERT_EQ(::write(sock, frames, size - 3), static_cast<ssize_t>(size - 3));
+
+    nbbt::MetricsSnapshot before;
+    nbbt::metrics_snapshot(before);
+    while (server.messages < 2) {
+        ASSERT_TRUE(server.run(100));
+    }
+
+    ASSERT_EQ(::write(sock, frames + size - 3, 3), 3);
+    while (server.messages < 3) {
+        ASSERT_TRUE(server.run(100));
+    }
+    nbbt::MetricsSnapshot after;
+    nbbt::metrics_snapshot(after);
+
+    // one ::send() per iteration of the event loop
+    EXPECT_EQ(after.values[nbbt::METRIC_SEND_CALLS] - before.values[nbbt::METRIC_SEND_CALLS], 2);
+
+    unsigned char echo[size];
+    size_t received = 0;
+    while (received < size) {
+        ssize_t ret = ::read(sock, echo + received, size - received);
+        ASSERT_GT(ret, 0);
+        received += ret;
+    }
+    EXPECT_EQ(::memcmp(echo, frames, size), 0);
+
+    ::close(sock);
+}
+
+struct SmallTraits : public nbbt::ServerTraits
+{
+    typedef nbbt::LengthPrefixFraming framing;
+    static size_t const max_message = 16;
+};
+
+struct RelayingServer : public nbbt::BasicServer<RelayingServer, SmallTraits>
+{
+    void onConnected(nbbt::client_t client)
+    {
+        clients.push_back(client);
+    }
+
+    void onDisconnected(nbbt::client_t client)
+    {
+        disconnected.push_back(client);
+    }
+
+    void onMessage(nbbt::client_t client, nbbt::Buffer& buffer, size_t bytes)
+    {
+        (void)buffer;
+        (void)bytes;
+        messages++;
+        relayed = relay(client, clients.back());
+    }
+
+    std::vector<nbbt::client_t> clients;
+    std::vector<nbbt::client_t> disconnected;
+    int messages = 0;
+    bool relayed = false;
+};
+
+static int connect_unix(char const* path)
+{
+    int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    ::strcpy(address.sun_path, path);
+    if (-1 == ::connect(sock, (struct sockaddr*)&address, sizeof(address))) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+TEST(BasicServer, RelayFromMessage)
+{
+    RelayingServer server;
+    ASSERT_TRUE(server.init("/tmp/nbbt-test-relay.sock"));
+
+    int a = connect_unix("/tmp/nbbt-test-relay.sock");
+    ASSERT_NE(a, -1);
+    while (server.clients.size() < 1) {
+        ASSERT_TRUE(server.run(100));
+    }
+    int b = connect_unix("/tmp/nbbt-test-relay.sock");
+    ASSERT_NE(b, -1);
+    while (server.clients.size() < 2) {
+        ASSERT_TRUE(server.run(100));
+    }
+
+    // the message is taken by the handler, the bytes after it are passed on
+    unsigned char const frames[] = "\0\0\0\4peertail";
+    ASSERT_EQ(::write(a, frames, 12), 12);
+    while (!server.relayed) {
+        ASSERT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(server.messages, 1);
+
+    // the read buffer has not been consumed twice
+    nbbt::ConnectionStats stats;
+    ASSERT_TRUE(server.stats(server.clients[0], stats));
+    EXPECT_EQ(stats.rbuffered, 0u);
+
+    char received[4];
+    for (int i = 0; i < 1000 && ::recv(b, received, 4, MSG_PEEK | MSG_DONTWAIT) < 4; ++i) {
+        server.run(1);
+    }
+    ASSERT_EQ(::recv(b, received, 4, MSG_DONTWAIT), 4);
+    EXPECT_EQ(std::string(received, 4), "tail");
+
+    ASSERT_EQ(::write(a, "more", 4), 4);
+    for (int i = 0; i < 1000 && ::recv(b, received, 4, MSG_PEEK | MSG_DONTWAIT) < 4; ++i) {
+        server.run(1);
+    }
+    ASSERT_EQ(::recv(b, received, 4, MSG_DONTWAIT), 4);
+    EXPECT_EQ(std::string(received, 4), "more");
+    EXPECT_EQ(::recv(b, received, 4, MSG_DONTWAIT), -1);
+
+    ASSERT_EQ(::write(b, "back", 4), 4);
+    for (int i = 0; i < 1000 && ::recv(a, received, 4, MSG_PEEK | MSG_DONTWAIT) < 4; ++i) {
+        server.run(1);
+    }
+    ASSERT_EQ(::recv(a, received, 4, MSG_DONTWAIT), 4);
+    EXPECT_EQ(std::string(received, 4), "back");
+
+    ::close(a);
+    ::close(b);
+}
+
+TEST(BasicServer, MaxMessage)
+{
+    RelayingServer server;
+    ASSERT_TRUE(server.init("/tmp/nbbt-test-max.sock"));
+
+    int sock = connect_unix("/tmp/nbbt-test-max.sock");
+    ASSERT_NE(sock, -1);
+    while (server.clients.empty()) {
+        ASSERT_TRUE(server.run(100));
+    }
+
+    // the header announces more than SmallTraits::max_message
+    ASSERT_EQ(::write(sock, "\0\0\0\21", 4), 4);
+    while (server.disconnected.empty()) {
+        ASSERT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(server.disconnected[0], server.clients[0]);
+    EXPECT_EQ(server.messages, 0);
+
+    char byte;
+    EXPECT_EQ(::read(sock, &byte, 1), 0);
+
+    ::close(sock);
+}
@@ -0,0 +1,109 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Cursor.h"
+
+#include <string>
+
+TEST(Cursor, RoundTrip)
+{
+    // 16 byte chunks, most values span two chunks at some point
+    nbbt::Buffer buffer(INVALID_SOCKET, 4);
+    {
+        nbbt::WriteCursor cursor(buffer);
+        for (int i = 0; i < 20; ++i) {
+            cursor.write_be(uint32_t(0x01020304 + i));
+            cursor.write_le(int16_t(-i));
+            cursor.write_be(1.5 * i);
+            cursor.write_varint(uint64_t(1) << (3 * i));
+            cursor.write_svarint(-i * 1000);
+            cursor.write_string(std::string(i, 'a'));
+        }
+        cursor.commit();
+        EXPECT_EQ(buffer.available(), cursor.written());
+    }
+
+    unsigned char const* first;
+    size_t bytes;
+    first = buffer.peek(0, bytes);
+    EXPECT_EQ(first[0], 0x01);
+    EXPECT_EQ(first[3], 0x04);
+
+    nbbt::ReadCursor cursor(buffer);
+    for (int i = 0; i < 20; ++i) {
+        uint32_t u32;
+        int16_t i16;
+        double d;
+        uint64_t varint;
+        int64_t svarint;
+        std::string string;
+        ASSERT_TRUE(cursor.read_be(u32));
+        ASSERT_TRUE(cursor.read_le(i16));
+        ASSERT_TRUE(cursor.read_be(d));
+        ASSERT_TRUE(cursor.read_varint(varint));
+        ASSERT_TRUE(cursor.read_svarint(svarint));
+        ASSERT_TRUE(cursor.read_string(string));
+        EXPECT_EQ(u32, uint32_t(0x01020304 + i));
+        EXPECT_EQ(i16, -i);
+        EXPECT_EQ(d, 1.5 * i);
+        EXPECT_EQ(varint, uint64_t(1) << (3 * i));
+        EXPECT_EQ(svarint, -i * 1000);
+        EXPECT_EQ(string, std::string(i, 'a'));
+    }
+    EXPECT_EQ(cursor.remaining(), 0u);
+    EXPECT_FALSE(cursor.error());
+}
+
+TEST(Cursor, Incomplete)
+{
+    nbbt::Buffer buffer(INVALID_SOCKET, 4);
+    {
+        nbbt::WriteCursor cursor(buffer);
+        cursor.write_be(uint16_t(7));
+        cursor.write_varint(300);
+        cursor.write_varint(5); // string length without the string
+        cursor.write_bytes(reinterpret_cast<unsigned char const*>("ab"), 2);
+    }
+
+    nbbt::ReadCursor cursor(buffer);
+    uint16_t u16;
+    uint64_t u64;
+    uint64_t varint;
+    std::string string;
+    EXPECT_TRUE(cursor.read_be(u16));
+    EXPECT_TRUE(cursor.read_varint(varint));
+    EXPECT_EQ(varint, 300u);
+
+    size_t offset = cursor.offset();
+    EXPECT_FALSE(cursor.read_string(string));
+    EXPECT_FALSE(cursor.read_be(u64));
+    EXPECT_EQ(cursor.offset(), offset);
+    EXPECT_FALSE(cursor.error());
+
+    // too long for the limit
+    EXPECT_FALSE(cursor.read_string(string, 4));
+    EXPECT_TRUE(cursor.error());
+}
@@ -0,0 +1,145 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/DatagramServer.h"
+#include "nbbt/Server.h"
+
+#include <netinet/udp.h>
+#include <unistd.h>
+
+#include <cstring>
+
+struct IdleServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t) override {}
+    void onDisconnected(nbbt::client_t) override {}
+    void onReadyRead(nbbt::client_t) override {}
+};
+
+struct EchoDatagrams : public nbbt::DatagramServer
+{
+    explicit EchoDatagrams(size_t batch) : DatagramServer(batch) {}
+
+    void onReceived(nbbt::Datagram const* datagrams, size_t count) override
+    {
+        batches++;
+        for (size_t i = 0; i < count; ++i) {
+            EXPECT_TRUE(send(datagrams[i], datagrams[i].data, datagrams[i].bytes));
+            received++;
+        }
+    }
+
+    int batches = 0;
+    int received = 0;
+};
+
+static int udp_socket(struct sockaddr_in& server, uint16_t port)
+{
+    int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    ::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct timeval timeout = { 5, 0 };
+    ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+TEST(DatagramServer, Batches)
+{
+    IdleServer server;
+    EchoDatagrams echo(8);
+    ASSERT_TRUE(echo.init(55560));
+    ASSERT_TRUE(echo.attach(server));
+
+    struct sockaddr_in address;
+    int sock = udp_socket(address, 55560);
+    for (int i = 0; i < 20; ++i) {
+        char message[16];
+        int bytes = ::snprintf(message, sizeof(message), "message %d", i);
+        ASSERT_EQ(::sendto(sock, message, bytes, 0, (struct sockaddr*)&address, sizeof(address)), bytes);
+    }
+
+    while (echo.received < 20) {
+        ASSERT_TRUE(server.run(100));
+    }
+    // 8 + 8 + 4
+    EXPECT_LE(echo.batches, 3);
+
+    for (int i = 0; i < 20; ++i) {
+        char expected[16];
+        char message[16];
+        int bytes = ::snprintf(expected, sizeof(expected), "message %d", i);
+        ASSERT_EQ(::recv(sock, message, sizeof(message), 0), bytes);
+        EXPECT_EQ(::memcmp(message, expected, bytes), 0);
+    }
+
+    ::close(sock);
+}
+
+TEST(DatagramServer, Offload)
+{
+    IdleServer server;
+    EchoDatagrams echo(8);
+    echo.set_offload(true, true);
+    ASSERT_TRUE(echo.init(55561));
+    ASSERT_TRUE(echo.attach(server));
+
+    // five datagrams of 100 bytes in one message
+    struct sockaddr_in address;
+    int sock = udp_socket(address, 55561);
+    unsigned char payload[500];
+    for (size_t i = 0; i < sizeof(payload); ++i) {
+        payload[i] = static_cast<unsigned char>(i / 100);
+    }
+
+    uint16_t segment = 100;
+    if (0 != ::setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment))) {
+        // no GSO, send them one by one
+        for (size_t i = 0; i < 5; ++i) {
+            ASSERT_EQ(::sendto(sock, payload + i * 100, 100, 0, (struct sockaddr*)&address, sizeof(address)), 100);
+        }
+    } else {
+        ASSERT_EQ(::sendto(sock, payload, sizeof(payload), 0, (struct sockaddr*)&address, sizeof(address)), 500);
+    }
+
+    while (echo.received < 5) {
+        ASSERT_TRUE(server.run(100));
+    }
+    EXPECT_EQ(echo.received, 5);
+
+    segment = 0;
+    ::setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+    for (unsigned char i = 0; i < 5; ++i) {
+        unsigned char message[200];
+        ASSERT_EQ(::recv(sock, message, sizeof(message), 0), 100);
+        EXPECT_EQ(message[0], i);
+        EXPECT_EQ(message[99], i);
+    }
+
+    ::close(sock);
+}
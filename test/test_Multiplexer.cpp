@@ -0,0 +1,132 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Multiplexer.h"
+
+#include <map>
+#include <string>
+
+TEST(Multiplexer, Streams)
+{
+    // Each side reads directly from the write buffer of the other.
+    nbbt::Buffer toServer;
+    nbbt::Buffer toClient;
+    nbbt::Multiplexer client(toServer, true, 64 << 10);
+    nbbt::Multiplexer server(toClient, false, 64 << 10);
+
+    std::map<uint32_t, std::string> received;
+    std::map<uint32_t, bool> closed;
+    std::string order;
+    server.set_accept([&](uint32_t stream) {
+        server.set_handler(stream, [&, stream](nbbt::Buffer& buffer, size_t bytes) {
+            if (bytes == 0) {
+                closed[stream] = true;
+                server.close(stream);
+                return;
+            }
+            std::string data(bytes, '\0');
+            buffer.memcpy(reinterpret_cast<unsigned char*>(&data[0]), bytes);
+            received[stream] += data;
+            order += std::to_string(stream);
+        });
+    });
+
+    bool clientClosed = false;
+    uint32_t bulk = client.open([](nbbt::Buffer&, size_t) {});
+    uint32_t small = client.open([&](nbbt::Buffer&, size_t bytes) {
+        clientClosed = bytes == 0;
+    });
+    EXPECT_EQ(bulk, 1u);
+    EXPECT_EQ(small, 3u);
+
+    std::string payload(1 << 20, '\0');
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = static_cast<char>(i * 7);
+    }
+    std::string message(40 << 10, 'm');
+
+    EXPECT_TRUE(client.send(bulk, reinterpret_cast<unsigned char const*>(payload.data()), payload.size()));
+    EXPECT_TRUE(client.send(small, reinterpret_cast<unsigned char const*>(message.data()), message.size()));
+    EXPECT_TRUE(client.close(bulk));
+    EXPECT_TRUE(client.close(small));
+    EXPECT_FALSE(client.send(small, reinterpret_cast<unsigned char const*>("x"), 1));
+    client.flush();
+
+    // Only the window of the bulk stream is written, the rest waits for grants.
+    EXPECT_EQ(client.queued(bulk), payload.size() - (64 << 10));
+    EXPECT_EQ(client.queued(small), 0u);
+
+    for (int i = 0; i < 1000 && client.streams() > 0; ++i) {
+        ASSERT_TRUE(server.process(toServer));
+        server.flush();
+        ASSERT_TRUE(client.process(toClient));
+        client.flush();
+    }
+
+    // Frames of both streams are interleaved.
+    EXPECT_EQ(order.substr(0, 4), "1313");
+    EXPECT_EQ(received[bulk], payload);
+    EXPECT_EQ(received[small], message);
+    EXPECT_TRUE(closed[bulk]);
+    EXPECT_TRUE(closed[small]);
+    EXPECT_TRUE(clientClosed);
+    EXPECT_EQ(client.streams(), 0u);
+    EXPECT_EQ(server.streams(), 0u);
+
+    // Streams of the wrong parity are a protocol error.
+    unsigned char frame[] = { 0, 0, 0, 0, 2, 0, 0, 0, 0 };
+    toServer.append(frame, sizeof(frame));
+    EXPECT_FALSE(server.process(toServer));
+}
+
+TEST(Multiplexer, HandlerTakesData)
+{
+    nbbt::Buffer toServer;
+    nbbt::Buffer toClient;
+    nbbt::Multiplexer client(toServer, true);
+    nbbt::Multiplexer server(toClient, false);
+
+    // The handler removes its payload itself, e.g. by parsing it with take.
+    std::string received;
+    server.set_accept([&](uint32_t stream) {
+        server.set_handler(stream, [&](nbbt::Buffer& buffer, size_t bytes) {
+            std::string data(bytes, '\0');
+            buffer.memcpy(reinterpret_cast<unsigned char*>(&data[0]), bytes);
+            buffer.remove(bytes);
+            received += data;
+        });
+    });
+
+    uint32_t stream = client.open([](nbbt::Buffer&, size_t) {});
+    EXPECT_TRUE(client.send(stream, reinterpret_cast<unsigned char const*>("one"), 3));
+    client.flush();
+    EXPECT_TRUE(client.send(stream, reinterpret_cast<unsigned char const*>("two"), 3));
+    client.flush();
+
+    ASSERT_TRUE(server.process(toServer));
+    EXPECT_EQ(received, "onetwo");
+    EXPECT_EQ(toServer.available(), 0u);
+}
@@ -0,0 +1,147 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Reader.h"
+
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct ReaderTest : public ::testing::Test
+{
+    void SetUp() override
+    {
+        ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+        buffer.set_socket(fds[0]);
+    }
+
+    void TearDown() override
+    {
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    void receive(char const* data)
+    {
+        ASSERT_EQ(::write(fds[1], data, strlen(data)), static_cast<ssize_t>(strlen(data)));
+        size_t read;
+        ASSERT_EQ(buffer.read(read), 1);
+    }
+
+    int fds[2];
+    nbbt::Buffer buffer;
+    nbbt::Reader reader;
+};
+
+TEST_F(ReaderTest, Chained)
+{
+    std::string line;
+    std::string body;
+
+    reader.read_until('\n', [&](nbbt::Buffer& b, size_t bytes) {
+        line.resize(bytes);
+        b.memcpy(reinterpret_cast<unsigned char*>(&line[0]), bytes);
+        reader.read_exact(4, [&](nbbt::Buffer& b, size_t bytes) {
+            body.resize(bytes);
+            b.memcpy(reinterpret_cast<unsigned char*>(&body[0]), bytes);
+        });
+    });
+
+    receive("HEL");
+    reader.process(buffer);
+    EXPECT_TRUE(line.empty());
+
+    receive("LO\nab");
+    reader.process(buffer);
+    EXPECT_EQ(line, "HELLO\n");
+    EXPECT_TRUE(body.empty());
+
+    receive("cdef");
+    reader.process(buffer);
+    EXPECT_EQ(body, "abcd");
+    EXPECT_FALSE(reader.pending());
+    EXPECT_EQ(buffer.available(), 2u);
+}
+
+TEST_F(ReaderTest, Find)
+{
+    receive("abc:def");
+
+    size_t offset;
+    EXPECT_TRUE(buffer.find(':', offset));
+    EXPECT_EQ(offset, 3u);
+    EXPECT_FALSE(buffer.find(':', offset, 4));
+
+    size_t bytes;
+    unsigned char const* data = buffer.peek(4, bytes);
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(bytes, 3u);
+    EXPECT_EQ(data[0], 'd');
+}
+
+TEST_F(ReaderTest, HandlerTakesData)
+{
+    std::string first;
+    std::string second;
+
+    // the first handler takes its line and the byte after it
+    reader.read_until('\n', [&](nbbt::Buffer& b, size_t bytes) {
+        first.resize(bytes + 1);
+        b.memcpy(reinterpret_cast<unsigned char*>(&first[0]), bytes + 1);
+        b.remove(bytes + 1);
+    });
+    reader.read_exact(2, [&](nbbt::Buffer& b, size_t bytes) {
+        second.resize(bytes);
+        b.memcpy(reinterpret_cast<unsigned char*>(&second[0]), bytes);
+    });
+
+    receive("one\nxyz");
+    reader.process(buffer);
+    EXPECT_EQ(first, "one\nx");
+    EXPECT_EQ(second, "yz");
+    EXPECT_EQ(buffer.available(), 0u);
+}
+
+TEST_F(ReaderTest, RemovedBetweenCalls)
+{
+    std::string line;
+    reader.read_until('\n', [&](nbbt::Buffer& b, size_t bytes) {
+        line.resize(bytes);
+        b.memcpy(reinterpret_cast<unsigned char*>(&line[0]), bytes);
+    });
+
+    receive("abcdef");
+    reader.process(buffer);
+    EXPECT_TRUE(line.empty());
+
+    // taken by someone else, the search starts over
+    buffer.remove(4);
+    receive("\n");
+    reader.process(buffer);
+    EXPECT_EQ(line, "ef\n");
+    EXPECT_EQ(buffer.available(), 0u);
+}
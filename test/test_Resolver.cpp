@@ -0,0 +1,97 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Resolver.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+static struct in_addr make_addr(char const* ip)
+{
+    struct in_addr address;
+    address.s_addr = ::inet_addr(ip);
+    return address;
+}
+
+TEST(Resolver, DottedAddress)
+{
+    nbbt::Resolver resolver;
+    struct in_addr address;
+    EXPECT_EQ(resolver.lookup_cached("10.1.2.3", address), 1);
+    EXPECT_EQ(address.s_addr, make_addr("10.1.2.3").s_addr);
+}
+
+TEST(Resolver, RotatesThroughRecords)
+{
+    nbbt::Resolver resolver;
+    resolver.insert("service.test", { make_addr("10.0.0.1"), make_addr("10.0.0.2") }, 60);
+
+    std::vector<struct in_addr> all;
+    EXPECT_TRUE(resolver.addresses("service.test", all));
+    EXPECT_EQ(all.size(), 2u);
+
+    struct in_addr address;
+    EXPECT_TRUE(resolver.lookup("service.test", address));
+    EXPECT_EQ(address.s_addr, make_addr("10.0.0.1").s_addr);
+    EXPECT_TRUE(resolver.lookup("service.test", address));
+    EXPECT_EQ(address.s_addr, make_addr("10.0.0.2").s_addr);
+    EXPECT_TRUE(resolver.lookup("service.test", address));
+    EXPECT_EQ(address.s_addr, make_addr("10.0.0.1").s_addr);
+}
+
+TEST(Resolver, Expires)
+{
+    nbbt::Resolver resolver;
+    resolver.insert("expired.test", { make_addr("10.0.0.1") }, 0);
+
+    struct in_addr address;
+    EXPECT_EQ(resolver.lookup_cached("expired.test", address), -1);
+
+    resolver.insert("failed.test", {}, 60);
+    EXPECT_EQ(resolver.lookup_cached("failed.test", address), 0);
+}
+
+TEST(Resolver, Async)
+{
+    nbbt::Resolver resolver;
+
+    int notify[2];
+    ASSERT_EQ(::pipe2(notify, O_NONBLOCK), 0);
+
+    struct in_addr address;
+    EXPECT_EQ(resolver.lookup_cached("localhost", address), -1);
+    resolver.resolve_async("localhost", notify[1]);
+
+    struct pollfd pfd = { notify[0], POLLIN, 0 };
+    EXPECT_EQ(::poll(&pfd, 1, 5000), 1);
+
+    EXPECT_EQ(resolver.lookup_cached("localhost", address), 1);
+    EXPECT_EQ(address.s_addr, make_addr("127.0.0.1").s_addr);
+
+    ::close(notify[0]);
+    ::close(notify[1]);
+}
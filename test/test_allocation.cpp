@@ -0,0 +1,206 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Server.h"
+#include "nbbt/allocation.h"
+#include "pool.h"
+
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The pools are checked in every build, the allocation counts only with
+// NBBT_ALLOCATION_AUDIT.
+
+static int connect_loopback(uint16_t port)
+{
+    int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (-1 == ::connect(sock, (struct sockaddr*)&address, sizeof(address))) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+struct PooledServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t client) override { last = client; }
+    void onDisconnected(nbbt::client_t client) override { (void)client; }
+    void onReadyRead(nbbt::client_t client) override { (void)client; }
+
+    nbbt::client_t last = 0;
+};
+
+TEST(Allocation, ClientPool)
+{
+    PooledServer server;
+    ASSERT_TRUE(server.init(55574, AF_INET));
+
+    // a new connection takes the memory of the closed one
+    nbbt::Buffer* previous = nullptr;
+    for (int i = 0; i < 2; ++i) {
+        int client = connect_loopback(55574);
+        ASSERT_NE(client, -1);
+        while (server.connections() == 0) {
+            ASSERT_TRUE(server.run(100));
+        }
+
+        nbbt::Buffer* buffer = server.read_buffer(server.last);
+        ASSERT_NE(buffer, nullptr);
+        if (previous) {
+            EXPECT_EQ(buffer, previous);
+        }
+        previous = buffer;
+
+        ::close(client);
+        while (server.connections() > 0) {
+            ASSERT_TRUE(server.run(100));
+        }
+    }
+}
+
+TEST(Allocation, PoolAllocator)
+{
+    // freed nodes are handed out again
+    nbbt::PoolMap<int, int> map;
+    map[1] = 1;
+    int const* node = &map[1];
+    map.erase(1);
+    map[2] = 2;
+    EXPECT_EQ(&map[2], node);
+}
+
+TEST(Allocation, EmptiedBufferStartsOver)
+{
+    // without starting over the second message would need another chunk
+    nbbt::Buffer buffer(INVALID_SOCKET, 8);
+    std::vector<unsigned char> data(200, 'x');
+    buffer.append(data.data(), data.size());
+    EXPECT_EQ(buffer.capacity(), 256u);
+    buffer.remove(data.size());
+    buffer.append(data.data(), data.size());
+    EXPECT_EQ(buffer.capacity(), 256u);
+}
+
+#ifdef NBBT_ALLOCATION_AUDIT
+
+struct AuditedEchoServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t client) override { last = client; }
+    void onDisconnected(nbbt::client_t client) override { (void)client; }
+
+    void onReadyRead(nbbt::client_t client) override
+    {
+        size_t bytes = std::min(available(client), sizeof(data));
+        memcpy(client, data, bytes);
+        remove(client, bytes);
+        send(client, data, bytes);
+        echoed += bytes;
+    }
+
+    nbbt::client_t last = 0;
+    unsigned char data[4096];
+    size_t echoed = 0;
+};
+
+static void echo(AuditedEchoServer& server, int client, size_t messages)
+{
+    unsigned char message[64] = { 'x' };
+    for (size_t i = 0; i < messages; ++i) {
+        size_t expected = server.echoed + sizeof(message);
+        ASSERT_EQ(::send(client, message, sizeof(message), 0), (ssize_t)sizeof(message));
+        while (server.echoed < expected) {
+            ASSERT_TRUE(server.run(100));
+        }
+        ASSERT_EQ(::recv(client, message, sizeof(message), MSG_WAITALL), (ssize_t)sizeof(message));
+    }
+}
+
+TEST(Allocation, SteadyStateEcho)
+{
+    ASSERT_TRUE(nbbt::allocation_audit_enabled());
+
+    AuditedEchoServer server;
+    ASSERT_TRUE(server.init(55567, AF_INET));
+
+    // the first connection and messages size the pools
+    int client = connect_loopback(55567);
+    ASSERT_NE(client, -1);
+    echo(server, client, 100);
+    ::close(client);
+    while (server.connections() > 0) {
+        ASSERT_TRUE(server.run(100));
+    }
+
+    client = connect_loopback(55567);
+    ASSERT_NE(client, -1);
+    echo(server, client, 100);
+
+    nbbt::AllocationStats before;
+    nbbt::allocation_stats(before);
+    echo(server, client, 10000);
+    nbbt::AllocationStats after;
+    nbbt::allocation_stats(after);
+
+    EXPECT_EQ(after.allocations - before.allocations, 0u);
+    EXPECT_EQ(after.deallocations - before.deallocations, 0u);
+
+    ::close(client);
+}
+
+TEST(Allocation, ConnectionChurn)
+{
+    AuditedEchoServer server;
+    ASSERT_TRUE(server.init(55568, AF_INET));
+
+    // closed connections leave their memory for the next ones
+    nbbt::AllocationStats before;
+    for (int round = 0; round < 2; ++round) {
+        nbbt::allocation_stats(before);
+        for (int i = 0; i < 100; ++i) {
+            int client = connect_loopback(55568);
+            ASSERT_NE(client, -1);
+            echo(server, client, 10);
+            ::close(client);
+            while (server.connections() > 0) {
+                ASSERT_TRUE(server.run(100));
+            }
+        }
+    }
+    nbbt::AllocationStats after;
+    nbbt::allocation_stats(after);
+
+    EXPECT_EQ(after.allocations - before.allocations, 0u);
+}
+
+#endif // NBBT_ALLOCATION_AUDIT
@@ -0,0 +1,85 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Buffer.h"
+#include "nbbt/compression.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef NBBT_HAS_ZLIB
+
+TEST(Compression, Deflate)
+{
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+    {
+        nbbt::CompressionOptions options;
+        options.algorithm = nbbt::COMPRESSION_DEFLATE;
+        nbbt::CompressionTransport sender(options, fds[1]);
+        nbbt::CompressionTransport receiver(options, fds[0]);
+
+        nbbt::Buffer wbuffer(fds[1]);
+        wbuffer.set_transport(&sender);
+        nbbt::Buffer rbuffer(fds[0]);
+        rbuffer.set_transport(&receiver);
+
+        // below the threshold, sent as raw frame
+        unsigned char const hello[] = "hello";
+        EXPECT_EQ(wbuffer.send(hello, sizeof(hello)), 1);
+        EXPECT_EQ(wbuffer.flush(), 1);
+        EXPECT_EQ(sender.bytes_out(), sizeof(hello) + 5);
+
+        std::vector<unsigned char> sent(1 << 20);
+        for (size_t i = 0; i < sent.size(); ++i) {
+            sent[i] = static_cast<unsigned char>("abcdefgh"[i % 8] + (i / 4096) % 3);
+        }
+        EXPECT_EQ(wbuffer.send(sent.data(), sent.size()), 1);
+
+        size_t read;
+        size_t expected = sizeof(hello) + sent.size();
+        while (rbuffer.available() < expected) {
+            ASSERT_EQ(wbuffer.flush(), 1);
+            ASSERT_EQ(rbuffer.read(read), 1);
+        }
+        EXPECT_FALSE(wbuffer.pending());
+        EXPECT_EQ(sender.bytes_in(), expected);
+        EXPECT_LT(sender.bytes_out(), sent.size() / 10);
+
+        std::vector<unsigned char> received(expected);
+        ASSERT_EQ(rbuffer.available(), expected);
+        rbuffer.memcpy(received.data(), received.size());
+        EXPECT_EQ(::memcmp(received.data(), hello, sizeof(hello)), 0);
+        EXPECT_EQ(::memcmp(received.data() + sizeof(hello), sent.data(), sent.size()), 0);
+    }
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+#endif // NBBT_HAS_ZLIB
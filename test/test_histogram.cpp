@@ -0,0 +1,72 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/histogram.h"
+
+TEST(Histogram, Buckets)
+{
+    for (uint64_t v : { 0ull, 1ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, 1ull << 40, ~0ull }) {
+        size_t bucket = nbbt::Histogram::bucket(v);
+        ASSERT_LT(bucket, nbbt::Histogram::c_buckets);
+        EXPECT_LE(nbbt::Histogram::bucket_lower(bucket), v);
+        if (bucket + 1 < nbbt::Histogram::c_buckets) {
+            EXPECT_GT(nbbt::Histogram::bucket_lower(bucket + 1), v);
+        }
+    }
+}
+
+TEST(Histogram, Percentiles)
+{
+    nbbt::Histogram histogram;
+    EXPECT_EQ(histogram.percentile(50.0), 0u);
+
+    for (uint64_t v = 1; v <= 10000; ++v) {
+        histogram.record(v);
+    }
+
+    EXPECT_EQ(histogram.count(), 10000u);
+    EXPECT_EQ(histogram.max(), 10000u);
+    EXPECT_NEAR(static_cast<double>(histogram.percentile(50.0)), 5000.0, 5000.0 / 16);
+    EXPECT_NEAR(static_cast<double>(histogram.percentile(99.0)), 9900.0, 9900.0 / 16);
+    EXPECT_EQ(histogram.percentile(100.0), 10000u);
+}
+
+TEST(Histogram, Merge)
+{
+    nbbt::Histogram a;
+    nbbt::Histogram b;
+    a.record(10);
+    b.record(1000);
+    b.record(1000);
+
+    nbbt::Histogram merged(a);
+    merged.merge(b);
+    EXPECT_EQ(merged.count(), 3u);
+    EXPECT_EQ(merged.sum(), 2010u);
+    EXPECT_EQ(merged.max(), 1000u);
+    EXPECT_EQ(merged.percentile(10.0), 10u);
+    EXPECT_EQ(a.count(), 1u);
+}
@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Points stdout at given descriptor until destroyed.
+struct StdoutRedirect
+{
+    explicit StdoutRedirect(int fd) : saved(::dup(STDOUT_FILENO))
+    {
+        fflush(stdout);
+        ::dup2(fd, STDOUT_FILENO);
+    }
+
+    ~StdoutRedirect()
+    {
+        fflush(stdout);
+        ::dup2(saved, STDOUT_FILENO);
+        ::close(saved);
+    }
+
+    int saved;
+};
+
+TEST(Log, Flush)
+{
+    char path[] = "/tmp/nbbt-test-log-XXXXXX";
+    int fd = ::mkstemp(path);
+    ASSERT_NE(fd, -1);
+    ::unlink(path);
+
+    nbbt::log_flush();
+    {
+        StdoutRedirect redirect(fd);
+        LOG_INFO_F("flushed %d", 42);
+        nbbt::log_flush();
+    }
+
+    std::string text(4096, '\0');
+    ssize_t ret = ::pread(fd, &text[0], text.size(), 0);
+    ASSERT_GT(ret, 0);
+    text.resize(ret);
+    EXPECT_NE(text.find("INFO: flushed 42\n"), std::string::npos);
+
+    ::close(fd);
+}
+
+TEST(Log, Dropped)
+{
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+
+    // nobody reads the pipe, so the background thread stalls once it is full
+    nbbt::log_flush();
+    uint64_t dropped = nbbt::log_dropped();
+    std::string message(200, 'x');
+    std::thread reader;
+    {
+        StdoutRedirect redirect(fds[1]);
+        for (int i = 0; i < 8 * 1024; ++i) {
+            LOG_INFO(message.c_str());
+        }
+        EXPECT_GT(nbbt::log_dropped(), dropped);
+
+        reader = std::thread([&fds] {
+            char buffer[4096];
+            while (::read(fds[0], buffer, sizeof(buffer)) > 0);
+        });
+        nbbt::log_flush();
+    }
+
+    // the reader sees the end once stdout is restored
+    ::close(fds[1]);
+    reader.join();
+    ::close(fds[0]);
+}
+
+TEST(Log, CompiledAway)
+{
+    // debug messages are not even evaluated at the default level
+    int evaluated = 0;
+    LOG_DBG((++evaluated, "debug"));
+    LOG_DBG_F("%d", ++evaluated);
+    EXPECT_EQ(evaluated, 0);
+    EXPECT_EQ(NBBT_LOG_LEVEL, 2);
+}
@@ -0,0 +1,125 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Buffer.h"
+#include "nbbt/Server.h"
+#include "nbbt/metrics.h"
+
+#include <atomic>
+#include <cstring>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+TEST(Metrics, Buffer)
+{
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+    nbbt::MetricsSnapshot before;
+    nbbt::metrics_snapshot(before);
+
+    {
+        nbbt::Buffer buffer(fds[0]);
+        ASSERT_EQ(::write(fds[1], "0123456789", 10), 10);
+
+        size_t read;
+        ASSERT_EQ(buffer.read(read), 1);
+
+        nbbt::MetricsSnapshot after;
+        nbbt::metrics_snapshot(after);
+        EXPECT_EQ(after.values[nbbt::METRIC_BYTES_IN] - before.values[nbbt::METRIC_BYTES_IN], 10);
+        EXPECT_EQ(after.values[nbbt::METRIC_EAGAIN] - before.values[nbbt::METRIC_EAGAIN], 1);
+        EXPECT_EQ(after.values[nbbt::METRIC_BUFFERED_BYTES] - before.values[nbbt::METRIC_BUFFERED_BYTES], 10);
+        EXPECT_EQ(after.values[nbbt::METRIC_BUFFER_MEMORY] - before.values[nbbt::METRIC_BUFFER_MEMORY],
+                  static_cast<int64_t>(buffer.capacity()));
+    }
+
+    // gauges return to their previous value
+    nbbt::MetricsSnapshot after;
+    nbbt::metrics_snapshot(after);
+    EXPECT_EQ(after.values[nbbt::METRIC_BUFFERED_BYTES], before.values[nbbt::METRIC_BUFFERED_BYTES]);
+    EXPECT_EQ(after.values[nbbt::METRIC_BUFFER_MEMORY], before.values[nbbt::METRIC_BUFFER_MEMORY]);
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+TEST(Metrics, ExitedThreads)
+{
+    nbbt::MetricsSnapshot before;
+    nbbt::metrics_snapshot(before);
+
+    std::thread([] { nbbt::metrics_add(nbbt::METRIC_ACCEPTS, 3); }).join();
+
+    nbbt::MetricsSnapshot after;
+    nbbt::metrics_snapshot(after);
+    EXPECT_EQ(after.values[nbbt::METRIC_ACCEPTS] - before.values[nbbt::METRIC_ACCEPTS], 3);
+}
+
+struct MetricsServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t) override {}
+    void onDisconnected(nbbt::client_t) override {}
+    void onReadyRead(nbbt::client_t) override {}
+};
+
+TEST(Metrics, AdminSocket)
+{
+    char const* path = "/tmp/nbbt-test-admin.sock";
+
+    MetricsServer server;
+    ASSERT_TRUE(server.init(55557, AF_INET));
+    ASSERT_TRUE(server.init_admin(path));
+
+    // text belongs to the reader until it has finished
+    std::string text;
+    std::atomic<bool> finished(false);
+    std::thread reader([path, &text, &finished] {
+        int s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un address;
+        ::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        ::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        EXPECT_EQ(::connect(s, (struct sockaddr*)&address, sizeof(address)), 0);
+
+        char buffer[1024];
+        ssize_t n;
+        while ((n = ::read(s, buffer, sizeof(buffer))) > 0) {
+            text.append(buffer, n);
+        }
+        ::close(s);
+        finished = true;
+    });
+
+    for (int i = 0; i < 10 && !finished; ++i) {
+        server.run(100);
+    }
+    reader.join();
+
+    EXPECT_NE(text.find("# TYPE nbbt_bytes_in_total counter"), std::string::npos);
+    EXPECT_NE(text.find("nbbt_connections "), std::string::npos);
+}
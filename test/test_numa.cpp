@@ -0,0 +1,76 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Buffer.h"
+#include "nbbt/numa.h"
+
+#include <thread>
+#include <vector>
+
+TEST(Numa, Allocator)
+{
+    // keep the affinity of the main thread
+    std::thread pinned([]() { EXPECT_TRUE(nbbt::thread_set_affinity(std::vector<int>(1, 0))); });
+    pinned.join();
+    EXPECT_GE(nbbt::cpu_node(0), 0);
+
+    nbbt::NodeChunkAllocator allocator(nbbt::cpu_node(0), 1 << 16);
+    {
+        nbbt::Buffer buffer(INVALID_SOCKET, 12);
+        buffer.set_allocator(&allocator);
+
+        std::vector<unsigned char> data(40000, 'x');
+        buffer.append(data.data(), data.size());
+        EXPECT_EQ(allocator.used(), buffer.capacity());
+        EXPECT_EQ(allocator.reserved(), 1u << 16);
+
+        // released chunks are reused before a new slab is mapped
+        buffer.clear();
+        EXPECT_EQ(allocator.used(), 0u);
+        buffer.append(data.data(), data.size());
+        buffer.append(data.data(), data.size());
+        EXPECT_EQ(allocator.reserved(), 2u << 16);
+    }
+    EXPECT_EQ(allocator.used(), 0u);
+}
+
+TEST(Numa, HugePages)
+{
+    // with or without reserved huge pages, chunks have to be usable
+    nbbt::NodeChunkAllocator allocator(-1, 1 << 20, true);
+    nbbt::Buffer buffer(INVALID_SOCKET, 12);
+    buffer.set_allocator(&allocator);
+
+    std::vector<unsigned char> data(100000, 'x');
+    buffer.append(data.data(), data.size());
+    EXPECT_EQ(allocator.reserved(), 2u << 20);
+    EXPECT_LE(allocator.hugetlb() + allocator.transparent(), allocator.reserved());
+
+    std::vector<unsigned char> copy(data.size());
+    buffer.memcpy(copy.data(), copy.size());
+    EXPECT_TRUE(copy == data);
+    buffer.clear();
+}
@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Buffer.h"
+#include "nbbt/spill.h"
+
+#include <vector>
+
+TEST(Spill, Buffer)
+{
+    nbbt::SpillFile spill;
+    ASSERT_TRUE(spill.open("/tmp", 4096, 64 << 20));
+
+    nbbt::Buffer buffer(INVALID_SOCKET, 12);
+    EXPECT_FALSE(nbbt::Buffer(INVALID_SOCKET, 10).set_spill(&spill, 16 << 10));
+    ASSERT_TRUE(buffer.set_spill(&spill, 16 << 10));
+
+    std::vector<unsigned char> data(1 << 20);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<unsigned char>(i * 31 + i / 4096);
+    }
+    for (size_t i = 0; i < data.size(); i += 1000) {
+        buffer.append(&data[i], std::min<size_t>(1000, data.size() - i));
+    }
+
+    // at most the budget and the chunk being written stay in memory
+    EXPECT_EQ(buffer.available(), data.size());
+    EXPECT_EQ(buffer.spilled(), spill.used());
+    EXPECT_LE(buffer.capacity() - buffer.spilled(), (16 << 10) + 4096u);
+
+    // drain in odd pieces, spilled chunks are read back transparently
+    std::vector<unsigned char> received(data.size());
+    size_t offset = 0;
+    while (buffer.available() > 0) {
+        size_t bytes = std::min<size_t>(3000, buffer.available());
+        buffer.memcpy(&received[offset], bytes);
+        buffer.remove(bytes);
+        offset += bytes;
+    }
+    EXPECT_EQ(received, data);
+    EXPECT_EQ(spill.used(), 0u);
+    EXPECT_EQ(buffer.spilled(), 0u);
+
+    // a single large append is bounded as well
+    buffer.append(data.data(), data.size());
+    EXPECT_GT(spill.used(), 0u);
+    EXPECT_LE(buffer.capacity() - buffer.spilled(), (16 << 10) + 4096u);
+    buffer.clear();
+    EXPECT_EQ(spill.used(), 0u);
+}
@@ -0,0 +1,184 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Paul Wichern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "nbbt/Client.h"
+#include "nbbt/Server.h"
+#include "nbbt/tls.h"
+
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef NBBT_HAS_TLS
+
+TEST(Tls, PartialWrites)
+{
+    nbbt::TlsContext serverTls;
+    ASSERT_TRUE(serverTls.init_server_self_signed("localhost"));
+    nbbt::TlsContext clientTls;
+    ASSERT_TRUE(clientTls.init_client());
+    ASSERT_TRUE(clientTls.trust(serverTls.certificate()));
+
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+    {
+        nbbt::TlsSession server(serverTls, fds[0]);
+        nbbt::TlsSession client(clientTls, fds[1], "localhost");
+
+        int serverState = 0;
+        int clientState = 0;
+        while (serverState == 0 || clientState == 0) {
+            if (serverState == 0) {
+                serverState = server.handshake();
+            }
+            if (clientState == 0) {
+                clientState = client.handshake();
+            }
+        }
+        ASSERT_EQ(serverState, 1);
+        ASSERT_EQ(clientState, 1);
+
+        nbbt::Buffer rbuffer(fds[0]);
+        rbuffer.set_transport(&server);
+        nbbt::Buffer wbuffer(fds[1]);
+        wbuffer.set_transport(&client);
+
+        // more than the socket buffer holds, writes have to be repeated
+        std::vector<unsigned char> sent(1 << 20);
+        for (size_t i = 0; i < sent.size(); ++i) {
+            sent[i] = static_cast<unsigned char>(i * 7);
+        }
+        EXPECT_EQ(wbuffer.send(sent.data(), sent.size()), 1);
+
+        size_t read;
+        while (rbuffer.available() < sent.size()) {
+            ASSERT_EQ(wbuffer.flush(), 1);
+            ASSERT_EQ(rbuffer.read(read), 1);
+        }
+
+        std::vector<unsigned char> received(sent.size());
+        ASSERT_EQ(rbuffer.available(), sent.size());
+        rbuffer.memcpy(received.data(), received.size());
+        EXPECT_TRUE(received == sent);
+    }
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+struct TlsEchoServer : public nbbt::Server
+{
+    void onConnected(nbbt::client_t client) override
+    {
+        (void)client;
+        connected++;
+    }
+
+    void onDisconnected(nbbt::client_t client) override
+    {
+        (void)client;
+    }
+
+    void onReadyRead(nbbt::client_t client) override
+    {
+        std::vector<unsigned char> data(available(client));
+        memcpy(client, data.data(), data.size());
+        remove(client, data.size());
+        send(client, data.data(), data.size());
+    }
+
+    std::atomic<int> connected{0};
+    std::atomic<bool> stop{false};
+};
+
+struct TlsClient : public nbbt::Client
+{
+    void onDisconnected() override {}
+    void onReadyRead() override {}
+};
+
+class TlsTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(serverTls.init_server_self_signed("localhost"));
+        ASSERT_TRUE(server.set_tls(&serverTls));
+        ASSERT_TRUE(server.init(55559, AF_INET));
+        thread = std::thread([this]() { while (!server.stop && server.run(50)); });
+    }
+
+    void TearDown() override
+    {
+        server.stop = true;
+        thread.join();
+    }
+
+    nbbt::TlsContext serverTls;
+    TlsEchoServer server;
+    std::thread thread;
+};
+
+TEST_F(TlsTest, Echo)
+{
+    nbbt::TlsContext tls;
+    ASSERT_TRUE(tls.init_client());
+    ASSERT_TRUE(tls.trust(serverTls.certificate()));
+
+    TlsClient client;
+    ASSERT_TRUE(client.set_tls(&tls));
+    ASSERT_TRUE(client.connect("localhost", 55559));
+
+    // large enough to fill the socket buffers
+    std::vector<unsigned char> sent(4 << 20);
+    for (size_t i = 0; i < sent.size(); ++i) {
+        sent[i] = static_cast<unsigned char>(i * 7);
+    }
+    EXPECT_EQ(client.wbuffer.send(sent.data(), sent.size()), 1);
+
+    while (client.rbuffer.available() < sent.size() && client.run());
+
+    std::vector<unsigned char> received(sent.size());
+    ASSERT_EQ(client.rbuffer.available(), sent.size());
+    client.rbuffer.memcpy(received.data(), received.size());
+    EXPECT_TRUE(received == sent);
+    EXPECT_EQ(server.connected, 1);
+}
+
+TEST_F(TlsTest, Untrusted)
+{
+    nbbt::TlsContext tls;
+    ASSERT_TRUE(tls.init_client());
+
+    TlsClient client;
+    ASSERT_TRUE(client.set_tls(&tls));
+    EXPECT_FALSE(client.connect("localhost", 55559));
+    EXPECT_EQ(server.connected, 0);
+}
+
+#endif // NBBT_HAS_TLS